@@ -5,11 +5,15 @@ import sys
 import tempfile
 import os
 import errno
+import fnmatch
 import pytest
 import pathlib
 import platform
 import io
 import contextlib
+import struct
+import time
+import shutil
 
 import xattr
 from xattr import NS_USER, XATTR_CREATE, XATTR_REPLACE
@@ -419,6 +423,368 @@ def test_no_attributes(any_subject):
         xattr.get(item, USER_NN, nofollow=nofollow,
                   namespace=NAMESPACE)
 
+def test_get_default(any_subject):
+    item, nofollow = any_subject
+    sentinel = object()
+    assert xattr.get(item, USER_ATTR, nofollow=nofollow,
+                     default=None) is None
+    assert xattr.get(item, USER_NN, nofollow=nofollow, namespace=NAMESPACE,
+                     default=sentinel) is sentinel
+    if not nofollow:
+        xattr.set(item, USER_ATTR, USER_VAL)
+        assert xattr.get(item, USER_ATTR, default=None) == USER_VAL
+    # Other errors still raise
+    with pytest.raises(EnvironmentError):
+        xattr.get("/no/such/file", USER_ATTR, default=None)
+
+def test_has_sizes(any_subject):
+    item, nofollow = any_subject
+    assert not xattr.has(item, USER_ATTR, nofollow=nofollow)
+    assert not xattr.has(item, USER_NN, nofollow=nofollow,
+                         namespace=NAMESPACE)
+    assert xattr.sizes(item, nofollow=nofollow, namespace=NAMESPACE) == {}
+    if nofollow:
+        return
+    xattr.set(item, USER_ATTR, LARGE_VAL)
+    xattr.set(item, USER_ATTR + b".2", EMPTY_VAL)
+    assert xattr.has(item, USER_ATTR)
+    assert xattr.has(item, USER_NN, namespace=NAMESPACE)
+    assert xattr.has(item, USER_NN + b".2", namespace=NAMESPACE)
+    assert xattr.sizes(item, namespace=NAMESPACE) == {
+        USER_NN: len(LARGE_VAL), USER_NN + b".2": 0}
+    assert xattr.sizes(item)[USER_ATTR] == len(LARGE_VAL)
+    with pytest.raises(EnvironmentError):
+        xattr.has("/no/such/file", USER_ATTR)
+    with pytest.raises(EnvironmentError):
+        xattr.sizes("/no/such/file")
+
+@pytest.mark.parametrize("size", [0, 1, 1023, 1024, 1025, 2048])
+def test_get_value_sizes(subject, size):
+    item = subject[0]
+    value = bytes(range(256)) * (size // 256) + b"x" * (size % 256)
+    xattr.set(item, USER_ATTR, value)
+    assert xattr.get(item, USER_ATTR) == value
+    assert xattr.getxattr(item, USER_ATTR) == value
+    assert xattr.get_all(item, namespace=NAMESPACE) == [(USER_NN, value)]
+
+def test_typed_accessors(subject):
+    item = subject[0]
+    for value in [0, 1, 1767225600, 2**64 - 1]:
+        xattr.set_u64(item, USER_ATTR, value)
+        assert xattr.get(item, USER_ATTR) == value.to_bytes(8, "little")
+        assert xattr.get_u64(item, USER_ATTR) == value
+    xattr.set_u64(item, USER_NN, 5, namespace=NAMESPACE)
+    assert xattr.get_u64(item, USER_NN, namespace=NAMESPACE) == 5
+    with pytest.raises(IOError):
+        xattr.set_u64(item, USER_ATTR, 1, flags=XATTR_CREATE)
+    for bad in [-1, 2**64]:
+        with pytest.raises(OverflowError):
+            xattr.set_u64(item, USER_ATTR, bad)
+    with pytest.raises(TypeError):
+        xattr.set_u64(item, USER_ATTR, b"1")
+    for bad in [EMPTY_VAL, b"x" * 7, b"x" * 9]:
+        xattr.set(item, USER_ATTR, bad)
+        with pytest.raises(ValueError):
+            xattr.get_u64(item, USER_ATTR)
+
+    text = "h\u00e9llo"
+    xattr.set(item, USER_ATTR, text.encode())
+    assert xattr.get_str(item, USER_ATTR) == text
+    assert xattr.get_str(item, USER_NN, namespace=NAMESPACE) == text
+    assert xattr.get_str(item, USER_ATTR, encoding="latin-1") == \
+        text.encode().decode("latin-1")
+    xattr.set(item, USER_ATTR, b"\xff" + LARGE_VAL)
+    with pytest.raises(UnicodeDecodeError):
+        xattr.get_str(item, USER_ATTR)
+    assert xattr.get_str(item, USER_ATTR, errors="replace") == \
+        "\ufffd" + LARGE_VAL.decode()
+
+    packed = struct.pack("<IIQ", 1, 2, 3)
+    xattr.set(item, USER_ATTR, packed)
+    for fmt in ["<IIQ", b"<IIQ", struct.Struct("<IIQ")]:
+        assert xattr.get_struct(item, USER_ATTR, fmt) == (1, 2, 3)
+    assert xattr.get_struct(item, USER_NN, "<16s",
+                            namespace=NAMESPACE) == (packed,)
+    with pytest.raises(struct.error):
+        xattr.get_struct(item, USER_ATTR, "<Q")
+    with pytest.raises(IOError):
+        xattr.get_struct(item, USER_ATTR + b".missing", "<Q")
+
+def test_get_all_schema(subject):
+    item = subject[0]
+    schema = xattr.Schema({USER_ATTR + b".u": "u64",
+                           (USER_ATTR + b".i").decode(): "i64",
+                           USER_ATTR + b".s": "utf8",
+                           USER_ATTR + b".b": "bytes"})
+    assert len(schema) == 4
+    assert schema[USER_ATTR + b".u"] == "u64"
+    assert schema[(USER_ATTR + b".s").decode()] == "utf8"
+    with pytest.raises(KeyError):
+        schema[USER_ATTR]
+    xattr.set_u64(item, USER_ATTR + b".u", 2**64 - 1)
+    xattr.set_u64(item, USER_ATTR + b".i", 2**64 - 1)
+    xattr.set(item, USER_ATTR + b".s", "h\u00e9llo".encode())
+    xattr.set(item, USER_ATTR + b".b", USER_VAL)
+    xattr.set(item, USER_ATTR, USER_VAL)
+    expected = {USER_NN + b".u": 2**64 - 1, USER_NN + b".i": -1,
+                USER_NN + b".s": "h\u00e9llo", USER_NN + b".b": USER_VAL,
+                USER_NN: USER_VAL}
+    for kwargs in [{}, {"intern": xattr.InternTable()},
+                   {"max_value_size": 1024}]:
+        assert dict(xattr.get_all(item, namespace=NAMESPACE, schema=schema,
+                                  **kwargs)) == expected
+    attrs = xattr.get_all(item, namespace=NAMESPACE, schema=schema,
+                          compact=True)
+    assert attrs.to_dict() == expected
+    assert attrs[USER_NN + b".i"] == -1
+    # Names are matched in full, regardless of the namespace
+    full = dict(xattr.get_all(item, schema=schema))
+    assert full[USER_ATTR + b".u"] == 2**64 - 1
+    # Integers are never capped, unlike other values
+    capped = dict(xattr.get_all(item, namespace=NAMESPACE, schema=schema,
+                                max_value_size=1))
+    assert capped[USER_NN + b".u"] == 2**64 - 1
+    assert capped[USER_NN + b".s"] == len("h\u00e9llo".encode())
+    assert xattr.get_all(item, namespace=NAMESPACE, schema=schema,
+                         max_value_size=1, compact=True).to_dict() == capped
+    xattr.set(item, USER_ATTR + b".u", USER_VAL)
+    with pytest.raises(ValueError):
+        xattr.get_all(item, schema=schema)
+    with pytest.raises(ValueError):
+        xattr.get_all(item, schema=schema, compact=True)
+    xattr.set(item, USER_ATTR + b".u", LARGE_VAL)
+    for compact in [False, True]:
+        with pytest.raises(ValueError):
+            xattr.get_all(item, schema=schema, max_value_size=1,
+                          compact=compact)
+    for bad in [{USER_ATTR: "float"}, {USER_ATTR + b"\0": "u64"},
+                {USER_ATTR: "u64", USER_ATTR.decode(): "u64"}]:
+        with pytest.raises(ValueError):
+            xattr.Schema(bad)
+    with pytest.raises(TypeError):
+        xattr.Schema({USER_ATTR: 1})
+    with pytest.raises(TypeError):
+        xattr.get_all(item, schema={USER_ATTR: "u64"})
+
+def test_names_as_str(subject):
+    item = subject[0]
+    odd = USER_ATTR + b".\xc3\xa9\xff"
+    xattr.set(item, USER_ATTR, USER_VAL)
+    xattr.set(item, odd, USER_VAL)
+    names = sorted(os.fsdecode(n) for n in
+                   [USER_NN, odd[len(NAMESPACE) + 1:]])
+    kw = {"namespace": NAMESPACE, "names_as_str": True}
+    assert sorted(xattr.list(item, **kw)) == names
+    assert sorted(xattr.list(item, lazy=True, **kw)) == names
+    assert sorted(n for (n, _) in xattr.get_all(item, **kw)) == names
+    assert list(xattr.get_all(item, compact=True, **kw)) == names
+    assert sorted(xattr.sizes(item, **kw)) == names
+    # The (non-UTF-8) names returned can be looked up again
+    lazy = xattr.list(item, lazy=True, **kw)
+    attrs = xattr.get_all(item, compact=True, **kw)
+    for name in names:
+        assert name in lazy
+        assert attrs[name] == USER_VAL
+    assert os.fsdecode(odd) in xattr.list(item, names_as_str=True)
+    # ASCII names are interned
+    a = [n for n in xattr.list(item, **kw) if n == USER_NN.decode()]
+    b = [n for n in xattr.list(item, **kw) if n == USER_NN.decode()]
+    assert a[0] is b[0]
+    assert [type(n) for n in xattr.list(item, **kw)] == [str, str]
+    assert [type(n) for n in xattr.list(item, namespace=NAMESPACE)] == \
+        [bytes, bytes]
+
+def test_name_filters(subject):
+    item = subject[0]
+    names = [USER_ATTR + b".app.a", USER_ATTR + b".app.b", USER_ATTR]
+    for name in names:
+        xattr.set(item, name, USER_VAL)
+    glob = USER_ATTR + b".app.*"
+    for kw, expected in [
+            ({"namespaces": [NAMESPACE]}, names),
+            ({"namespaces": (b"nonexistent", NAMESPACE)}, names),
+            ({"namespaces": []}, []),
+            ({"namespaces": [b"nonexistent"]}, []),
+            ({"name_glob": glob}, names[:2]),
+            ({"name_glob": glob, "namespaces": [NAMESPACE]}, names[:2]),
+            ({"name_glob": USER_ATTR + b".app.[b]"}, names[1:2]),
+            ({"name_glob": glob, "namespace": NAMESPACE},
+             [n[len(NAMESPACE) + 1:] for n in names[:2]]),
+    ]:
+        expected = sorted(expected)
+        assert sorted(ignore(xattr.list(item, **kw))) == expected
+        assert sorted(ignore(xattr.list(item, lazy=True, **kw))) == expected
+        assert sorted(ignore(n for (n, _) in
+                             xattr.get_all(item, **kw))) == expected
+        assert sorted(ignore(xattr.get_all(item, compact=True,
+                                           **kw))) == expected
+    # An empty namespace is no filter at all
+    assert sorted(ignore(xattr.list(item, namespace=b"",
+                                    namespaces=[NAMESPACE]))) == sorted(names)
+    # Backslashes are literal, as in fnmatch.fnmatchcase
+    odd = USER_ATTR + b".a\\b"
+    xattr.set(item, odd, USER_VAL)
+    assert fnmatch.fnmatchcase(odd, USER_ATTR + b".a\\*")
+    assert xattr.list(item, name_glob=USER_ATTR + b".a\\*") == [odd]
+    assert xattr.list(item, name_glob=odd) == [odd]
+    with pytest.raises(ValueError):
+        xattr.list(item, namespace=NAMESPACE, namespaces=[NAMESPACE])
+    with pytest.raises(ValueError):
+        xattr.get_all(item, namespaces=[b"a\0b"])
+    with pytest.raises(TypeError):
+        xattr.list(item, namespaces=[NAMESPACE.decode()])
+    with pytest.raises(TypeError):
+        xattr.get_all(item, namespaces=1)
+
+def test_stat_all(any_subject):
+    item, nofollow = any_subject
+    if hasattr(item, "fileno"):
+        expected = os.fstat(item.fileno())
+    elif isinstance(item, int):
+        expected = os.fstat(item)
+    else:
+        expected = os.stat(item, follow_symlinks=not nofollow)
+    st, attrs = xattr.stat_all(item, nofollow=nofollow)
+    assert st == expected
+    for field in ["st_atime_ns", "st_mtime_ns", "st_ctime_ns", "st_mtime",
+                  "st_blksize", "st_blocks", "st_rdev"]:
+        assert getattr(st, field) == getattr(expected, field)
+    assert ignore_tuples(attrs) == \
+        ignore_tuples(xattr.get_all(item, nofollow=nofollow))
+    if nofollow:
+        return
+    xattr.set(item, USER_ATTR, USER_VAL)
+    st, attrs = xattr.stat_all(item, namespace=NAMESPACE)
+    assert attrs == [(USER_NN, USER_VAL)]
+    st, attrs = xattr.stat_all(item, namespace=NAMESPACE, compact=True)
+    assert attrs.to_dict() == {USER_NN: USER_VAL}
+
+def test_stat_all_missing(testdir):
+    with pytest.raises(EnvironmentError) as e:
+        xattr.stat_all(os.path.join(testdir, "missing"))
+    assert e.value.errno == errno.ENOENT
+
+def test_get_all_max_value_size(subject):
+    item = subject[0]
+    big = LARGE_VAL
+    xattr.set(item, USER_ATTR, big)
+    xattr.set(item, USER_ATTR + b".2", USER_VAL)
+    xattr.set(item, USER_ATTR + b".3", EMPTY_VAL)
+    def get_all(size):
+        return dict(xattr.get_all(item, namespace=NAMESPACE,
+                                  max_value_size=size))
+    assert get_all(None) == {USER_NN: big, USER_NN + b".2": USER_VAL,
+                             USER_NN + b".3": EMPTY_VAL}
+    assert get_all(len(big)) == get_all(None)
+    assert get_all(len(big) - 1) == {USER_NN: len(big),
+                                     USER_NN + b".2": USER_VAL,
+                                     USER_NN + b".3": EMPTY_VAL}
+    assert get_all(len(USER_VAL)) == get_all(len(big) - 1)
+    assert get_all(len(USER_VAL) - 1) == {USER_NN: len(big),
+                                          USER_NN + b".2": len(USER_VAL),
+                                          USER_NN + b".3": EMPTY_VAL}
+    assert get_all(0)[USER_NN + b".3"] == EMPTY_VAL
+    with pytest.raises(ValueError):
+        get_all(-1)
+    with pytest.raises(TypeError):
+        get_all("1")
+
+def test_get_all_intern(subject):
+    item = subject[0]
+    xattr.set(item, USER_ATTR, USER_VAL)
+    xattr.set(item, USER_ATTR + b".2", USER_VAL)
+    table = xattr.InternTable()
+    a = dict(xattr.get_all(item, namespace=NAMESPACE, intern=table))
+    b = dict(xattr.get_all(item, namespace=NAMESPACE, intern=table))
+    assert a == b == {USER_NN: USER_VAL, USER_NN + b".2": USER_VAL}
+    assert a[USER_NN] is a[USER_NN + b".2"] is b[USER_NN]
+    assert len(table) == 3
+    assert table.misses == 3 and table.hits == 5
+    assert table.size > 0
+    table.clear()
+    assert len(table) == 0 and table.size == 0 and table.hits == 0
+    # Bounded tables still return correct (unshared) values
+    for t in [xattr.InternTable(max_size=0),
+              xattr.InternTable(max_value_size=len(USER_VAL) - 1)]:
+        a = dict(xattr.get_all(item, namespace=NAMESPACE, intern=t))
+        assert a == b
+        assert a[USER_NN] is not a[USER_NN + b".2"]
+    with pytest.raises(TypeError):
+        xattr.get_all(item, intern={})
+    with pytest.raises(ValueError):
+        xattr.InternTable(max_size=-1)
+
+def test_list_large(subject):
+    """test lists larger than the initial (on-stack) buffer"""
+    item = subject[0]
+    names = [USER_ATTR + b".%02d" % i + b"x" * 40 for i in range(30)]
+    for name in names:
+        xattr.set(item, name, EMPTY_VAL)
+    lists_equal(sorted(xattr.list(item)), names)
+    lists_equal(sorted(xattr.list(item, lazy=True)), names)
+    lists_equal(sorted(n for (n, _) in xattr.get_all(item)), names)
+
+def test_list_lazy(subject):
+    item = subject[0]
+    names = xattr.list(item, namespace=NAMESPACE, lazy=True)
+    assert isinstance(names, xattr.NameList)
+    assert len(names) == 0 and list(names) == [] and bytes(names) == b""
+    xattr.set(item, USER_ATTR, USER_VAL)
+    xattr.set(item, USER_ATTR + b".2", USER_VAL)
+    for kwargs in [{}, {"namespace": NAMESPACE}]:
+        expected = xattr.list(item, **kwargs)
+        names = xattr.list(item, lazy=True, **kwargs)
+        assert len(names) == len(expected)
+        assert list(names) == expected
+        assert names[0] == expected[0] and names[-1] == expected[-1]
+        assert bytes(names) == b"".join(n + b"\0" for n in expected)
+        assert memoryview(names).readonly
+        for name in expected:
+            assert name in names
+            assert name.decode() in names
+            assert name[:-1] not in names
+        with pytest.raises(IndexError):
+            names[len(expected)]
+    names = xattr.list(item, namespace=NAMESPACE, lazy=True)
+    assert USER_ATTR not in names
+    assert USER_NN in names
+    with pytest.raises(TypeError):
+        1 in names
+
+def test_get_all_compact(subject):
+    item = subject[0]
+    attrs = xattr.get_all(item, namespace=NAMESPACE, compact=True)
+    assert isinstance(attrs, xattr.XattrSet)
+    assert len(attrs) == 0 and list(attrs) == [] and attrs.to_dict() == {}
+    xattr.set(item, USER_ATTR + b".b", USER_VAL)
+    xattr.set(item, USER_ATTR + b".a", LARGE_VAL)
+    xattr.set(item, USER_ATTR, EMPTY_VAL)
+    attrs = xattr.get_all(item, namespace=NAMESPACE, compact=True)
+    expected = dict(xattr.get_all(item, namespace=NAMESPACE))
+    assert len(attrs) == 3
+    assert list(attrs) == sorted(expected)
+    assert attrs.to_dict() == expected
+    for name, value in expected.items():
+        assert name in attrs
+        assert name.decode() in attrs
+        assert attrs[name] == value
+        assert attrs.get(name) == value
+    assert b"missing" not in attrs
+    assert attrs.get(b"missing") is None
+    assert attrs.get(b"missing", 1) == 1
+    with pytest.raises(KeyError):
+        attrs[USER_NN + b"\0"]
+    with pytest.raises(TypeError):
+        attrs[1]
+    # Without namespace, names are full
+    assert USER_ATTR in xattr.get_all(item, compact=True)
+    attrs = xattr.get_all(item, namespace=NAMESPACE, compact=True,
+                          max_value_size=len(USER_VAL))
+    assert attrs[USER_NN + b".a"] == len(LARGE_VAL)
+    assert attrs[USER_NN + b".b"] == USER_VAL
+    with pytest.raises(ValueError):
+        xattr.get_all(item, compact=True, intern=xattr.InternTable())
+
 def test_binary_payload_deprecated(subject):
     """test binary values (deprecated functions)"""
     item = subject[0]
@@ -442,6 +808,446 @@ def test_binary_payload(subject):
     assert xattr.get_all(item, namespace=NAMESPACE) == [(USER_NN, BINVAL)]
     xattr.remove(item, USER_ATTR)
 
+def test_set_if_changed(subject, use_ns):
+    item = subject[0]
+    if use_ns:
+        args = (item, USER_NN)
+        kw = {"namespace": NAMESPACE}
+    else:
+        args = (item, USER_ATTR)
+        kw = {}
+    assert xattr.set_if_changed(*args, USER_VAL, **kw)
+    assert not xattr.set_if_changed(*args, USER_VAL, **kw)
+    assert xattr.get(item, USER_ATTR) == USER_VAL
+    # Shorter, longer and empty values must all be detected
+    for val in [USER_VAL[:1], LARGE_VAL, EMPTY_VAL]:
+        assert xattr.set_if_changed(*args, val, **kw)
+        assert not xattr.set_if_changed(*args, val, **kw)
+        assert xattr.get(item, USER_ATTR) == val
+
+def test_set_if_changed_flags(subject):
+    item = subject[0]
+    with pytest.raises(EnvironmentError):
+        xattr.set_if_changed(item, USER_ATTR, USER_VAL, flags=XATTR_REPLACE)
+    assert xattr.set_if_changed(item, USER_ATTR, USER_VAL, flags=XATTR_CREATE)
+    # XATTR_CREATE fails on an existing attribute, even an identical one
+    with pytest.raises(EnvironmentError) as e:
+        xattr.set_if_changed(item, USER_ATTR, USER_VAL, flags=XATTR_CREATE)
+    assert e.value.errno == errno.EEXIST
+    assert not xattr.set_if_changed(item, USER_ATTR, USER_VAL,
+                                    flags=XATTR_REPLACE)
+    with pytest.raises(EnvironmentError):
+        xattr.set_if_changed(item, USER_ATTR, LARGE_VAL, flags=XATTR_CREATE)
+
+def test_set_many(subject, use_ns):
+    item = subject[0]
+    attrs = {USER_ATTR: USER_VAL, USER_ATTR + b".2": LARGE_VAL}
+    if use_ns:
+        attrs = {USER_NN: USER_VAL, USER_NN + b".2": LARGE_VAL}
+        kw = {"namespace": NAMESPACE}
+    else:
+        kw = {}
+    assert xattr.set_many(item, attrs, **kw) == 2
+    assert xattr.get(item, USER_ATTR) == USER_VAL
+    assert xattr.get(item, USER_ATTR + b".2") == LARGE_VAL
+    # Pairs, e.g. from get_all, are accepted too
+    pairs = list(attrs.items())
+    assert xattr.set_many(item, pairs, **kw) == 2
+    assert xattr.set_many(item, pairs, only_changed=True, **kw) == 0
+    pairs[0] = (pairs[0][0], EMPTY_VAL)
+    assert xattr.set_many(item, pairs, only_changed=True, **kw) == 1
+    assert xattr.get(item, USER_ATTR) == EMPTY_VAL
+    assert xattr.set_many(item, {}, **kw) == 0
+
+@pytest.mark.parametrize("atomic", [True, False], ids=["atomic", "partial"])
+def test_set_many_failure(subject, atomic):
+    item = subject[0]
+    xattr.set(item, USER_ATTR, USER_VAL)
+    attrs = [(USER_ATTR, LARGE_VAL),
+             (USER_ATTR + b".2", USER_VAL),
+             # Larger than what Linux allows (64KiB)
+             (USER_ATTR + b".3", b"x" * (1 << 17))]
+    with pytest.raises(EnvironmentError):
+        xattr.set_many(item, attrs, atomic=atomic)
+    if atomic:
+        tuples_equal(xattr.get_all(item), [(USER_ATTR, USER_VAL)])
+    else:
+        assert xattr.get(item, USER_ATTR) == LARGE_VAL
+        assert xattr.get(item, USER_ATTR + b".2") == USER_VAL
+
+@pytest.mark.parametrize(
+    "attrs, exc", [(object(), TypeError),
+                   ([USER_ATTR], TypeError),
+                   ([(USER_ATTR, USER_VAL, USER_VAL)], TypeError),
+                   ([(USER_ATTR, 1)], TypeError),
+                   ([(b"user.a\0b", USER_VAL)], ValueError)])
+def test_set_many_bad_attrs(testdir, attrs, exc):
+    with get_file_name(testdir) as fname:
+        with pytest.raises(exc):
+            xattr.set_many(fname, attrs)
+        lists_equal(xattr.list(fname), [])
+
+def test_remove_many(subject, use_ns):
+    item = subject[0]
+    xattr.set_many(item, {USER_ATTR: USER_VAL, USER_ATTR + b".2": USER_VAL,
+                          USER_ATTR + b".3": USER_VAL})
+    if use_ns:
+        names = [USER_NN, USER_NN + b".2", USER_NN + b".missing"]
+        kw = {"namespace": NAMESPACE}
+    else:
+        names = [USER_ATTR, USER_ATTR + b".2", USER_ATTR + b".missing"]
+        kw = {}
+    assert xattr.remove_many(item, names, **kw) == 2
+    lists_equal(xattr.list(item), [USER_ATTR + b".3"])
+    assert xattr.remove_many(item, names, **kw) == 0
+    assert xattr.remove_many(item, [], **kw) == 0
+
+def test_remove_all(subject, use_ns):
+    item = subject[0]
+    xattr.set_many(item, {USER_ATTR: USER_VAL, USER_ATTR + b".2": USER_VAL})
+    if use_ns:
+        assert xattr.remove_all(item, namespace=NAMESPACE) == 2
+        assert xattr.remove_all(item, namespace=NAMESPACE) == 0
+    else:
+        # There might be other (ignored) attributes, so only check what
+        # we can
+        assert xattr.remove_all(item, namespace=b"no-such-ns") == 0
+        lists_equal(xattr.list(item), [USER_ATTR, USER_ATTR + b".2"])
+        xattr.remove_many(item, [USER_ATTR, USER_ATTR + b".2"])
+    lists_equal(xattr.list(item), [])
+
+def test_remove_all_error(testdir):
+    with get_dangling_symlink(testdir) as sname:
+        with pytest.raises(EnvironmentError):
+            xattr.remove_all(sname)
+
+@pytest.fixture
+def tree(testdir):
+    """a small tree with attributes on some of its items"""
+    root = os.path.join(testdir, "tree")
+    os.makedirs(os.path.join(root, "a", "b"))
+    paths = {}
+    for rel in ["", "f1", "f2", "a", os.path.join("a", "b", "f3")]:
+        path = os.path.join(root, rel)
+        if not os.path.exists(path):
+            open(path, "w").close()
+        paths[rel] = path
+    xattr.set(paths[""], USER_ATTR, USER_VAL)
+    xattr.set_many(paths["f1"], [(USER_ATTR, LARGE_VAL),
+                                 (USER_ATTR + b".2", EMPTY_VAL)])
+    xattr.set(paths[os.path.join("a", "b", "f3")], USER_ATTR, USER_VAL)
+    yield root, paths
+
+def tree_attrs(paths):
+    return {rel: xattr.get_all(path, namespace=NAMESPACE)
+            for rel, path in paths.items()}
+
+@pytest.mark.parametrize("crc", [True, False], ids=["crc", "no crc"])
+def test_dump_restore(testdir, tree, crc):
+    root, paths = tree
+    expected = tree_attrs(paths)
+    snapshot = os.path.join(testdir, "snapshot")
+    with open(snapshot, "wb") as f:
+        assert xattr.dump(root, f, namespace=NAMESPACE, crc=crc) == 4
+    for path in paths.values():
+        xattr.remove_all(path, namespace=NAMESPACE)
+    with open(snapshot, "rb") as f:
+        assert xattr.restore(f.fileno(), pathlib.PurePath(root)) == 4
+    assert tree_attrs(paths) == expected
+    # Dumping into the same snapshot is idempotent
+    with open(snapshot, "rb") as f:
+        data = f.read()
+    with open(snapshot, "wb") as f:
+        xattr.dump(root.encode(), f.fileno(), namespace=NAMESPACE, crc=crc)
+    with open(snapshot, "rb") as f:
+        assert f.read() == data
+
+def test_dump_namespace(testdir, tree):
+    root, _ = tree
+    with open(os.path.join(testdir, "snapshot"), "wb") as f:
+        assert xattr.dump(root, f, namespace=b"no-such-ns") == 0
+
+def test_dump_missing_root(testdir):
+    with open(os.path.join(testdir, "snapshot"), "wb") as f:
+        with pytest.raises(EnvironmentError):
+            xattr.dump(os.path.join(testdir, "missing"), f)
+
+@pytest.mark.parametrize(
+    "mangle", [lambda d: d[:-1],
+               lambda d: d[:-10],
+               lambda d: b"NOTXATTR" + d[8:],
+               lambda d: d[:20] + bytes([d[20] ^ 1]) + d[21:]],
+    ids=["truncated end", "truncated record", "bad magic", "bad crc"])
+def test_restore_corrupted(testdir, tree, mangle):
+    root, _ = tree
+    snapshot = os.path.join(testdir, "snapshot")
+    with open(snapshot, "wb") as f:
+        xattr.dump(root, f, namespace=NAMESPACE)
+    with open(snapshot, "rb") as f:
+        data = mangle(f.read())
+    with open(snapshot, "wb") as f:
+        f.write(data)
+    with open(snapshot, "rb") as f:
+        with pytest.raises(ValueError):
+            xattr.restore(f, root)
+
+def test_restore_unsafe_path(testdir):
+    snapshot = os.path.join(testdir, "snapshot")
+    rel = b"a/../../escape"
+    with open(snapshot, "wb") as f:
+        f.write(b"PYXATTR\x01\x00F" + bytes([len(rel)]) + rel +
+                b"\x01\x06user.x\x00\x00E")
+    with open(snapshot, "rb") as f:
+        with pytest.raises(ValueError):
+            xattr.restore(f, testdir)
+
+def test_restore_symlink_path(testdir):
+    root = os.path.join(testdir, "root")
+    outside = os.path.join(testdir, "outside")
+    os.mkdir(root)
+    os.mkdir(outside)
+    victim = os.path.join(outside, "victim")
+    open(victim, "w").close()
+    os.symlink(os.path.join("..", "outside"), os.path.join(root, "link"))
+    snapshot = os.path.join(testdir, "snapshot")
+    rel = b"link/victim"
+    with open(snapshot, "wb") as f:
+        f.write(b"PYXATTR\x01\x00F" + bytes([len(rel)]) + rel +
+                b"\x01" + bytes([len(USER_ATTR)]) + USER_ATTR +
+                b"\x00\x00E")
+    with open(snapshot, "rb") as f:
+        with pytest.raises(EnvironmentError) as e:
+            xattr.restore(f, root)
+    assert e.value.errno in (errno.ELOOP, errno.ENOTDIR)
+    assert ignore(xattr.list(victim)) == []
+
+def test_index(testdir, tree):
+    import xattr.index
+    root, paths = tree
+    ipath = os.path.join(testdir, "index")
+    assert xattr.index.build(root, ipath, namespace=NAMESPACE) == 3
+    f3 = os.path.join("a", "b", "f3").encode()
+    with xattr.index.open(pathlib.PurePath(ipath)) as idx:
+        assert len(idx) == 3
+        assert idx.root == root.encode()
+        assert idx.names() == [USER_ATTR, USER_ATTR + b".2"]
+        assert idx.query(USER_ATTR) == sorted([b"", b"f1", f3])
+        assert idx.query(USER_ATTR, USER_VAL) == sorted([b"", f3])
+        assert idx.query(USER_ATTR.decode(), LARGE_VAL.decode()) == [b"f1"]
+        assert idx.query(USER_ATTR + b".2", EMPTY_VAL) == [b"f1"]
+        assert idx.query(USER_ATTR, b"no-such-value") == []
+        assert idx.query(b"user.no-such-name") == []
+        assert sorted(idx.values(USER_ATTR)) == sorted([USER_VAL, LARGE_VAL])
+        assert idx.values(b"user.no-such-name") == []
+    with pytest.raises(ValueError):
+        idx.query(USER_ATTR)
+    with pytest.raises(ValueError):
+        len(idx)
+
+@pytest.mark.parametrize("threads", [None, 1, 4])
+def test_find(tree, threads):
+    root, paths = tree
+    def find(**kwargs):
+        return xattr.find(root, threads=threads, **kwargs)
+    def expected(*names):
+        return sorted(os.fsencode(os.path.join(root, n) if n else root)
+                      for n in names)
+    f3 = os.path.join("a", "b", "f3")
+    assert find() == expected("", "f1", "f2", "a", os.path.join("a", "b"),
+                              f3)
+    assert find(has=[USER_ATTR]) == expected("", "f1", f3)
+    assert find(has=USER_ATTR.decode()) == expected("", "f1", f3)
+    assert find(has=[USER_ATTR, USER_ATTR + b".2"]) == expected("f1")
+    assert find(missing=[USER_ATTR]) == expected("f2", "a",
+                                                 os.path.join("a", "b"))
+    assert find(equals={USER_ATTR: USER_VAL}) == expected("", f3)
+    assert find(equals=[(USER_ATTR, USER_VAL[:-1])]) == []
+    assert find(equals={USER_ATTR + b".2": EMPTY_VAL}) == expected("f1")
+    assert find(prefix={USER_ATTR: LARGE_VAL[:10]}) == expected("f1")
+    assert find(prefix={USER_ATTR.decode(): ""}) == expected("", "f1", f3)
+    assert find(has=[USER_ATTR], missing=[USER_ATTR + b".2"],
+                prefix={USER_ATTR: USER_VAL}) == expected("", f3)
+
+def test_find_errors(testdir, tree):
+    root, paths = tree
+    assert xattr.find(paths["f1"], has=[USER_ATTR]) == \
+        [os.fsencode(paths["f1"])]
+    with pytest.raises(EnvironmentError):
+        xattr.find(os.path.join(testdir, "missing"))
+    for threads in [0, -1, 1000000]:
+        with pytest.raises(ValueError):
+            xattr.find(root, threads=threads)
+    with pytest.raises(ValueError):
+        xattr.find(root, has=[b"user.a\0b"])
+    with pytest.raises(TypeError):
+        xattr.find(root, has=[1])
+    with pytest.raises(TypeError):
+        xattr.find(root, equals=[USER_ATTR])
+
+def test_fingerprint(testdir, tree):
+    _, paths = tree
+    f1, f2 = paths["f1"], paths["f2"]
+    empty = xattr.fingerprint(f2, namespace=NAMESPACE)
+    assert 0 <= empty < 2**64
+    assert xattr.fingerprint(paths["a"], namespace=NAMESPACE) == empty
+    fp1 = xattr.fingerprint(f1, namespace=NAMESPACE)
+    assert fp1 != empty
+    # Same attributes, set in a different order
+    xattr.set(f2, USER_ATTR + b".2", EMPTY_VAL)
+    xattr.set(f2, USER_ATTR, LARGE_VAL)
+    with open(f2) as f:
+        assert xattr.fingerprint(f, namespace=NAMESPACE) == fp1
+    xattr.set(f2, USER_ATTR, LARGE_VAL[:-1])
+    assert xattr.fingerprint(f2, namespace=NAMESPACE) != fp1
+    # Moving bytes between the name and the value changes it
+    xattr.remove_all(f2, namespace=NAMESPACE)
+    xattr.set(f2, USER_ATTR + b".", b"2")
+    xattr.set(f1, USER_ATTR + b".2", b"")
+    assert xattr.fingerprint(f2, namespace=NAMESPACE) != \
+        xattr.fingerprint(f1, namespace=NAMESPACE)
+    assert xattr.fingerprint_many([f1, pathlib.PurePath(f2), paths["a"]],
+                                  namespace=NAMESPACE) == \
+        [xattr.fingerprint(f, namespace=NAMESPACE)
+         for f in [f1, f2, paths["a"]]]
+    assert xattr.fingerprint_many([]) == []
+    with pytest.raises(EnvironmentError) as e:
+        xattr.fingerprint(os.path.join(testdir, "missing"))
+    assert e.value.errno == errno.ENOENT
+    with pytest.raises(EnvironmentError) as e:
+        xattr.fingerprint_many([f1, os.path.join(testdir, "missing")])
+    assert e.value.errno == errno.ENOENT
+    with pytest.raises(TypeError):
+        xattr.fingerprint_many([f1, None])
+
+def test_diff(testdir, tree):
+    _, paths = tree
+    f1, f2 = paths["f1"], paths["f2"]
+    assert xattr.diff(f1, f1) == ([], [], [])
+    assert xattr.diff(f1, f2, namespace=NAMESPACE) == \
+        ([], [USER_NN, USER_NN + b".2"], [])
+    xattr.set(f2, USER_ATTR, LARGE_VAL[:-1])
+    xattr.set(f2, USER_ATTR + b".3", EMPTY_VAL)
+    assert xattr.diff(f1, f2) == \
+        ([USER_ATTR + b".3"], [USER_ATTR + b".2"], [USER_ATTR])
+    with open(f2) as f:
+        assert xattr.diff(pathlib.PurePath(f1), f, namespace=NAMESPACE) == \
+            ([USER_NN + b".3"], [USER_NN + b".2"], [USER_NN])
+    xattr.set(f2, USER_ATTR, LARGE_VAL)
+    assert xattr.diff(f2, f1) == ([USER_ATTR + b".2"], [USER_ATTR + b".3"], [])
+    with pytest.raises(EnvironmentError) as e:
+        xattr.diff(f1, os.path.join(testdir, "missing"))
+    assert e.value.errno == errno.ENOENT
+
+@pytest.mark.parametrize("threads", [None, 1, 4])
+def test_diff_tree(testdir, tree, threads):
+    root, paths = tree
+    copy = os.path.join(testdir, "copy")
+    shutil.copytree(root, copy)
+    assert xattr.diff_tree(root, copy, threads=threads) == []
+    f3 = os.path.join("a", "b", "f3")
+    xattr.set(os.path.join(copy, "f2"), USER_ATTR, USER_VAL)
+    xattr.remove(os.path.join(copy, f3), USER_ATTR)
+    xattr.set(copy, USER_ATTR, EMPTY_VAL)
+    os.unlink(os.path.join(copy, "f1"))
+    assert xattr.diff_tree(root, copy, threads=threads,
+                           namespace=NAMESPACE) == [
+        (b"", [], [], [USER_NN]),
+        (os.fsencode(f3), [], [USER_NN], []),
+        (b"f1", [], [USER_NN, USER_NN + b".2"], []),
+        (b"f2", [USER_NN], [], []),
+    ]
+    with pytest.raises(EnvironmentError):
+        xattr.diff_tree(os.path.join(testdir, "missing"), copy)
+    # A directory replaced by a file only has missing items below
+    shutil.rmtree(os.path.join(copy, "a", "b"))
+    open(os.path.join(copy, "a", "b"), "w").close()
+    diff = xattr.diff_tree(root, copy, threads=threads, namespace=NAMESPACE)
+    assert (os.fsencode(f3), [], [USER_NN], []) in diff
+
+def test_merkle(testdir, tree):
+    root, paths = tree
+    copy = os.path.join(testdir, "copy")
+    shutil.copytree(root, copy)
+    ab = os.path.join("a", "b").encode()
+    m = xattr.merkle(root, namespace=NAMESPACE)
+    assert sorted(m) == [b"", b"a", ab]
+    assert xattr.merkle(copy, namespace=NAMESPACE, threads=4) == m
+    assert xattr.merkle(pathlib.PurePath(root), namespace=NAMESPACE,
+                        threads=1) == m
+    # Changes propagate up to the root only
+    os.mkdir(os.path.join(copy, "c"))
+    xattr.set(os.path.join(copy, "a", "b", "f3"), USER_ATTR, EMPTY_VAL)
+    m2 = xattr.merkle(copy, namespace=NAMESPACE)
+    assert sorted(m2) == [b"", b"a", ab, b"c"]
+    assert all(m2[k] != m[k] for k in m)
+    xattr.set(os.path.join(copy, "a", "b", "f3"), USER_ATTR, USER_VAL)
+    shutil.rmtree(os.path.join(copy, "c"))
+    assert xattr.merkle(copy, namespace=NAMESPACE) == m
+    # Renaming an item changes the hash, even with the same attributes
+    os.rename(os.path.join(copy, "f1"), os.path.join(copy, "f1.new"))
+    m3 = xattr.merkle(copy, namespace=NAMESPACE)
+    assert m3[b""] != m[b""] and m3[b"a"] == m[b"a"]
+    with pytest.raises(EnvironmentError):
+        xattr.merkle(paths["f1"])
+    with pytest.raises(EnvironmentError):
+        xattr.merkle(os.path.join(testdir, "missing"))
+
+def index_contents(ipath):
+    import xattr.index
+    with xattr.index.open(ipath) as idx:
+        return sorted((p, n, v) for n in idx.names() for v in idx.values(n)
+                      for p in idx.query(n, v))
+
+def test_index_incremental(testdir, tree):
+    import xattr.index
+    root, paths = tree
+    ipath = os.path.join(testdir, "index")
+    full = os.path.join(testdir, "full")
+    # Without a previous index, this is a full build
+    assert xattr.index.build(root, ipath, incremental=True,
+                              namespace=NAMESPACE) == 3
+    # Let the tree age past the watermark, so that it is carried over
+    time.sleep(1.1)
+    assert xattr.index.build(root, ipath, namespace=NAMESPACE) == 3
+    xattr.set(paths["f1"], USER_ATTR, USER_VAL)
+    xattr.set(paths["f2"], USER_ATTR, EMPTY_VAL)
+    xattr.remove(paths[os.path.join("a", "b", "f3")], USER_ATTR)
+    os.unlink(paths["f1"])
+    with open(paths["f1"], "w"):
+        pass
+    assert xattr.index.build(root, ipath, incremental=True,
+                              namespace=NAMESPACE) == 2
+    assert xattr.index.build(root, full, namespace=NAMESPACE) == 2
+    assert index_contents(ipath) == index_contents(full)
+    assert (b"f2", USER_ATTR, EMPTY_VAL) in index_contents(ipath)
+    # Renaming a directory leaves the ctime of its contents untouched
+    xattr.set(paths[os.path.join("a", "b", "f3")], USER_ATTR, USER_VAL)
+    time.sleep(1.1)
+    assert xattr.index.build(root, ipath, namespace=NAMESPACE) == 3
+    os.rename(paths["a"], os.path.join(root, "z"))
+    assert xattr.index.build(root, ipath, incremental=True,
+                              namespace=NAMESPACE) == 3
+    assert xattr.index.build(root, full, namespace=NAMESPACE) == 3
+    assert index_contents(ipath) == index_contents(full)
+    assert (os.fsencode(os.path.join("z", "b", "f3")), USER_ATTR,
+            USER_VAL) in index_contents(ipath)
+    # An index of another root is not reused
+    assert xattr.index.build(os.path.join(root, "z"), ipath,
+                              incremental=True, namespace=NAMESPACE) == 1
+
+def test_index_invalid(testdir):
+    import xattr.index
+    ipath = os.path.join(testdir, "index")
+    with pytest.raises(EnvironmentError):
+        xattr.index.open(ipath)
+    with pytest.raises(EnvironmentError):
+        xattr.index.build(os.path.join(testdir, "missing"), ipath)
+    assert not os.path.exists(ipath)
+    with open(ipath, "wb") as f:
+        f.write(b"x" * 4096)
+    with pytest.raises(ValueError):
+        xattr.index.open(ipath)
+
 @NOT_MACOSX
 def test_symlinks_user_fail(testdir, use_dangling):
     _, sname = get_symlink(testdir, dangling=use_dangling)
@@ -458,7 +1264,19 @@ def test_symlinks_user_fail(testdir, use_dangling):
                    (xattr.list, []),
                    (xattr.remove, [USER_ATTR]),
                    (xattr.get, [USER_ATTR]),
-                   (xattr.set, [USER_ATTR, USER_VAL])])
+                   (xattr.set, [USER_ATTR, USER_VAL]),
+                   (xattr.set_if_changed, [USER_ATTR, USER_VAL]),
+                   (xattr.set_many, [{USER_ATTR: USER_VAL}]),
+                   (xattr.remove_many, [[USER_ATTR]]),
+                   (xattr.remove_all, []),
+                   (xattr.fingerprint, []),
+                   (xattr.has, [USER_ATTR]),
+                   (xattr.sizes, []),
+                   (xattr.get_u64, [USER_ATTR]),
+                   (xattr.set_u64, [USER_ATTR, 1]),
+                   (xattr.get_str, [USER_ATTR]),
+                   (xattr.get_struct, [USER_ATTR, "<Q"]),
+                   (xattr.stat_all, [])])
 def test_none_namespace(testdir, call, args):
     # Don't want to use subject, since that would prevent xfail test
     # on path objects (due to hiding the exception here).
@@ -472,9 +1290,12 @@ def test_none_namespace(testdir, call, args):
 @pytest.mark.parametrize(
     "call",
     [xattr.get, xattr.list, xattr.listxattr,
-     xattr.remove, xattr.removexattr,
-     xattr.set, xattr.setxattr,
-     xattr.get, xattr.getxattr])
+     xattr.remove, xattr.removexattr, xattr.remove_many, xattr.remove_all,
+     xattr.set, xattr.setxattr, xattr.set_if_changed, xattr.set_many,
+     xattr.get, xattr.getxattr, xattr.find, xattr.diff, xattr.diff_tree,
+     xattr.fingerprint, xattr.fingerprint_many, xattr.merkle, xattr.has,
+     xattr.sizes, xattr.get_u64, xattr.set_u64, xattr.get_str,
+     xattr.get_struct, xattr.stat_all])
 def test_wrong_call(call):
     with pytest.raises(TypeError):
         call()
@@ -488,7 +1309,114 @@ def test_wrong_call(call):
                    (xattr.get, [USER_ATTR]),
                    (xattr.getxattr, [USER_ATTR]),
                    (xattr.set, [USER_ATTR, USER_VAL]),
-                   (xattr.setxattr, [USER_ATTR, USER_VAL])])
+                   (xattr.setxattr, [USER_ATTR, USER_VAL]),
+                   (xattr.set_if_changed, [USER_ATTR, USER_VAL]),
+                   (xattr.set_many, [{USER_ATTR: USER_VAL}]),
+                   (xattr.remove_many, [[USER_ATTR]]),
+                   (xattr.remove_all, [])])
 def test_wrong_argument_type(call, args):
     with pytest.raises(TypeError):
         call(object(), *args)
+
+@pytest.mark.parametrize("mod", [os, xattr.os_compat], ids=["os", "compat"])
+def test_os_compat(testdir, mod):
+    fname = os.path.join(testdir, "f")
+    lname = os.path.join(testdir, "l")
+    with open(fname, "w"):
+        pass
+    os.symlink("f", lname)
+    attr = USER_ATTR.decode()
+    mod.setxattr(fname, attr, USER_VAL)
+    mod.setxattr(pathlib.Path(fname), USER_ATTR + b".2", LARGE_VAL,
+                 flags=XATTR_CREATE)
+    assert mod.getxattr(fname, attr) == USER_VAL
+    assert mod.getxattr(lname, USER_ATTR + b".2") == LARGE_VAL
+    assert sorted(ignore(mod.listxattr(fname))) == \
+        [attr, attr + ".2"]
+    assert sorted(ignore(mod.listxattr(path=lname))) == \
+        [attr, attr + ".2"]
+    assert ignore(mod.listxattr(lname, follow_symlinks=False)) == []
+    fd = os.open(fname, os.O_RDONLY)
+    try:
+        assert mod.getxattr(fd, attr) == USER_VAL
+        assert sorted(ignore(mod.listxattr(fd))) == [attr, attr + ".2"]
+        with pytest.raises(ValueError):
+            mod.getxattr(fd, attr, follow_symlinks=False)
+    finally:
+        os.close(fd)
+    with pytest.raises(FileExistsError):
+        mod.setxattr(fname, attr, USER_VAL, XATTR_CREATE)
+    mod.removexattr(fname, attr + ".2")
+    with pytest.raises(OSError) as e:
+        mod.getxattr(fname, attr + ".2")
+    assert e.value.filename == fname
+    with pytest.raises(FileNotFoundError) as e:
+        mod.listxattr(fname + ".missing")
+    assert e.value.filename == fname + ".missing"
+    with pytest.raises(TypeError):
+        mod.getxattr(fname)
+    with pytest.raises(TypeError):
+        mod.getxattr(fname, attr, True)
+    with pytest.raises(TypeError):
+        mod.getxattr(fname, attr, nofollow=True)
+    with pytest.raises(TypeError):
+        mod.setxattr(fname, attr, "str value")
+
+def test_os_compat_extra(testdir):
+    compat = xattr.os_compat
+    fname = os.path.join(testdir, "f")
+    with open(fname, "w"):
+        pass
+    os.symlink("f", os.path.join(testdir, "l"))
+    compat.setxattr(fname, USER_ATTR, USER_VAL)
+    assert os.getxattr(fname, USER_ATTR) == USER_VAL
+    compat.setxattr(testdir, USER_ATTR, USER_VAL)
+    old = os.getcwd()
+    os.chdir(testdir)
+    try:
+        assert ignore(compat.listxattr()) == [USER_ATTR.decode()]
+    finally:
+        os.chdir(old)
+    if sys.platform.startswith("linux"):
+        dfd = os.open(testdir, os.O_RDONLY)
+        try:
+            assert compat.getxattr("f", USER_ATTR, dir_fd=dfd) == USER_VAL
+            assert compat.getxattr("l", USER_ATTR, dir_fd=dfd) == USER_VAL
+            assert ignore(compat.listxattr(
+                "l", dir_fd=dfd, follow_symlinks=False)) == []
+            # Absolute paths ignore dir_fd
+            assert compat.getxattr(os.path.abspath(fname), USER_ATTR,
+                                   dir_fd=dfd) == USER_VAL
+            with pytest.raises(ValueError):
+                compat.getxattr(dfd, USER_ATTR, dir_fd=dfd)
+        finally:
+            os.close(dfd)
+
+STRESS_THREADS = 32
+STRESS_COUNT = 256
+
+def test_threads_stress(testdir):
+    """concurrent get/set/list on a shared file"""
+    import threading
+    with get_file_name(testdir) as fname:
+        errors = []
+        barrier = threading.Barrier(STRESS_THREADS)
+        def worker(idx):
+            name = USER_ATTR + b".%d" % idx
+            value = b"%d" % idx
+            try:
+                barrier.wait()
+                for i in range(STRESS_COUNT):
+                    xattr.set(fname, name, value)
+                    assert xattr.get(fname, name) == value
+                    assert name in xattr.list(fname)
+            except Exception as e:  # pragma: no cover
+                errors.append(e)
+        threads = [threading.Thread(target=worker, args=(i,))
+                   for i in range(STRESS_THREADS)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        assert errors == []
+        assert len(xattr.get_all(fname, namespace=NAMESPACE)) == STRESS_THREADS
@@ -27,6 +27,14 @@
 #include <sys/xattr.h>
 #endif
 #include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define ITEM_DOC \
     ":param item: a string representing a file-name, a file-like\n" \
@@ -71,6 +79,21 @@
     "    giving an error if it doesn't exist;\n" \
     ":type flags: integer\n"
 
+#define NAMES_AS_STR_DOC \
+    ":keyword names_as_str: if true, names are returned as str,\n" \
+    "    decoded as by :func:`os.fsdecode`, instead of bytes\n" \
+    ":type names_as_str: bool\n"
+
+#define FILTER_DOC \
+    ":keyword namespaces: if given, only names in one of these\n" \
+    "    namespaces are returned, unstripped; this can't be combined\n" \
+    "    with a non-empty *namespace*\n" \
+    ":type namespaces: list[bytes]\n" \
+    ":keyword name_glob: if given, only names matching this shell-style\n" \
+    "    pattern (as by :func:`fnmatch.fnmatchcase`, matched against the\n" \
+    "    full name) are returned\n" \
+    ":type name_glob: bytes\n"
+
 #define NS_CHANGED_DOC \
     ".. versionchanged:: 0.5.1\n" \
     "   The namespace argument, if passed, cannot be None anymore; to\n" \
@@ -83,10 +106,18 @@
  * two and allocate more memory upfront than needed, otherwise we
  * incur three syscalls (get with ENORANGE, get with 0 to compute
  * actual size, final get). The test suite is marginally faster (5%)
- * with this, so it seems worth doing.
+ * with this, so it seems worth doing. Where possible, this first
+ * attempt uses an on-stack buffer (see _get_small).
 */
 #define ESTIMATE_ATTR_SIZE 1024
 
+/* Per-object locking for free-threaded builds; with the GIL (or on
+   Python versions before 3.13), the GIL protects objects already. */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
 typedef enum {T_FD, T_PATH, T_LINK} target_e;
 
 typedef struct {
@@ -182,6 +213,61 @@ static int merge_ns(const char *ns, const char *name,
     return 0;
 }
 
+/* Converts a str or bytes object into a new bytes reference, the same
+   way the "et" argument format does (str is UTF-8 encoded). Returns
+   NULL with an exception set on failure. */
+static PyObject *convert_bytes(PyObject *obj) {
+    if(PyBytes_Check(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    if(PyUnicode_Check(obj))
+        return PyUnicode_AsEncodedString(obj, NULL, NULL);
+    PyErr_Format(PyExc_TypeError, "expected bytes or str, not %.200s",
+                 Py_TYPE(obj)->tp_name);
+    return NULL;
+}
+
+/* As convert_bytes, but encodes str names as os.fsencode does, so
+ * that the names returned with names_as_str can be looked up again.
+ */
+static PyObject *convert_fsname(PyObject *obj) {
+    if(PyUnicode_Check(obj))
+        return PyUnicode_EncodeFSDefault(obj);
+    return convert_bytes(obj);
+}
+
+/* Decodes a name with the filesystem encoding and error handler, as
+ * os.fsdecode does; pure ASCII names (the vast majority) skip the
+ * decoder.
+ */
+static PyObject *name_to_str(const char *name, Py_ssize_t len) {
+    PyObject *res;
+    Py_ssize_t i;
+
+    for(i = 0; i < len; i++)
+        if((unsigned char) name[i] >= 0x80)
+            return PyUnicode_DecodeFSDefaultAndSize(name, len);
+    if((res = PyUnicode_New(len, 127)) == NULL)
+        return NULL;
+    memcpy(PyUnicode_DATA(res), name, (size_t) len);
+    return res;
+}
+
+/* Creates the Python object for an attribute name: bytes, or (if
+ * as_str) str. Str names are interned, as the same names recur
+ * across items.
+ */
+static PyObject *name_to_obj(const char *name, Py_ssize_t len, int as_str) {
+    PyObject *res;
+
+    if(!as_str)
+        return PyBytes_FromStringAndSize(name, len);
+    if((res = name_to_str(name, len)) != NULL)
+        PyUnicode_InternInPlace(&res);
+    return res;
+}
+
 #if defined(__APPLE__)
 static inline ssize_t _listxattr(const char *path, char *namebuf, size_t size) {
     return listxattr(path, namebuf, size, 0);
@@ -224,6 +310,9 @@ static inline int _fremovexattr(int filedes, const char *name) {
     return fremovexattr(filedes, name, 0);
 }
 
+/* errno value for a missing attribute */
+#define XATTR_ENOATTR ENOATTR
+
 #elif defined(__linux__) || defined(__GLIBC__)
 #define _listxattr(path, list, size) listxattr(path, list, size)
 #define _llistxattr(path, list, size) llistxattr(path, list, size)
@@ -241,22 +330,88 @@ static inline int _fremovexattr(int filedes, const char *name) {
 #define _lremovexattr(path, name)   lremovexattr(path, name)
 #define _fremovexattr(fd, name)     fremovexattr(fd, name)
 
+/* errno value for a missing attribute */
+#define XATTR_ENOATTR ENODATA
+
 #endif
 
 typedef ssize_t (*buf_getter)(target_t *tgt, const char *name,
                               void *output, size_t size);
 
+/* Raw I/O helpers; these must be called without holding the GIL, and
+   leave errno set on failure. */
+static ssize_t _list_raw(target_t *tgt, void *list, size_t size) {
+    if(tgt->type == T_FD)
+        return _flistxattr(tgt->fd, list, size);
+    else if (tgt->type == T_LINK)
+        return _llistxattr(tgt->name, list, size);
+    else
+        return _listxattr(tgt->name, list, size);
+}
+
+static ssize_t _get_raw(target_t *tgt, const char *name, void *value,
+                        size_t size) {
+    if(tgt->type == T_FD)
+        return _fgetxattr(tgt->fd, name, value, size);
+    else if (tgt->type == T_LINK)
+        return _lgetxattr(tgt->name, name, value, size);
+    else
+        return _getxattr(tgt->name, name, value, size);
+}
+
+static int _set_raw(target_t *tgt, const char *name,
+                    const void *value, size_t size, int flags) {
+    if(tgt->type == T_FD)
+        return _fsetxattr(tgt->fd, name, value, size, flags);
+    else if (tgt->type == T_LINK)
+        return _lsetxattr(tgt->name, name, value, size, flags);
+    else
+        return _setxattr(tgt->name, name, value, size, flags);
+}
+
+static int _remove_raw(target_t *tgt, const char *name) {
+    if(tgt->type == T_FD)
+        return _fremovexattr(tgt->fd, name);
+    else if (tgt->type == T_LINK)
+        return _lremovexattr(tgt->name, name);
+    else
+        return _removexattr(tgt->name, name);
+}
+
+/* Sets an attribute only if its current value differs from the given
+ * one. The scratch buffer must be at least size bytes long; it is
+ * used to read the current value, which can only be equal if it fits
+ * exactly in size bytes (a larger one fails with ERANGE).
+ *
+ * Must be called without the GIL. Returns 1 if the value was written,
+ * 0 if it was already up to date, and -1 (with errno set) on failure.
+ */
+static int _set_if_changed_raw(target_t *tgt, const char *name,
+                               const char *value, size_t size,
+                               char *scratch, int flags) {
+    ssize_t cur;
+    /* With XATTR_CREATE, any existing attribute must fail the write
+       (as with set), even one already holding this value */
+    if(!(flags & XATTR_CREATE)) {
+        cur = _get_raw(tgt, name, scratch, size);
+        if(cur >= 0 && (size_t) cur == size &&
+           (size == 0 || memcmp(scratch, value, size) == 0))
+            return 0;
+    }
+    /* Any read failure (missing attribute, larger value, etc.) means we
+       need to write; if the failure is persistent, the write will
+       report it. */
+    if(_set_raw(tgt, name, value, size, flags) == -1)
+        return -1;
+    return 1;
+}
+
 static ssize_t _list_obj(target_t *tgt, const char *unused, void *list,
                          size_t size) {
     ssize_t ret;
 
     Py_BEGIN_ALLOW_THREADS;
-    if(tgt->type == T_FD)
-        ret = _flistxattr(tgt->fd, list, size);
-    else if (tgt->type == T_LINK)
-        ret = _llistxattr(tgt->name, list, size);
-    else
-        ret = _listxattr(tgt->name, list, size);
+    ret = _list_raw(tgt, list, size);
     Py_END_ALLOW_THREADS;
     return ret;
 }
@@ -265,12 +420,7 @@ static ssize_t _get_obj(target_t *tgt, const char *name, void *value,
                         size_t size) {
     ssize_t ret;
     Py_BEGIN_ALLOW_THREADS;
-    if(tgt->type == T_FD)
-        ret = _fgetxattr(tgt->fd, name, value, size);
-    else if (tgt->type == T_LINK)
-        ret = _lgetxattr(tgt->name, name, value, size);
-    else
-        ret = _getxattr(tgt->name, name, value, size);
+    ret = _get_raw(tgt, name, value, size);
     Py_END_ALLOW_THREADS;
     return ret;
 }
@@ -279,12 +429,7 @@ static int _set_obj(target_t *tgt, const char *name,
                     const void *value, size_t size, int flags) {
     int ret;
     Py_BEGIN_ALLOW_THREADS;
-    if(tgt->type == T_FD)
-        ret = _fsetxattr(tgt->fd, name, value, size, flags);
-    else if (tgt->type == T_LINK)
-        ret = _lsetxattr(tgt->name, name, value, size, flags);
-    else
-        ret = _setxattr(tgt->name, name, value, size, flags);
+    ret = _set_raw(tgt, name, value, size, flags);
     Py_END_ALLOW_THREADS;
     return ret;
 }
@@ -292,12 +437,7 @@ static int _set_obj(target_t *tgt, const char *name,
 static int _remove_obj(target_t *tgt, const char *name) {
     int ret;
     Py_BEGIN_ALLOW_THREADS;
-    if(tgt->type == T_FD)
-        ret = _fremovexattr(tgt->fd, name);
-    else if (tgt->type == T_LINK)
-        ret = _lremovexattr(tgt->name, name);
-    else
-        ret = _removexattr(tgt->name, name);
+    ret = _remove_raw(tgt, name);
     Py_END_ALLOW_THREADS;
     return ret;
 }
@@ -321,8 +461,10 @@ static int _remove_obj(target_t *tgt, const char *name) {
  *
  * Return value: if positive or zero, buffer will contain the read
  * value. Otherwise, io_errno will contain the I/O errno, or zero
- * to signify a Python-level error. In all cases, the Python-level
- * error is set to the appropriate value.
+ * to signify a Python-level error. The Python-level error is set to
+ * the appropriate value, except for a missing attribute when io_errno
+ * is non-NULL: callers asking for the errno handle that case
+ * themselves, and creating an exception just to clear it is costly.
  */
 static ssize_t _generic_get(buf_getter getter, target_t *tgt,
                             const char *name,
@@ -342,13 +484,15 @@ static ssize_t _generic_get(buf_getter getter, target_t *tgt,
     *io_errno = 0;
   }
 
-#define EXIT_IOERROR()                 \
-  {                                    \
-    if (io_errno != NULL) {            \
-        *io_errno = errno;             \
-    }                                  \
-    PyErr_SetFromErrno(PyExc_IOError); \
-    return -1;                         \
+#define EXIT_IOERROR()                         \
+  {                                            \
+    if (io_errno != NULL) {                    \
+        *io_errno = errno;                     \
+        if (errno == XATTR_ENOATTR)            \
+            return -1;                         \
+    }                                          \
+    PyErr_SetFromErrno(PyExc_IOError);         \
+    return -1;                                 \
   }
 
   /* Initialize the buffer, if needed. */
@@ -387,6 +531,105 @@ static ssize_t _generic_get(buf_getter getter, target_t *tgt,
 #undef EXIT_IOERROR
 }
 
+/* Like _generic_get, but the first attempt is done into the on-stack
+ * buffer small (of ESTIMATE_ATTR_SIZE bytes), so that small values
+ * and lists don't touch the heap at all; only if that is too small,
+ * *buffer is allocated (with the probed size) as in _generic_get.
+ *
+ * On success, *data points to the buffer holding the result.
+ */
+static ssize_t _get_small(buf_getter getter, target_t *tgt,
+                          const char *name, char *small, const char **data,
+                          char **buffer, size_t *size, int *io_errno)
+    CPYCHECKER_NEGATIVE_RESULT_SETS_EXCEPTION;
+
+static ssize_t _get_small(buf_getter getter, target_t *tgt,
+                          const char *name, char *small, const char **data,
+                          char **buffer, size_t *size, int *io_errno) {
+  ssize_t res;
+
+  if (io_errno != NULL) {
+    *io_errno = 0;
+  }
+  if((res = getter(tgt, name, small, ESTIMATE_ATTR_SIZE)) != -1) {
+    *data = small;
+    return res;
+  }
+  if(errno == ERANGE)
+    res = getter(tgt, name, NULL, 0);
+  if(res == -1) {
+    if (io_errno != NULL) {
+      *io_errno = errno;
+    }
+    if (io_errno == NULL || errno != XATTR_ENOATTR)
+      PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+  /* Allocate the heap buffer with the right size upfront */
+  if(*buffer == NULL && *size < (size_t) res)
+    *size = (size_t) res;
+  res = _generic_get(getter, tgt, name, buffer, size, io_errno);
+  *data = *buffer;
+  return res;
+}
+
+/* Reads a value into a new bytes object. Small values are read on
+ * the stack first, and then copied into an exactly-sized object;
+ * larger ones are read straight into an object of the probed size,
+ * avoiding both an intermediate buffer and the copy out of it.
+ *
+ * Returns a new reference, or NULL; errors are handled as in
+ * _generic_get, i.e. a missing attribute doesn't set an exception if
+ * io_errno is non-NULL.
+ */
+static PyObject *_get_bytes(target_t *tgt, const char *name, int *io_errno) {
+  PyObject *res;
+  char small[ESTIMATE_ATTR_SIZE];
+  size_t size;
+  ssize_t nret;
+  int err;
+
+  if (io_errno != NULL) {
+    *io_errno = 0;
+  }
+  if((nret = _get_obj(tgt, name, small, sizeof(small))) != -1)
+    return PyBytes_FromStringAndSize(small, nret);
+  /* Saved right away, as freeing objects might clobber errno */
+  err = errno;
+  res = NULL;
+  for(;;) {
+    if(err == ERANGE) {
+      nret = _get_obj(tgt, name, NULL, 0);
+      err = errno;
+    }
+    Py_XDECREF(res);
+    if(nret == -1) {
+      if (io_errno != NULL) {
+        *io_errno = err;
+      }
+      if (io_errno == NULL || err != XATTR_ENOATTR) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_IOError);
+      }
+      return NULL;
+    }
+    /* A new object on retries, rather than a resize, which would
+       copy the (meaningless) old contents */
+    size = (size_t) nret;
+    if((res = PyBytes_FromStringAndSize(NULL, nret)) == NULL)
+      return NULL;
+    /* A zero-sized read would only probe again */
+    if(size == 0)
+      return res;
+    if((nret = _get_obj(tgt, name, PyBytes_AS_STRING(res), size)) != -1)
+      break;
+    err = errno;
+  }
+  if((size_t) nret != size && _PyBytes_Resize(&res, nret) < 0)
+    return NULL;
+  return res;
+}
+
 /*
    Checks if an attribute name matches an optional namespace.
 
@@ -409,715 +652,7175 @@ const char *matches_ns(const char *ns, const char *name) {
     return NULL;
 }
 
-/* Wrapper for getxattr */
-static char __pygetxattr_doc__[] =
-    "getxattr(item, attribute[, nofollow=False])\n"
-    "Get the value of a given extended attribute (deprecated).\n"
-    "\n"
-    ITEM_DOC
-    NAME_GET_DOC
-    NOFOLLOW_DOC
-    "\n"
-    ".. deprecated:: 0.4\n"
-    "   this function has been deprecated\n"
-    "   by the :func:`get` function.\n"
-    ;
+/* A name filter, compiled once per call from the namespace,
+   namespaces and name_glob arguments, so that scanning a list buffer
+   needs no per-name strlen() of the patterns. */
+typedef struct {
+    const char *str;
+    size_t len;
+} filter_prefix_t;
 
-static PyObject *
-pygetxattr(PyObject *self, PyObject *args)
-{
-    PyObject *myarg;
-    target_t tgt;
-    int nofollow = 0;
-    char *attrname = NULL;
-    char *buf = NULL;
-    ssize_t nret;
-    size_t nalloc = 0;
-    PyObject *res;
+typedef struct {
+    const char *ns;             /* stripped from the matching names */
+    size_t ns_len;
+    filter_prefix_t *prefixes;  /* NULL if not filtering on namespaces */
+    size_t nprefixes;
+    PyObject *seq;              /* owns the prefixes' strings */
+    const char *glob;
+    size_t glob_lit;            /* length of the glob's literal prefix */
+} name_filter_t;
+
+static int filter_init(name_filter_t *f, const char *ns,
+                       PyObject *namespaces, const char *glob) {
+    Py_ssize_t i, n;
+
+    memset(f, 0, sizeof(*f));
+    if(ns != NULL) {
+        f->ns = ns;
+        f->ns_len = strlen(ns);
+    }
+    if(glob != NULL) {
+        f->glob = glob;
+        f->glob_lit = strcspn(glob, "*?[");
+    }
+    if(namespaces == NULL || namespaces == Py_None)
+        return 0;
+    /* An empty namespace means no namespace filtering, as usual */
+    if(f->ns_len > 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "namespace and namespaces can't be used together");
+        return -1;
+    }
+    if((f->seq = PySequence_Fast(namespaces,
+                                 "namespaces must be a sequence")) == NULL)
+        return -1;
+    n = PySequence_Fast_GET_SIZE(f->seq);
+    if((f->prefixes = PyMem_New(filter_prefix_t, (size_t) n + 1)) == NULL) {
+        PyErr_NoMemory();
+        goto err;
+    }
+    for(i = 0; i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(f->seq, i);
+        char *str;
+
+        if(!PyBytes_Check(item)) {
+            PyErr_Format(PyExc_TypeError,
+                         "namespaces must contain bytes, not %.200s",
+                         Py_TYPE(item)->tp_name);
+            goto err;
+        }
+        /* Rejects embedded null bytes */
+        if(PyBytes_AsStringAndSize(item, &str, NULL) < 0)
+            goto err;
+        f->prefixes[i].str = str;
+        f->prefixes[i].len = (size_t) PyBytes_GET_SIZE(item);
+    }
+    f->nprefixes = (size_t) n;
+    return 0;
 
-    /* Parse the arguments */
-    if (!PyArg_ParseTuple(args, "Oet|i", &myarg, NULL, &attrname, &nofollow))
-        return NULL;
-    if(convert_obj(myarg, &tgt, nofollow) < 0) {
-        res = NULL;
-        goto free_arg;
+ err:
+    PyMem_Free(f->prefixes);
+    f->prefixes = NULL;
+    Py_CLEAR(f->seq);
+    return -1;
+}
+
+static void filter_free(name_filter_t *f) {
+    PyMem_Free(f->prefixes);
+    Py_XDECREF(f->seq);
+}
+
+/* As matches_ns, for a compiled filter; the (cheap) namespace checks
+   run first, so that the glob only sees names which passed them. */
+static const char *filter_match(const name_filter_t *f, const char *name) {
+    size_t i;
+
+    if(f->ns_len > 0) {
+        if(strncmp(name, f->ns, f->ns_len) != 0 ||
+           name[f->ns_len] != '.' || name[f->ns_len + 1] == '\0')
+            return NULL;
+    }
+    if(f->prefixes != NULL) {
+        for(i = 0; i < f->nprefixes; i++) {
+            const filter_prefix_t *p = &f->prefixes[i];
+            if(p->len == 0 ||
+               (strncmp(name, p->str, p->len) == 0 &&
+                name[p->len] == '.' && name[p->len + 1] != '\0'))
+                break;
+        }
+        if(i == f->nprefixes)
+            return NULL;
     }
+    if(f->glob != NULL &&
+       (strncmp(name, f->glob, f->glob_lit) != 0 ||
+        fnmatch(f->glob, name, FNM_NOESCAPE) != 0))
+        return NULL;
+    return f->ns_len > 0 ? name + f->ns_len + 1 : name;
+}
 
-    nret = _generic_get(_get_obj, &tgt, attrname, &buf, &nalloc, NULL);
-    if (nret == -1) {
-      res = NULL;
-      goto free_buf;
+/* Hashing helper (64-bit FNV-1a); the seed allows chaining calls */
+#define XATTR_HASH_INIT 0xcbf29ce484222325ULL
+
+static uint64_t xattr_hash(const void *data, size_t len, uint64_t h) {
+    const unsigned char *p = data;
+    while(len-- > 0) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
     }
-    /* Create the string which will hold the result */
-    res = PyBytes_FromStringAndSize(buf, nret);
+    return h;
+}
 
- free_buf:
-    /* Free the buffer, now it is no longer needed */
-    PyMem_Free(buf);
-    free_tgt(&tgt);
- free_arg:
-    PyMem_Free(attrname);
+/* Hashes an integer, as 8 little-endian bytes */
+static uint64_t xattr_hash_u64(uint64_t v, uint64_t h) {
+    unsigned char buf[8];
+    int i;
+    for(i = 0; i < 8; i++)
+        buf[i] = (unsigned char) (v >> (8 * i));
+    return xattr_hash(buf, sizeof(buf), h);
+}
 
-    /* Return the result */
+/* Interning of values: an open-addressing hash table of bytes objects,
+ * keyed by hash and length, which stops growing once its memory
+ * budget is used up (already interned values are still shared).
+ */
+
+#define INTERN_DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+#define INTERN_DEFAULT_MAX_VALUE_SIZE 1024
+
+typedef struct {
+    uint64_t hash;
+    PyObject *value;    /* NULL for empty slots */
+} intern_slot_t;
+
+typedef struct {
+    PyObject_HEAD
+    intern_slot_t *slots;
+    size_t nslots, count;
+    size_t size, max_size;      /* accounted memory, in bytes */
+    Py_ssize_t max_value_size;
+    Py_ssize_t hits, misses;
+} InternTableObject;
+
+static PyTypeObject InternTableType;
+
+/* Approximate memory cost of an interned value, slots included */
+static size_t intern_cost(Py_ssize_t len) {
+    return (size_t) len + sizeof(PyBytesObject) + 2 * sizeof(intern_slot_t);
+}
+
+static void intern_clear(InternTableObject *t) {
+    size_t i;
+    for(i = 0; i < t->nslots; i++)
+        Py_XDECREF(t->slots[i].value);
+    PyMem_Free(t->slots);
+    t->slots = NULL;
+    t->nslots = t->count = t->size = 0;
+}
+
+/* Doubles the slot array; returns -1 on memory errors, without an
+   exception, since the table keeps working without growing */
+static int intern_grow(InternTableObject *t) {
+    size_t nslots = t->nslots == 0 ? 64 : t->nslots * 2, i, j;
+    intern_slot_t *slots = PyMem_Calloc(nslots, sizeof(intern_slot_t));
+    if(slots == NULL)
+        return -1;
+    for(i = 0; i < t->nslots; i++) {
+        if(t->slots[i].value == NULL)
+            continue;
+        j = (size_t) t->slots[i].hash & (nslots - 1);
+        while(slots[j].value != NULL)
+            j = (j + 1) & (nslots - 1);
+        slots[j] = t->slots[i];
+    }
+    PyMem_Free(t->slots);
+    t->slots = slots;
+    t->nslots = nslots;
+    return 0;
+}
+
+/* Returns a new reference to a bytes object with the given contents,
+   shared with earlier calls if possible; t can be NULL. */
+static PyObject *intern_bytes(InternTableObject *t, const char *buf,
+                              Py_ssize_t len) {
+    PyObject *res = NULL;
+    uint64_t hash;
+    size_t i;
+
+    if(t == NULL || len > t->max_value_size)
+        return PyBytes_FromStringAndSize(buf, len);
+    hash = xattr_hash(buf, (size_t) len, XATTR_HASH_INIT);
+    Py_BEGIN_CRITICAL_SECTION(t);
+    i = (size_t) hash & (t->nslots - 1);
+    for(; t->nslots > 0 && t->slots[i].value != NULL;
+        i = (i + 1) & (t->nslots - 1)) {
+        PyObject *v = t->slots[i].value;
+        if(t->slots[i].hash == hash && PyBytes_GET_SIZE(v) == len &&
+           !memcmp(PyBytes_AS_STRING(v), buf, (size_t) len)) {
+            t->hits++;
+            Py_INCREF(v);
+            res = v;
+            break;
+        }
+    }
+    if(res == NULL) {
+        t->misses++;
+        res = PyBytes_FromStringAndSize(buf, len);
+        /* Keep the load factor under 1/2, within the budget */
+        if(res != NULL && t->size + intern_cost(len) <= t->max_size &&
+           ((t->count + 1) * 2 <= t->nslots || intern_grow(t) == 0)) {
+            i = (size_t) hash & (t->nslots - 1);
+            while(t->slots[i].value != NULL)
+                i = (i + 1) & (t->nslots - 1);
+            t->slots[i].hash = hash;
+            t->slots[i].value = res;
+            Py_INCREF(res);
+            t->count++;
+            t->size += intern_cost(len);
+        }
+    }
+    Py_END_CRITICAL_SECTION();
     return res;
 }
 
-/* Wrapper for getxattr */
-static char __get_doc__[] =
-    "get(item, name[, nofollow=False, namespace=None])\n"
-    "Get the value of a given extended attribute.\n"
-    "\n"
-    "Example:\n"
-    "    >>> xattr.get('/path/to/file', 'user.comment')\n"
-    "    b'test'\n"
-    "    >>> xattr.get('/path/to/file', 'comment', namespace=xattr.NS_USER)\n"
-    "    b'test'\n"
-    "\n"
-    ITEM_DOC
-    NAME_GET_DOC
-    NOFOLLOW_DOC
-    NS_DOC
-    ":return: the value of the extended attribute (can contain NULLs)\n"
-    ":rtype: bytes\n"
-    ":raises EnvironmentError: caused by any system errors\n"
-    "\n"
-    ".. versionadded:: 0.4\n"
-    NS_CHANGED_DOC
-    ;
+/* Parses an optional intern argument */
+static int intern_arg(PyObject *obj, InternTableObject **t) {
+    if(obj == NULL || obj == Py_None) {
+        *t = NULL;
+        return 0;
+    }
+    if(!PyObject_TypeCheck(obj, &InternTableType)) {
+        PyErr_Format(PyExc_TypeError,
+                     "intern must be an InternTable or None, not %.200s",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    *t = (InternTableObject *) obj;
+    return 0;
+}
 
 static PyObject *
-xattr_get(PyObject *self, PyObject *args, PyObject *keywds)
+intern_new(PyTypeObject *type, PyObject *args, PyObject *keywds)
 {
-    PyObject *myarg;
-    target_t tgt;
-    int nofollow = 0;
-    char *attrname = NULL, *namebuf;
-    const char *fullname;
-    char *buf = NULL;
-    const char *ns = NULL;
-    ssize_t nret;
-    size_t nalloc = 0;
-    PyObject *res = NULL;
-    static char *kwlist[] = {"item", "name", "nofollow", "namespace", NULL};
+    InternTableObject *t;
+    Py_ssize_t max_size = INTERN_DEFAULT_MAX_SIZE;
+    Py_ssize_t max_value_size = INTERN_DEFAULT_MAX_VALUE_SIZE;
+    static char *kwlist[] = {"max_size", "max_value_size", NULL};
 
-    /* Parse the arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|iy", kwlist,
-                                     &myarg, NULL, &attrname, &nofollow, &ns))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "|nn", kwlist,
+                                     &max_size, &max_value_size))
+        return NULL;
+    if(max_size < 0 || max_value_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "sizes must not be negative");
         return NULL;
-    res = NULL;
-    if(convert_obj(myarg, &tgt, nofollow) < 0) {
-        goto free_arg;
-    }
-
-    if(merge_ns(ns, attrname, &fullname, &namebuf) < 0) {
-        goto free_tgt;
     }
+    if((t = (InternTableObject *) type->tp_alloc(type, 0)) == NULL)
+        return NULL;
+    t->max_size = (size_t) max_size;
+    t->max_value_size = max_value_size;
+    return (PyObject *) t;
+}
 
-    nret = _generic_get(_get_obj, &tgt, fullname, &buf, &nalloc, NULL);
-    if(nret == -1) {
-      goto free_buf;
-    }
+static void
+intern_dealloc(InternTableObject *self)
+{
+    intern_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
 
-    /* Create the string which will hold the result */
-    res = PyBytes_FromStringAndSize(buf, nret);
+static char __intern_clear_doc__[] =
+    "clear()\n"
+    "Drop all the interned values, and reset the statistics.\n"
+    ;
 
-    /* Free the buffers, they are no longer needed */
- free_buf:
-    PyMem_Free(buf);
-    PyMem_Free(namebuf);
- free_tgt:
-    free_tgt(&tgt);
- free_arg:
-    PyMem_Free(attrname);
+static PyObject *
+intern_clear_method(InternTableObject *self, PyObject *unused)
+{
+    Py_BEGIN_CRITICAL_SECTION(self);
+    intern_clear(self);
+    self->hits = self->misses = 0;
+    Py_END_CRITICAL_SECTION();
+    Py_RETURN_NONE;
+}
 
-    /* Return the result */
+static Py_ssize_t
+intern_len(InternTableObject *self)
+{
+    Py_ssize_t res;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    res = (Py_ssize_t) self->count;
+    Py_END_CRITICAL_SECTION();
     return res;
 }
 
-/* Wrapper for getxattr */
-static char __get_all_doc__[] =
-    "get_all(item[, nofollow=False, namespace=None])\n"
-    "Get all the extended attributes of an item.\n"
+static PyObject *
+intern_get_stat(InternTableObject *self, void *closure)
+{
+    Py_ssize_t res;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    switch((int) (intptr_t) closure) {
+    case 0: res = self->hits; break;
+    case 1: res = self->misses; break;
+    default: res = (Py_ssize_t) self->size; break;
+    }
+    Py_END_CRITICAL_SECTION();
+    return PyLong_FromSsize_t(res);
+}
+
+static PyMethodDef intern_methods[] = {
+    {"clear", (PyCFunction) intern_clear_method, METH_NOARGS,
+     __intern_clear_doc__ },
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyGetSetDef intern_getset[] = {
+    {"hits", (getter) intern_get_stat, NULL,
+     "number of lookups which returned an interned value", (void *) 0},
+    {"misses", (getter) intern_get_stat, NULL,
+     "number of lookups which created a new value", (void *) 1},
+    {"size", (getter) intern_get_stat, NULL,
+     "approximate memory used by the interned values, in bytes",
+     (void *) 2},
+    {NULL}
+};
+
+static PySequenceMethods intern_as_sequence = {
+    .sq_length = (lenfunc) intern_len,
+};
+
+static char __intern_type_doc__[] =
+    "InternTable([max_size=16777216, max_value_size=1024])\n"
+    "A table of interned attribute names and values.\n"
+    "\n"
+    "When passed to :func:`get_all` (via its *intern* argument), equal\n"
+    "names and values are returned as the same (shared) bytes objects,\n"
+    "which saves memory when scanning many items with repetitive\n"
+    "attributes, such as ``security.selinux`` labels. The table can be\n"
+    "reused across calls, and from multiple threads.\n"
     "\n"
-    "This function performs a bulk-get of all extended attribute names\n"
-    "and the corresponding value.\n"
     "Example:\n"
     "\n"
-    "    >>> xattr.get_all('/path/to/file')\n"
-    "    [(b'user.mime-type', b'plain/text'), (b'user.comment', b'test'),\n"
-    "     (b'system.posix_acl_access', b'\\x02\\x00...')]\n"
-    "    >>> xattr.get_all('/path/to/file', namespace=xattr.NS_USER)\n"
-    "    [(b'mime-type', b'plain/text'), (b'comment', b'test')]\n"
+    "    >>> table = xattr.InternTable()\n"
+    "    >>> attrs = [xattr.get_all(f, intern=table) for f in files]\n"
     "\n"
-    ITEM_DOC
-    ":keyword namespace: an optional namespace for filtering the\n"
-    "   attributes; for example, querying all user attributes can be\n"
-    "   accomplished by passing namespace=:const:`NS_USER`\n"
-    ":type namespace: string\n"
-    NOFOLLOW_DOC
-    ":return: list of tuples (name, value); note that if a namespace\n"
-    "   argument was passed, it (and the separator) will be stripped from\n"
-    "   the names returned\n"
-    ":rtype: list[(bytes, bytes)]\n"
-    ":raises EnvironmentError: caused by any system errors\n"
+    ":param max_size: the memory budget of the table, in bytes; once\n"
+    "    it is used up, new values are no longer interned\n"
+    ":type max_size: int\n"
+    ":param max_value_size: values larger than this are never interned\n"
+    ":type max_value_size: int\n"
     "\n"
-    ".. note:: Since reading the whole attribute list is not an atomic\n"
-    "   operation, it might be possible that attributes are added\n"
-    "   or removed between the initial query and the actual reading\n"
-    "   of the attributes; the returned list will contain only the\n"
-    "   attributes that were present at the initial listing of the\n"
-    "   attribute names and that were still present when the read\n"
-    "   attempt for the value is made.\n"
-    ".. versionadded:: 0.4\n"
-    NS_CHANGED_DOC
+    ".. versionadded:: 0.9\n"
     ;
 
-static PyObject *
-get_all(PyObject *self, PyObject *args, PyObject *keywds)
-{
-    PyObject *myarg, *res;
-    int nofollow=0;
-    const char *ns = NULL;
-    char *buf_list = NULL, *buf_val = NULL;
-    const char *s;
-    size_t nalloc = 0;
-    ssize_t nlist, nval;
-    PyObject *mylist;
-    target_t tgt;
-    static char *kwlist[] = {"item", "nofollow", "namespace", NULL};
-    int io_errno;
+static PyTypeObject InternTableType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "xattr.InternTable",
+    .tp_basicsize = sizeof(InternTableObject),
+    .tp_dealloc = (destructor) intern_dealloc,
+    .tp_as_sequence = &intern_as_sequence,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = __intern_type_doc__,
+    .tp_methods = intern_methods,
+    .tp_getset = intern_getset,
+    .tp_new = intern_new,
+};
 
-    /* Parse the arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iy", kwlist,
-                                     &myarg, &nofollow, &ns))
-        return NULL;
-    if(convert_obj(myarg, &tgt, nofollow) < 0)
-        return NULL;
+/* Schemas: the types of known attributes, used to decode their values
+ * while reading them; kept as an array sorted by name, for binary
+ * searching.
+ */
 
-    res = NULL;
-    /* Compute first the list of attributes */
-    nlist = _generic_get(_list_obj, &tgt, NULL, &buf_list,
-                         &nalloc, &io_errno);
-    if (nlist == -1) {
-      /* We can't handle any errors, and the Python error is already
-         set, just bail out. */
-      goto free_tgt;
+typedef enum {
+    SCHEMA_BYTES = 0,
+    SCHEMA_U64,
+    SCHEMA_I64,
+    SCHEMA_UTF8,
+} schema_type_t;
+
+static const char *schema_type_names[] = {"bytes", "u64", "i64", "utf8"};
+
+typedef struct {
+    char *name;
+    schema_type_t type;
+} schema_field_t;
+
+typedef struct {
+    PyObject_HEAD
+    schema_field_t *fields;
+    Py_ssize_t count;
+} SchemaObject;
+
+static PyTypeObject SchemaType;
+
+static int schema_cmp_fields(const void *x, const void *y) {
+    return strcmp(((const schema_field_t *) x)->name,
+                  ((const schema_field_t *) y)->name);
+}
+
+/* Returns the type of an attribute (by full name); schema can be NULL */
+static schema_type_t schema_lookup(SchemaObject *schema, const char *name) {
+    Py_ssize_t lo = 0, hi;
+
+    if(schema == NULL)
+        return SCHEMA_BYTES;
+    hi = schema->count;
+    while(lo < hi) {
+        Py_ssize_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(schema->fields[mid].name, name);
+        if(c == 0)
+            return schema->fields[mid].type;
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return SCHEMA_BYTES;
+}
 
-    /* Create the list which will hold the result. */
-    mylist = PyList_New(0);
-    if(mylist == NULL) {
-      goto free_buf_list;
+/* Checks that a value has the right size for its type */
+static int schema_check(schema_type_t type, const char *name,
+                        Py_ssize_t len) {
+    if((type == SCHEMA_U64 || type == SCHEMA_I64) && len != 8) {
+        PyErr_Format(PyExc_ValueError,
+                     "attribute %s: expected an 8-byte value, "
+                     "got %zd bytes", name, len);
+        return -1;
     }
+    return 0;
+}
 
-    nalloc = 0;
-    /* Create and insert the attributes as strings in the list */
-    for(s = buf_list; s - buf_list < nlist; s += strlen(s) + 1) {
-        PyObject *my_tuple;
-        const char *name;
+/* Returns the max_value_size to use for a value of the given type:
+   integers are at most 8 bytes, so they are always read (and larger
+   values fail the check), rather than reported by their size, which
+   couldn't be told apart from a decoded value */
+static Py_ssize_t schema_cap(schema_type_t type, Py_ssize_t max_size) {
+    if((type == SCHEMA_U64 || type == SCHEMA_I64) &&
+       max_size >= 0 && max_size < 8)
+        return 8;
+    return max_size;
+}
 
-        if((name = matches_ns(ns, s)) == NULL)
-            continue;
-        /* Now retrieve the attribute value */
-        nval = _generic_get(_get_obj, &tgt, s, &buf_val, &nalloc, &io_errno);
-        if (nval == -1) {
-          if (io_errno == ENODATA) {
-            PyErr_Clear();
-            continue;
-          } else {
-            Py_DECREF(mylist);
-            goto free_buf_val;
-          }
+/* Decodes a value according to its type, after checking it (unless
+   name is NULL); bytes values are interned if a table is given.
+   Returns a new reference, or NULL. */
+static PyObject *schema_decode(schema_type_t type, const char *name,
+                               const char *buf, Py_ssize_t len,
+                               InternTableObject *table) {
+    unsigned long long v = 0;
+    int i;
+
+    if(name != NULL && schema_check(type, name, len) < 0)
+        return NULL;
+    switch(type) {
+    case SCHEMA_U64:
+    case SCHEMA_I64:
+        for(i = 7; i >= 0; i--)
+            v = (v << 8) | (unsigned char) buf[i];
+        if(type == SCHEMA_I64)
+            return PyLong_FromLongLong((long long) (int64_t) v);
+        return PyLong_FromUnsignedLongLong(v);
+    case SCHEMA_UTF8:
+        return PyUnicode_DecodeUTF8(buf, len, NULL);
+    default:
+        return intern_bytes(table, buf, len);
+    }
+}
+
+/* Parses an optional schema argument */
+static int schema_arg(PyObject *obj, SchemaObject **schema) {
+    if(obj == NULL || obj == Py_None) {
+        *schema = NULL;
+        return 0;
+    }
+    if(!PyObject_TypeCheck(obj, &SchemaType)) {
+        PyErr_Format(PyExc_TypeError,
+                     "schema must be a Schema or None, not %.200s",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    *schema = (SchemaObject *) obj;
+    return 0;
+}
+
+static void schema_free_fields(schema_field_t *fields, Py_ssize_t count) {
+    Py_ssize_t i;
+    for(i = 0; i < count; i++)
+        PyMem_Free(fields[i].name);
+    PyMem_Free(fields);
+}
+
+static PyObject *
+schema_new(PyTypeObject *type, PyObject *args, PyObject *keywds)
+{
+    SchemaObject *schema;
+    PyObject *types, *key, *value;
+    schema_field_t *fields;
+    Py_ssize_t pos = 0, count = 0, i;
+    static char *kwlist[] = {"types", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O!", kwlist,
+                                     &PyDict_Type, &types))
+        return NULL;
+    if((fields = PyMem_New(schema_field_t, PyDict_GET_SIZE(types) + 1))
+       == NULL)
+        return PyErr_NoMemory();
+    while(PyDict_Next(types, &pos, &key, &value)) {
+        PyObject *name;
+        const char *tname;
+        schema_type_t t;
+
+        if(!PyUnicode_Check(value)) {
+            PyErr_Format(PyExc_TypeError, "schema types must be str, "
+                         "not %.200s", Py_TYPE(value)->tp_name);
+            goto err;
         }
-        my_tuple = Py_BuildValue("yy#", name, buf_val, nval);
-        if (my_tuple == NULL) {
-          Py_DECREF(mylist);
-          goto free_buf_val;
+        if((tname = PyUnicode_AsUTF8(value)) == NULL)
+            goto err;
+        for(t = SCHEMA_BYTES; t <= SCHEMA_UTF8; t++)
+            if(!strcmp(tname, schema_type_names[t]))
+                break;
+        if(t > SCHEMA_UTF8) {
+            PyErr_Format(PyExc_ValueError, "unknown schema type '%s'",
+                         tname);
+            goto err;
         }
-        int lappend_ret = PyList_Append(mylist, my_tuple);
-        Py_DECREF(my_tuple);
-        if(lappend_ret < 0) {
-            Py_DECREF(mylist);
-            goto free_buf_val;
+        if((name = convert_bytes(key)) == NULL)
+            goto err;
+        if(strlen(PyBytes_AS_STRING(name)) !=
+           (size_t) PyBytes_GET_SIZE(name)) {
+            Py_DECREF(name);
+            PyErr_SetString(PyExc_ValueError,
+                            "attribute names can't contain NUL bytes");
+            goto err;
         }
+        fields[count].name = PyMem_Malloc((size_t) PyBytes_GET_SIZE(name)
+                                          + 1);
+        if(fields[count].name == NULL) {
+            Py_DECREF(name);
+            PyErr_NoMemory();
+            goto err;
+        }
+        memcpy(fields[count].name, PyBytes_AS_STRING(name),
+               (size_t) PyBytes_GET_SIZE(name) + 1);
+        fields[count++].type = t;
+        Py_DECREF(name);
     }
+    qsort(fields, (size_t) count, sizeof(schema_field_t), schema_cmp_fields);
+    /* str and bytes keys could name the same attribute */
+    for(i = 1; i < count; i++)
+        if(!strcmp(fields[i - 1].name, fields[i].name)) {
+            PyErr_Format(PyExc_ValueError, "duplicate attribute '%s'",
+                         fields[i].name);
+            goto err;
+        }
+    if((schema = (SchemaObject *) type->tp_alloc(type, 0)) == NULL)
+        goto err;
+    schema->fields = fields;
+    schema->count = count;
+    return (PyObject *) schema;
+
+ err:
+    schema_free_fields(fields, count);
+    return NULL;
+}
 
-    /* Successful exit */
-    res = mylist;
-
- free_buf_val:
-    PyMem_Free(buf_val);
+static void
+schema_dealloc(SchemaObject *self)
+{
+    schema_free_fields(self->fields, self->count);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
 
- free_buf_list:
-    PyMem_Free(buf_list);
+static Py_ssize_t
+schema_len(SchemaObject *self)
+{
+    return self->count;
+}
 
- free_tgt:
-    free_tgt(&tgt);
+static PyObject *
+schema_subscript(SchemaObject *self, PyObject *key)
+{
+    PyObject *name, *res = NULL;
+    Py_ssize_t lo = 0, hi = self->count;
 
-    /* Return the result */
+    if((name = convert_bytes(key)) == NULL)
+        return NULL;
+    while(lo < hi) {
+        Py_ssize_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(self->fields[mid].name, PyBytes_AS_STRING(name));
+        if(c == 0) {
+            res = PyUnicode_FromString(
+                schema_type_names[self->fields[mid].type]);
+            break;
+        }
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(res == NULL && !PyErr_Occurred())
+        PyErr_SetObject(PyExc_KeyError, key);
+    Py_DECREF(name);
     return res;
 }
 
+static PyMappingMethods schema_as_mapping = {
+    .mp_length = (lenfunc) schema_len,
+    .mp_subscript = (binaryfunc) schema_subscript,
+};
 
-static char __pysetxattr_doc__[] =
-    "setxattr(item, name, value[, flags=0, nofollow=False])\n"
-    "Set the value of a given extended attribute (deprecated).\n"
+static char __schema_type_doc__[] =
+    "Schema(types)\n"
+    "The types of known attributes, for decoding them while reading.\n"
     "\n"
-    "Be careful in case you want to set attributes on symbolic\n"
-    "links, you have to use all the 5 parameters; use 0 for the \n"
-    "flags value if you want the default behaviour (create or "
-    "replace)\n"
+    "When passed to :func:`get_all` (via its *schema* argument), the\n"
+    "values of the attributes named in the schema are decoded in C,\n"
+    "while they are read; other values are returned as bytes. The\n"
+    "supported types are:\n"
+    "\n"
+    "- ``'bytes'``: the raw value\n"
+    "- ``'u64'``, ``'i64'``: an 8-byte, little-endian, unsigned\n"
+    "  respectively signed integer, as written by :func:`set_u64`\n"
+    "- ``'utf8'``: a UTF-8 encoded string\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> schema = xattr.Schema({'user.expires': 'u64',\n"
+    "    ...                        'user.owner': 'utf8'})\n"
+    "    >>> xattr.get_all('/path/to/file', schema=schema)\n"
+    "    [(b'user.expires', 1767225600), (b'user.owner', 'alice')]\n"
+    "\n"
+    "Schemas map names to type names, and are immutable.\n"
+    "\n"
+    ":param types: the types of the attributes, by full name (including\n"
+    "    the namespace)\n"
+    ":type types: dict[bytes or str, str]\n"
+    ":raises ValueError: for unknown types\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyTypeObject SchemaType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "xattr.Schema",
+    .tp_basicsize = sizeof(SchemaObject),
+    .tp_dealloc = (destructor) schema_dealloc,
+    .tp_as_mapping = &schema_as_mapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = __schema_type_doc__,
+    .tp_new = schema_new,
+};
+
+/* Wrapper for getxattr */
+static char __pygetxattr_doc__[] =
+    "getxattr(item, attribute[, nofollow=False])\n"
+    "Get the value of a given extended attribute (deprecated).\n"
     "\n"
     ITEM_DOC
-    NAME_SET_DOC
-    VALUE_DOC
-    FLAGS_DOC
+    NAME_GET_DOC
     NOFOLLOW_DOC
     "\n"
     ".. deprecated:: 0.4\n"
     "   this function has been deprecated\n"
-    "   by the :func:`set` function.\n"
+    "   by the :func:`get` function.\n"
     ;
 
-/* Wrapper for setxattr */
 static PyObject *
-pysetxattr(PyObject *self, PyObject *args)
+pygetxattr(PyObject *self, PyObject *args)
 {
-    PyObject *myarg, *res;
+    PyObject *myarg;
+    target_t tgt;
     int nofollow = 0;
     char *attrname = NULL;
-    char *buf = NULL;
-    Py_ssize_t bufsize_s;
-    size_t bufsize;
-    int nret;
-    int flags = 0;
-    target_t tgt;
+    PyObject *res;
 
     /* Parse the arguments */
-    if (!PyArg_ParseTuple(args, "Oetet#|ii", &myarg, NULL, &attrname,
-                          NULL, &buf, &bufsize_s, &flags, &nofollow))
+    if (!PyArg_ParseTuple(args, "Oet|i", &myarg, NULL, &attrname, &nofollow))
         return NULL;
-
-    if (bufsize_s < 0) {
-        PyErr_SetString(PyExc_ValueError,
-                        "negative value size?!");
-        res = NULL;
-        goto free_arg;
-    }
-    bufsize = (size_t) bufsize_s;
-
     if(convert_obj(myarg, &tgt, nofollow) < 0) {
         res = NULL;
         goto free_arg;
     }
 
-    /* Set the attribute's value */
-    nret = _set_obj(&tgt, attrname, buf, bufsize, flags);
+    res = _get_bytes(&tgt, attrname, NULL);
 
     free_tgt(&tgt);
-
-    if(nret == -1) {
-        res = PyErr_SetFromErrno(PyExc_IOError);
-        goto free_arg;
-    }
-
-    Py_INCREF(Py_None);
-    res = Py_None;
-
  free_arg:
     PyMem_Free(attrname);
-    PyMem_Free(buf);
 
     /* Return the result */
     return res;
 }
 
-static char __set_doc__[] =
-    "set(item, name, value[, flags=0, namespace=None])\n"
-    "Set the value of a given extended attribute.\n"
+/* Wrapper for getxattr */
+static char __get_doc__[] =
+    "get(item, name[, nofollow=False, namespace=None, default])\n"
+    "Get the value of a given extended attribute.\n"
     "\n"
     "Example:\n"
-    "\n"
-    "    >>> xattr.set('/path/to/file', 'user.comment', 'test')\n"
-    "    >>> xattr.set('/path/to/file', 'comment', 'test',"
-    " namespace=xattr.NS_USER)\n"
+    "    >>> xattr.get('/path/to/file', 'user.comment')\n"
+    "    b'test'\n"
+    "    >>> xattr.get('/path/to/file', 'comment', namespace=xattr.NS_USER)\n"
+    "    b'test'\n"
+    "    >>> xattr.get('/path/to/file', 'user.missing', default=None)\n"
     "\n"
     ITEM_DOC
-    NAME_SET_DOC
-    VALUE_DOC
-    FLAGS_DOC
+    NAME_GET_DOC
     NOFOLLOW_DOC
     NS_DOC
-    ":returns: None\n"
+    ":keyword default: if given, it is returned when the attribute\n"
+    "    doesn't exist, instead of raising an exception; this is much\n"
+    "    cheaper than catching the exception\n"
+    ":return: the value of the extended attribute (can contain NULLs)\n"
+    ":rtype: bytes\n"
     ":raises EnvironmentError: caused by any system errors\n"
     "\n"
     ".. versionadded:: 0.4\n"
-    NS_CHANGED_DOC
+    NS_CHANGED_DOC "\n"
+    ".. versionchanged:: 0.9\n"
+    "   The *default* argument was added.\n"
     ;
 
-/* Wrapper for setxattr */
 static PyObject *
-xattr_set(PyObject *self, PyObject *args, PyObject *keywds)
+xattr_get(PyObject *self, PyObject *args, PyObject *keywds)
 {
-    PyObject *myarg, *res;
-    int nofollow = 0;
-    char *attrname = NULL;
-    char *buf = NULL;
-    Py_ssize_t bufsize_s;
-    size_t bufsize;
-    int nret;
-    int flags = 0;
+    PyObject *myarg;
     target_t tgt;
+    int nofollow = 0;
+    char *attrname = NULL, *namebuf;
+    const char *fullname;
     const char *ns = NULL;
-    char *newname;
-    const char *full_name;
-    static char *kwlist[] = {"item", "name", "value", "flags",
-                             "nofollow", "namespace", NULL};
+    PyObject *res = NULL, *dflt = NULL;
+    int io_errno;
+    static char *kwlist[] = {"item", "name", "nofollow", "namespace",
+                             "default", NULL};
 
     /* Parse the arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oetet#|iiy",
-                                     kwlist, &myarg, NULL, &attrname, NULL,
-                                     &buf, &bufsize_s, &flags, &nofollow, &ns))
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|iyO", kwlist,
+                                     &myarg, NULL, &attrname, &nofollow, &ns,
+                                     &dflt))
         return NULL;
-
-    if (bufsize_s < 0) {
+    res = NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        goto free_arg;
+    }
+
+    if(merge_ns(ns, attrname, &fullname, &namebuf) < 0) {
+        goto free_tgt;
+    }
+
+    /* Only ask for the errno if there's a default, so that missing
+       attributes don't raise */
+    res = _get_bytes(&tgt, fullname, dflt == NULL ? NULL : &io_errno);
+    if(res == NULL && dflt != NULL && io_errno == XATTR_ENOATTR) {
+        Py_INCREF(dflt);
+        res = dflt;
+    }
+
+    /* Free the buffers, they are no longer needed */
+    PyMem_Free(namebuf);
+ free_tgt:
+    free_tgt(&tgt);
+ free_arg:
+    PyMem_Free(attrname);
+
+    /* Return the result */
+    return res;
+}
+
+#ifdef __APPLE__
+#define ST_TIMESPEC(st, which) ((st)->st_##which##timespec)
+#else
+#define ST_TIMESPEC(st, which) ((st)->st_##which##tim)
+#endif
+
+/* Sets the float and nanosecond fields of a stat_result time */
+static int stat_set_time(PyObject *dict, const char *name,
+                         const char *name_ns, const struct timespec *ts) {
+    PyObject *val;
+    int ret;
+
+    val = PyFloat_FromDouble((double) ts->tv_sec + ts->tv_nsec * 1e-9);
+    if(val == NULL)
+        return -1;
+    ret = PyDict_SetItemString(dict, name, val);
+    Py_DECREF(val);
+    if(ret < 0)
+        return -1;
+    val = PyLong_FromLongLong((long long) ts->tv_sec * 1000000000LL +
+                              ts->tv_nsec);
+    if(val == NULL)
+        return -1;
+    ret = PyDict_SetItemString(dict, name_ns, val);
+    Py_DECREF(val);
+    return ret;
+}
+
+/* Converts a struct stat into an os.stat_result */
+static PyObject *stat_to_obj(const struct stat *st) {
+    PyObject *os, *type, *seq = NULL, *dict = NULL, *res = NULL;
+
+    if((os = PyImport_ImportModule("os")) == NULL)
+        return NULL;
+    type = PyObject_GetAttrString(os, "stat_result");
+    Py_DECREF(os);
+    if(type == NULL)
+        return NULL;
+    seq = Py_BuildValue("(NKKNNNLLLL)",
+                        PyLong_FromUnsignedLong((unsigned long) st->st_mode),
+                        (unsigned long long) st->st_ino,
+                        (unsigned long long) st->st_dev,
+                        PyLong_FromUnsignedLong((unsigned long) st->st_nlink),
+                        PyLong_FromUnsignedLong((unsigned long) st->st_uid),
+                        PyLong_FromUnsignedLong((unsigned long) st->st_gid),
+                        (long long) st->st_size,
+                        (long long) ST_TIMESPEC(st, a).tv_sec,
+                        (long long) ST_TIMESPEC(st, m).tv_sec,
+                        (long long) ST_TIMESPEC(st, c).tv_sec);
+    dict = Py_BuildValue("{sLsLsK}",
+                         "st_blksize", (long long) st->st_blksize,
+                         "st_blocks", (long long) st->st_blocks,
+                         "st_rdev", (unsigned long long) st->st_rdev);
+    if(seq == NULL || dict == NULL ||
+       stat_set_time(dict, "st_atime", "st_atime_ns",
+                     &ST_TIMESPEC(st, a)) < 0 ||
+       stat_set_time(dict, "st_mtime", "st_mtime_ns",
+                     &ST_TIMESPEC(st, m)) < 0 ||
+       stat_set_time(dict, "st_ctime", "st_ctime_ns",
+                     &ST_TIMESPEC(st, c)) < 0)
+        goto out;
+    res = PyObject_CallFunctionObjArgs(type, seq, dict, NULL);
+ out:
+    Py_XDECREF(dict);
+    Py_XDECREF(seq);
+    Py_DECREF(type);
+    return res;
+}
+
+/* Stats a target the way the xattr calls address it: fstat for file
+   descriptors, lstat for nofollow paths, stat otherwise */
+static PyObject *stat_target(target_t *tgt) {
+    struct stat st;
+    int ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    if(tgt->type == T_FD)
+        ret = fstat(tgt->fd, &st);
+    else if(tgt->type == T_LINK)
+        ret = lstat(tgt->name, &st);
+    else
+        ret = stat(tgt->name, &st);
+    Py_END_ALLOW_THREADS
+    if(ret == -1)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return stat_to_obj(&st);
+}
+
+/* Wrapper for getxattr */
+static char __get_all_doc__[] =
+    "get_all(item[, nofollow=False, namespace=None, max_value_size=None,\n"
+    "        intern=None, compact=False, schema=None, names_as_str=False,\n"
+    "        namespaces=None, name_glob=None])\n"
+    "Get all the extended attributes of an item.\n"
+    "\n"
+    "This function performs a bulk-get of all extended attribute names\n"
+    "and the corresponding value.\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.get_all('/path/to/file')\n"
+    "    [(b'user.mime-type', b'plain/text'), (b'user.comment', b'test'),\n"
+    "     (b'system.posix_acl_access', b'\\x02\\x00...')]\n"
+    "    >>> xattr.get_all('/path/to/file', namespace=xattr.NS_USER)\n"
+    "    [(b'mime-type', b'plain/text'), (b'comment', b'test')]\n"
+    "\n"
+    ITEM_DOC
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes; for example, querying all user attributes can be\n"
+    "   accomplished by passing namespace=:const:`NS_USER`\n"
+    ":type namespace: string\n"
+    NOFOLLOW_DOC
+    ":keyword max_value_size: if given, values larger than this are not\n"
+    "   read (nor copied); their size is returned instead\n"
+    ":type max_value_size: int\n"
+    ":keyword intern: if given, equal names and values are shared via\n"
+    "   this table\n"
+    ":type intern: InternTable\n"
+    ":keyword compact: if true, return an :class:`XattrSet` instead of\n"
+    "   a list, which avoids creating objects for attributes that are\n"
+    "   never accessed; this can't be combined with *intern*\n"
+    ":type compact: bool\n"
+    ":keyword schema: if given, the values of the attributes it names\n"
+    "   are decoded to their types; a value which doesn't match its\n"
+    "   type raises :exc:`ValueError`; integer values are always read,\n"
+    "   regardless of *max_value_size*, so that they are never\n"
+    "   returned as their size\n"
+    ":type schema: Schema\n"
+    NAMES_AS_STR_DOC
+    FILTER_DOC
+    ":return: list of tuples (name, value); note that if a namespace\n"
+    "   argument was passed, it (and the separator) will be stripped from\n"
+    "   the names returned\n"
+    ":rtype: list[(bytes or str, bytes or int or str)] or XattrSet\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. note:: Since reading the whole attribute list is not an atomic\n"
+    "   operation, it might be possible that attributes are added\n"
+    "   or removed between the initial query and the actual reading\n"
+    "   of the attributes; the returned list will contain only the\n"
+    "   attributes that were present at the initial listing of the\n"
+    "   attribute names and that were still present when the read\n"
+    "   attempt for the value is made.\n"
+    ".. versionadded:: 0.4\n"
+    NS_CHANGED_DOC "\n"
+    ".. versionchanged:: 0.9\n"
+    "   The *max_value_size*, *intern*, *compact*, *schema*,\n"
+    "   *names_as_str*, *namespaces* and *name_glob* arguments were\n"
+    "   added.\n"
+    ;
+
+/* Reads a value unless it is larger than max_size, in which case
+ * *oversize is set to its size instead. The read is done with a buffer
+ * of at most max_size + 1 bytes, so that larger values fail with
+ * ERANGE and are then only probed for their size; this avoids both
+ * allocating and copying them.
+ *
+ * Same return values and error handling as _generic_get.
+ */
+static ssize_t _get_capped(target_t *tgt, const char *name, char **buffer,
+                           size_t *size, size_t max_size, ssize_t *oversize,
+                           int *io_errno)
+    CPYCHECKER_NEGATIVE_RESULT_SETS_EXCEPTION;
+
+static ssize_t _get_capped(target_t *tgt, const char *name, char **buffer,
+                           size_t *size, size_t max_size, ssize_t *oversize,
+                           int *io_errno) {
+    ssize_t res;
+    size_t cap;
+
+    *oversize = -1;
+    if(*buffer == NULL) {
+        if(*size == 0)
+            *size = ESTIMATE_ATTR_SIZE;
+        if((*buffer = PyMem_Malloc(*size)) == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    cap = max_size < *size - 1 ? max_size + 1 : *size;
+    res = _get_obj(tgt, name, *buffer, cap);
+    if(res == -1 && errno == ERANGE)
+        res = _get_obj(tgt, name, NULL, 0);
+    else if(res != -1 && (size_t) res <= max_size)
+        return res;
+    if(res == -1) {
+        *io_errno = errno;
+        if(errno != XATTR_ENOATTR)
+            PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    if((size_t) res > max_size) {
+        *oversize = res;
+        return 0;
+    }
+    /* Small enough, but larger than the current buffer */
+    return _generic_get(_get_obj, tgt, name, buffer, size, io_errno);
+}
+
+/* Compact results of get_all: the names and values of all attributes
+ * are stored back to back in a single buffer, with an array of
+ * offsets sorted by name; Python objects are only created on access.
+ */
+
+typedef struct {
+    size_t name_off, name_len;
+    size_t value_off;           /* XSET_OVERSIZE if the value wasn't read */
+    size_t value_len;           /* or the size of the value */
+    schema_type_t type;
+} xset_entry_t;
+
+#define XSET_OVERSIZE ((size_t) -1)
+
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    xset_entry_t *entries;
+    Py_ssize_t count;
+    int names_as_str;
+} XattrSetObject;
+
+typedef struct {
+    PyObject_HEAD
+    XattrSetObject *set;
+    Py_ssize_t pos;
+} XattrSetIterObject;
+
+static PyTypeObject XattrSetType;
+static PyTypeObject XattrSetIterType;
+
+static int attr_cmp_names(const void *x, const void *y) {
+    return strcmp(*(const char * const *) x, *(const char * const *) y);
+}
+
+/* Appends len bytes to the data buffer, growing it as needed; returns
+   the offset of the copy, or -1 with an exception set */
+static ssize_t xset_append(char **data, size_t *used, size_t *alloc,
+                           const char *buf, size_t len) {
+    size_t off = *used;
+    if(*alloc - *used < len) {
+        size_t nalloc = *alloc * 2 + len;
+        char *tmp = PyMem_Realloc(*data, nalloc);
+        if(tmp == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *data = tmp;
+        *alloc = nalloc;
+    }
+    memcpy(*data + off, buf, len);
+    *used += len;
+    return (ssize_t) off;
+}
+
+/* Reads all the attributes of a target into a new XattrSet; if
+   max_size is non-negative, larger values are not read. */
+static PyObject *xset_build(target_t *tgt, const name_filter_t *filter,
+                            Py_ssize_t max_size, SchemaObject *schema,
+                            int names_as_str) {
+    XattrSetObject *set = NULL;
+    char *buf_list = NULL, *buf_val = NULL, *data = NULL;
+    const char **names = NULL;
+    xset_entry_t *entries = NULL;
+    size_t nalloc = 0, count = 0, nnames = 0, i;
+    size_t used = 0, data_alloc = 0;
+    ssize_t nlist, nval, oversize = -1, off;
+    const char *s;
+    int io_errno;
+
+    nlist = _generic_get(_list_obj, tgt, NULL, &buf_list, &nalloc, &io_errno);
+    if(nlist == -1)
+        goto out;
+    for(s = buf_list; s - buf_list < nlist; s += strlen(s) + 1)
+        if(filter_match(filter, s) != NULL)
+            nnames++;
+    if((names = PyMem_New(const char *, nnames + 1)) == NULL ||
+       (entries = PyMem_New(xset_entry_t, nnames + 1)) == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    nnames = 0;
+    for(s = buf_list; s - buf_list < nlist; s += strlen(s) + 1)
+        if(filter_match(filter, s) != NULL)
+            names[nnames++] = s;
+    qsort((void *) names, nnames, sizeof(char *), attr_cmp_names);
+
+    nalloc = 0;
+    for(i = 0; i < nnames; i++) {
+        const char *name = filter_match(filter, names[i]);
+        xset_entry_t *e = &entries[count];
+        Py_ssize_t cap;
+
+        e->type = schema_lookup(schema, names[i]);
+        if((cap = schema_cap(e->type, max_size)) >= 0)
+            nval = _get_capped(tgt, names[i], &buf_val, &nalloc,
+                               (size_t) cap, &oversize, &io_errno);
+        else
+            nval = _generic_get(_get_obj, tgt, names[i], &buf_val, &nalloc,
+                                &io_errno);
+        if(nval == -1) {
+            if(io_errno == XATTR_ENOATTR)
+                continue;
+            goto out;
+        }
+        /* Check typed values now, so that accesses can't fail */
+        if(schema_check(e->type, names[i],
+                        oversize >= 0 ? oversize : nval) < 0)
+            goto out;
+        e->name_len = strlen(name);
+        if((off = xset_append(&data, &used, &data_alloc, name,
+                              e->name_len)) < 0)
+            goto out;
+        e->name_off = (size_t) off;
+        if(oversize >= 0) {
+            e->value_off = XSET_OVERSIZE;
+            e->value_len = (size_t) oversize;
+        } else {
+            if((off = xset_append(&data, &used, &data_alloc, buf_val,
+                                  (size_t) nval)) < 0)
+                goto out;
+            e->value_off = (size_t) off;
+            e->value_len = (size_t) nval;
+        }
+        count++;
+    }
+
+    if((set = PyObject_New(XattrSetObject, &XattrSetType)) == NULL)
+        goto out;
+    set->data = data;
+    set->entries = entries;
+    set->count = (Py_ssize_t) count;
+    set->names_as_str = names_as_str;
+    data = NULL;
+    entries = NULL;
+
+ out:
+    PyMem_Free(data);
+    PyMem_Free(entries);
+    PyMem_Free((void *) names);
+    PyMem_Free(buf_val);
+    PyMem_Free(buf_list);
+    return (PyObject *) set;
+}
+
+/* Finds the entry of the given name (bytes or str); returns NULL
+   without an exception if not found */
+static const xset_entry_t *xset_find(XattrSetObject *self, PyObject *key) {
+    PyObject *name;
+    const char *k;
+    size_t klen;
+    Py_ssize_t lo = 0, hi = self->count;
+    const xset_entry_t *res = NULL;
+
+    if((name = convert_fsname(key)) == NULL)
+        return NULL;
+    k = PyBytes_AS_STRING(name);
+    klen = (size_t) PyBytes_GET_SIZE(name);
+    while(lo < hi) {
+        Py_ssize_t mid = lo + (hi - lo) / 2;
+        const xset_entry_t *e = &self->entries[mid];
+        int c = memcmp(self->data + e->name_off, k,
+                       e->name_len < klen ? e->name_len : klen);
+        if(c == 0)
+            c = e->name_len < klen ? -1 : e->name_len > klen;
+        if(c == 0) {
+            res = e;
+            break;
+        }
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    Py_DECREF(name);
+    return res;
+}
+
+static PyObject *xset_value(XattrSetObject *self, const xset_entry_t *e) {
+    if(e->value_off == XSET_OVERSIZE)
+        return PyLong_FromSize_t(e->value_len);
+    return schema_decode(e->type, NULL, self->data + e->value_off,
+                         (Py_ssize_t) e->value_len, NULL);
+}
+
+static PyObject *xset_name(XattrSetObject *self, const xset_entry_t *e) {
+    return name_to_obj(self->data + e->name_off, (Py_ssize_t) e->name_len,
+                       self->names_as_str);
+}
+
+static PyObject *
+xset_subscript(XattrSetObject *self, PyObject *key)
+{
+    const xset_entry_t *e = xset_find(self, key);
+    if(e == NULL) {
+        if(!PyErr_Occurred())
+            PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+    return xset_value(self, e);
+}
+
+static int
+xset_contains(XattrSetObject *self, PyObject *key)
+{
+    if(xset_find(self, key) != NULL)
+        return 1;
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static Py_ssize_t
+xset_len(XattrSetObject *self)
+{
+    return self->count;
+}
+
+static char __xset_get_doc__[] =
+    "get(name[, default=None])\n"
+    "Return the value of an attribute, or *default* if it is missing.\n"
+    ;
+
+static PyObject *
+xset_get(XattrSetObject *self, PyObject *args)
+{
+    PyObject *key, *dflt = Py_None;
+    const xset_entry_t *e;
+
+    if (!PyArg_ParseTuple(args, "O|O", &key, &dflt))
+        return NULL;
+    if((e = xset_find(self, key)) != NULL)
+        return xset_value(self, e);
+    if(PyErr_Occurred())
+        return NULL;
+    Py_INCREF(dflt);
+    return dflt;
+}
+
+static char __xset_to_dict_doc__[] =
+    "to_dict()\n"
+    "Return all the attributes as a dictionary of names to values.\n"
+    ;
+
+static PyObject *
+xset_to_dict(XattrSetObject *self, PyObject *unused)
+{
+    PyObject *res, *name, *value;
+    Py_ssize_t i;
+    int ret;
+
+    if((res = PyDict_New()) == NULL)
+        return NULL;
+    for(i = 0; i < self->count; i++) {
+        name = xset_name(self, &self->entries[i]);
+        value = name == NULL ? NULL : xset_value(self, &self->entries[i]);
+        ret = value == NULL ? -1 : PyDict_SetItem(res, name, value);
+        Py_XDECREF(name);
+        Py_XDECREF(value);
+        if(ret < 0) {
+            Py_DECREF(res);
+            return NULL;
+        }
+    }
+    return res;
+}
+
+static PyObject *
+xset_iter(XattrSetObject *self)
+{
+    XattrSetIterObject *it;
+
+    if((it = PyObject_New(XattrSetIterObject, &XattrSetIterType)) == NULL)
+        return NULL;
+    Py_INCREF(self);
+    it->set = self;
+    it->pos = 0;
+    return (PyObject *) it;
+}
+
+static void
+xset_dealloc(XattrSetObject *self)
+{
+    PyMem_Free(self->data);
+    PyMem_Free(self->entries);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+xset_iter_next(XattrSetIterObject *self)
+{
+    Py_ssize_t pos;
+
+    /* Advance atomically, so that threads sharing an iterator never
+       return the same name twice */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    pos = self->pos;
+    if(pos < self->set->count)
+        self->pos++;
+    Py_END_CRITICAL_SECTION();
+    if(pos >= self->set->count)
+        return NULL;
+    return xset_name(self->set, &self->set->entries[pos]);
+}
+
+static void
+xset_iter_dealloc(XattrSetIterObject *self)
+{
+    Py_DECREF(self->set);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyMethodDef xset_methods[] = {
+    {"get", (PyCFunction) xset_get, METH_VARARGS, __xset_get_doc__ },
+    {"to_dict", (PyCFunction) xset_to_dict, METH_NOARGS,
+     __xset_to_dict_doc__ },
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyMappingMethods xset_as_mapping = {
+    .mp_length = (lenfunc) xset_len,
+    .mp_subscript = (binaryfunc) xset_subscript,
+};
+
+static PySequenceMethods xset_as_sequence = {
+    .sq_contains = (objobjproc) xset_contains,
+};
+
+static char __xset_type_doc__[] =
+    "The attributes of an item, as returned by ``get_all(compact=True)``.\n"
+    "\n"
+    "A read-only mapping of attribute names (bytes, or str if\n"
+    "``names_as_str`` was given) to values, stored in a single buffer;\n"
+    "names and values only become Python objects when accessed. Names\n"
+    "can be looked up as bytes or str, and are iterated in sorted order.\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyTypeObject XattrSetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "xattr.XattrSet",
+    .tp_basicsize = sizeof(XattrSetObject),
+    .tp_dealloc = (destructor) xset_dealloc,
+    .tp_as_sequence = &xset_as_sequence,
+    .tp_as_mapping = &xset_as_mapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = __xset_type_doc__,
+    .tp_iter = (getiterfunc) xset_iter,
+    .tp_methods = xset_methods,
+};
+
+static PyTypeObject XattrSetIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "xattr.XattrSetIterator",
+    .tp_basicsize = sizeof(XattrSetIterObject),
+    .tp_dealloc = (destructor) xset_iter_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc) xset_iter_next,
+};
+
+/* Common implementation of get_all and stat_all; with_stat selects
+   the latter, which returns the stat result alongside */
+static PyObject *
+get_all_common(PyObject *args, PyObject *keywds, int with_stat)
+{
+    PyObject *myarg, *res, *st = NULL;
+    int nofollow=0, compact=0, names_as_str=0;
+    const char *ns = NULL, *glob = NULL;
+    char *buf_list = NULL, *buf_val = NULL;
+    char small_list[ESTIMATE_ATTR_SIZE];
+    const char *s, *list = NULL;
+    size_t nalloc = 0;
+    ssize_t nlist, nval;
+    PyObject *mylist, *max_obj = Py_None, *intern_obj = NULL;
+    PyObject *schema_obj = NULL, *namespaces = NULL;
+    name_filter_t filter;
+    InternTableObject *table;
+    SchemaObject *schema;
+    Py_ssize_t max_size = -1;
+    ssize_t oversize = -1;
+    target_t tgt;
+    static char *kwlist[] = {"item", "nofollow", "namespace",
+                             "max_value_size", "intern", "compact",
+                             "schema", "names_as_str", "namespaces",
+                             "name_glob", NULL};
+    int io_errno;
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iyOOpOpOy", kwlist,
+                                     &myarg, &nofollow, &ns, &max_obj,
+                                     &intern_obj, &compact, &schema_obj,
+                                     &names_as_str, &namespaces, &glob))
+        return NULL;
+    if(intern_arg(intern_obj, &table) < 0 ||
+       schema_arg(schema_obj, &schema) < 0)
+        return NULL;
+    if(compact && table != NULL) {
         PyErr_SetString(PyExc_ValueError,
-                        "negative value size?!");
+                        "compact and intern can't be used together");
+        return NULL;
+    }
+    if(max_obj != Py_None) {
+        if((max_size = PyNumber_AsSsize_t(max_obj, PyExc_OverflowError)) == -1
+           && PyErr_Occurred())
+            return NULL;
+        if(max_size < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "max_value_size must not be negative");
+            return NULL;
+        }
+    }
+    if(filter_init(&filter, ns, namespaces, glob) < 0)
+        return NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        filter_free(&filter);
+        return NULL;
+    }
+
+    if(with_stat && (st = stat_target(&tgt)) == NULL) {
         res = NULL;
-        goto free_arg;
+        goto free_tgt;
+    }
+
+    if(compact) {
+        res = xset_build(&tgt, &filter, max_size, schema, names_as_str);
+        goto free_tgt;
+    }
+
+    res = NULL;
+    /* Compute first the list of attributes */
+    nlist = _get_small(_list_obj, &tgt, NULL, small_list, &list, &buf_list,
+                       &nalloc, &io_errno);
+    if (nlist == -1) {
+      /* We can't handle any errors, and the Python error is already
+         set, just bail out. */
+      goto free_tgt;
+    }
+
+    /* Create the list which will hold the result. */
+    mylist = PyList_New(0);
+    if(mylist == NULL) {
+      goto free_buf_list;
+    }
+
+    nalloc = 0;
+    /* Create and insert the attributes as strings in the list */
+    for(s = list; s - list < nlist; s += strlen(s) + 1) {
+        PyObject *my_tuple, *value;
+        const char *name;
+        schema_type_t type;
+
+        if((name = filter_match(&filter, s)) == NULL)
+            continue;
+        /* Now retrieve the attribute value; without capping, interning
+           or decoding, directly into its bytes object */
+        io_errno = 0;
+        type = schema_lookup(schema, s);
+        if(max_size < 0 && table == NULL && type == SCHEMA_BYTES) {
+            value = _get_bytes(&tgt, s, &io_errno);
+        } else {
+            Py_ssize_t cap = schema_cap(type, max_size);
+            if(cap >= 0)
+                nval = _get_capped(&tgt, s, &buf_val, &nalloc,
+                                   (size_t) cap, &oversize, &io_errno);
+            else
+                nval = _generic_get(_get_obj, &tgt, s, &buf_val, &nalloc,
+                                    &io_errno);
+            if(nval == -1)
+                value = NULL;
+            else if(oversize >= 0)
+                value = schema_check(type, s, oversize) < 0 ? NULL :
+                    PyLong_FromSsize_t((Py_ssize_t) oversize);
+            else
+                value = schema_decode(type, s, buf_val, nval, table);
+        }
+        if (value == NULL) {
+          if (io_errno == XATTR_ENOATTR) {
+            continue;
+          } else {
+            Py_DECREF(mylist);
+            goto free_buf_val;
+          }
+        }
+        if(names_as_str)
+            my_tuple = Py_BuildValue("NN",
+                                     name_to_obj(name,
+                                                 (Py_ssize_t) strlen(name), 1),
+                                     value);
+        else
+            my_tuple = Py_BuildValue("NN",
+                                     intern_bytes(table, name,
+                                                  (Py_ssize_t) strlen(name)),
+                                     value);
+        if (my_tuple == NULL) {
+          Py_DECREF(mylist);
+          goto free_buf_val;
+        }
+        int lappend_ret = PyList_Append(mylist, my_tuple);
+        Py_DECREF(my_tuple);
+        if(lappend_ret < 0) {
+            Py_DECREF(mylist);
+            goto free_buf_val;
+        }
+    }
+
+    /* Successful exit */
+    res = mylist;
+
+ free_buf_val:
+    PyMem_Free(buf_val);
+
+ free_buf_list:
+    PyMem_Free(buf_list);
+
+ free_tgt:
+    free_tgt(&tgt);
+    filter_free(&filter);
+
+    if(with_stat) {
+        if(res != NULL)
+            res = Py_BuildValue("NN", st, res);
+        else
+            Py_XDECREF(st);
+    }
+
+    /* Return the result */
+    return res;
+}
+
+static PyObject *
+get_all(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    return get_all_common(args, keywds, 0);
+}
+
+static char __stat_all_doc__[] =
+    "stat_all(item[, nofollow=False, namespace=None, max_value_size=None,\n"
+    "         intern=None, compact=False, schema=None, names_as_str=False,\n"
+    "         namespaces=None, name_glob=None])\n"
+    "Get the status and all the extended attributes of an item.\n"
+    "\n"
+    "This is equivalent to calling :func:`os.stat` (or :func:`os.lstat`,\n"
+    "or :func:`os.fstat`, depending on the item and *nofollow*) followed\n"
+    "by :func:`get_all` with the same arguments, but done in a single\n"
+    "call, with the item converted only once.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> st, attrs = xattr.stat_all('/path/to/file',\n"
+    "    ...                            namespace=xattr.NS_USER)\n"
+    "    >>> st.st_size, attrs\n"
+    "    (1024, [(b'comment', b'test')])\n"
+    "\n"
+    ITEM_DOC
+    NOFOLLOW_DOC
+    ":return: a tuple (stat_result, attributes), where attributes is as\n"
+    "   returned by :func:`get_all`, and accepts the same keyword\n"
+    "   arguments\n"
+    ":rtype: tuple\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_stat_all(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    return get_all_common(args, keywds, 1);
+}
+
+static char __has_doc__[] =
+    "has(item, name[, nofollow=False, namespace=None])\n"
+    "Check whether an item has a given extended attribute.\n"
+    "\n"
+    "This only probes for the attribute's size, without reading its\n"
+    "value.\n"
+    "\n"
+    "Example:\n"
+    "    >>> xattr.has('/path/to/file', 'user.comment')\n"
+    "    True\n"
+    "\n"
+    ITEM_DOC
+    NAME_GET_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":return: whether the attribute exists\n"
+    ":rtype: bool\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_has(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *res = NULL;
+    target_t tgt;
+    int nofollow = 0;
+    char *attrname = NULL, *namebuf;
+    const char *fullname;
+    const char *ns = NULL;
+    ssize_t nret;
+    static char *kwlist[] = {"item", "name", "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|iy", kwlist,
+                                     &myarg, NULL, &attrname, &nofollow, &ns))
+        return NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        goto free_arg;
+    if(merge_ns(ns, attrname, &fullname, &namebuf) < 0)
+        goto free_tgt;
+
+    nret = _get_obj(&tgt, fullname, NULL, 0);
+    if(nret != -1)
+        res = Py_True;
+    else if(errno == XATTR_ENOATTR)
+        res = Py_False;
+    else
+        PyErr_SetFromErrno(PyExc_IOError);
+    Py_XINCREF(res);
+
+    PyMem_Free(namebuf);
+ free_tgt:
+    free_tgt(&tgt);
+ free_arg:
+    PyMem_Free(attrname);
+
+    /* Return the result */
+    return res;
+}
+
+static char __sizes_doc__[] =
+    "sizes(item[, nofollow=False, namespace=None, names_as_str=False])\n"
+    "Get the sizes of all the extended attributes of an item.\n"
+    "\n"
+    "The sizes are probed without reading (and copying) the values.\n"
+    "\n"
+    "Example:\n"
+    "    >>> xattr.sizes('/path/to/file', namespace=xattr.NS_USER)\n"
+    "    {b'comment': 4, b'cache': 65536}\n"
+    "\n"
+    ITEM_DOC
+    NOFOLLOW_DOC
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes; if given, it (and the separator) will be stripped\n"
+    "   from the names returned\n"
+    ":type namespace: bytes\n"
+    NAMES_AS_STR_DOC
+    ":return: the size of each attribute, by name\n"
+    ":rtype: dict[bytes or str, int]\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_sizes(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *res = NULL, *key, *value;
+    target_t tgt;
+    int nofollow = 0, names_as_str = 0, ret;
+    const char *ns = NULL;
+    char *buf_list = NULL;
+    const char *s;
+    size_t nalloc = 0, count = 0, i;
+    ssize_t nlist, *sizes = NULL;
+    int io_errno = 0;
+    static char *kwlist[] = {"item", "nofollow", "namespace",
+                             "names_as_str", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iyp", kwlist,
+                                     &myarg, &nofollow, &ns, &names_as_str))
+        return NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        return NULL;
+
+    nlist = _generic_get(_list_obj, &tgt, NULL, &buf_list, &nalloc, NULL);
+    if(nlist == -1)
+        goto free_buf;
+    for(s = buf_list; s - buf_list < nlist; s += strlen(s) + 1)
+        count++;
+    if((sizes = PyMem_New(ssize_t, count + 1)) == NULL) {
+        PyErr_NoMemory();
+        goto free_buf;
+    }
+
+    /* Probe all the sizes in one go */
+    Py_BEGIN_ALLOW_THREADS;
+    for(s = buf_list, i = 0; s - buf_list < nlist; s += strlen(s) + 1, i++) {
+        if(matches_ns(ns, s) == NULL) {
+            sizes[i] = -1;
+            continue;
+        }
+        /* Attributes removed since the listing are skipped */
+        if((sizes[i] = _get_raw(&tgt, s, NULL, 0)) == -1 &&
+           errno != XATTR_ENOATTR) {
+            io_errno = errno;
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    if(io_errno != 0) {
+        errno = io_errno;
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto free_buf;
+    }
+    if((res = PyDict_New()) == NULL)
+        goto free_buf;
+    for(s = buf_list, i = 0; s - buf_list < nlist; s += strlen(s) + 1, i++) {
+        if(sizes[i] == -1)
+            continue;
+        const char *name = matches_ns(ns, s);
+        if((key = name_to_obj(name, (Py_ssize_t) strlen(name),
+                              names_as_str)) == NULL) {
+            Py_CLEAR(res);
+            break;
+        }
+        if((value = PyLong_FromSsize_t(sizes[i])) == NULL) {
+            Py_DECREF(key);
+            Py_CLEAR(res);
+            break;
+        }
+        ret = PyDict_SetItem(res, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if(ret < 0) {
+            Py_CLEAR(res);
+            break;
+        }
+    }
+
+ free_buf:
+    PyMem_Free(sizes);
+    PyMem_Free(buf_list);
+    free_tgt(&tgt);
+
+    /* Return the result */
+    return res;
+}
+
+
+/* Typed accessors: these decode values straight from the I/O buffer
+ * (on the stack, for small values), without an intermediate bytes
+ * object.
+ */
+
+/* Reads a value for the typed getters; on success, *data points to
+   either small or *buf, which the caller must free */
+static ssize_t typed_get(PyObject *myarg, const char *attrname, int nofollow,
+                         const char *ns, char *small, const char **data,
+                         char **buf)
+    CPYCHECKER_NEGATIVE_RESULT_SETS_EXCEPTION;
+
+static ssize_t typed_get(PyObject *myarg, const char *attrname, int nofollow,
+                         const char *ns, char *small, const char **data,
+                         char **buf) {
+    target_t tgt;
+    char *namebuf;
+    const char *fullname;
+    size_t nalloc = 0;
+    ssize_t nret = -1;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        return -1;
+    if(merge_ns(ns, attrname, &fullname, &namebuf) == 0) {
+        nret = _get_small(_get_obj, &tgt, fullname, small, data, buf,
+                          &nalloc, NULL);
+        PyMem_Free(namebuf);
+    }
+    free_tgt(&tgt);
+    return nret;
+}
+
+static char __get_u64_doc__[] =
+    "get_u64(item, name[, nofollow=False, namespace=None])\n"
+    "Get the value of an extended attribute as an unsigned integer.\n"
+    "\n"
+    "The value must be 8 bytes long, holding the integer in\n"
+    "little-endian byte order, as written by :func:`set_u64`.\n"
+    "\n"
+    "Example:\n"
+    "    >>> xattr.get_u64('/path/to/file', 'user.expires')\n"
+    "    1767225600\n"
+    "\n"
+    ITEM_DOC
+    NAME_GET_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":return: the value of the extended attribute\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    ":raises ValueError: if the value is not 8 bytes long\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_get_u64(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *res = NULL;
+    int nofollow = 0;
+    char *attrname = NULL, *buf = NULL;
+    char small[ESTIMATE_ATTR_SIZE];
+    const char *data;
+    const char *ns = NULL;
+    ssize_t nret;
+    unsigned long long value = 0;
+    int i;
+    static char *kwlist[] = {"item", "name", "nofollow", "namespace", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|iy", kwlist,
+                                     &myarg, NULL, &attrname, &nofollow, &ns))
+        return NULL;
+    nret = typed_get(myarg, attrname, nofollow, ns, small, &data, &buf);
+    if(nret == -1)
+        goto out;
+    if(nret != 8) {
+        PyErr_Format(PyExc_ValueError,
+                     "expected an 8-byte value, got %zd bytes", nret);
+        goto out;
+    }
+    for(i = 7; i >= 0; i--)
+        value = (value << 8) | (unsigned char) data[i];
+    res = PyLong_FromUnsignedLongLong(value);
+
+ out:
+    PyMem_Free(buf);
+    PyMem_Free(attrname);
+    return res;
+}
+
+static char __get_str_doc__[] =
+    "get_str(item, name[, encoding='utf-8', errors='strict',\n"
+    "        nofollow=False, namespace=None])\n"
+    "Get the value of an extended attribute, decoded as a string.\n"
+    "\n"
+    "Example:\n"
+    "    >>> xattr.get_str('/path/to/file', 'user.comment')\n"
+    "    'test'\n"
+    "\n"
+    ITEM_DOC
+    NAME_GET_DOC
+    ":param encoding: the encoding of the value\n"
+    ":type encoding: str\n"
+    ":param errors: the error handling scheme, as for\n"
+    "    :meth:`bytes.decode`\n"
+    ":type errors: str\n"
+    NOFOLLOW_DOC
+    NS_DOC
+    ":return: the decoded value of the extended attribute\n"
+    ":rtype: str\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    ":raises UnicodeDecodeError: if the value can't be decoded\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_get_str(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *res = NULL;
+    int nofollow = 0;
+    char *attrname = NULL, *buf = NULL;
+    char small[ESTIMATE_ATTR_SIZE];
+    const char *data;
+    const char *ns = NULL, *encoding = NULL, *errors = NULL;
+    ssize_t nret;
+    static char *kwlist[] = {"item", "name", "encoding", "errors",
+                             "nofollow", "namespace", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|ssiy", kwlist,
+                                     &myarg, NULL, &attrname, &encoding,
+                                     &errors, &nofollow, &ns))
+        return NULL;
+    nret = typed_get(myarg, attrname, nofollow, ns, small, &data, &buf);
+    if(nret != -1)
+        res = PyUnicode_Decode(data, nret, encoding, errors);
+
+    PyMem_Free(buf);
+    PyMem_Free(attrname);
+    return res;
+}
+
+static char __get_struct_doc__[] =
+    "get_struct(item, name, fmt[, nofollow=False, namespace=None])\n"
+    "Get the value of an extended attribute, unpacked as a structure.\n"
+    "\n"
+    "The value is unpacked directly from the read buffer, as by\n"
+    ":func:`struct.unpack`; passing a precompiled :class:`struct.Struct`\n"
+    "as *fmt* avoids parsing the format on each call.\n"
+    "\n"
+    "Example:\n"
+    "    >>> header = struct.Struct('<IIQ')\n"
+    "    >>> xattr.get_struct('/path/to/file', 'user.header', header)\n"
+    "    (1, 2, 1767225600)\n"
+    "\n"
+    ITEM_DOC
+    NAME_GET_DOC
+    ":param fmt: the layout of the value\n"
+    ":type fmt: str, bytes or struct.Struct\n"
+    NOFOLLOW_DOC
+    NS_DOC
+    ":return: the unpacked fields\n"
+    ":rtype: tuple\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    ":raises struct.error: if the value doesn't match the format\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_get_struct(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *fmt, *st = NULL, *view, *tmp, *res = NULL;
+    int nofollow = 0;
+    char *attrname = NULL, *buf = NULL;
+    char small[ESTIMATE_ATTR_SIZE];
+    const char *data;
+    const char *ns = NULL;
+    ssize_t nret;
+    static char *kwlist[] = {"item", "name", "fmt", "nofollow",
+                             "namespace", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OetO|iy", kwlist,
+                                     &myarg, NULL, &attrname, &fmt,
+                                     &nofollow, &ns))
+        return NULL;
+    /* Compile plain formats; anything else must behave like a Struct */
+    if(PyUnicode_Check(fmt) || PyBytes_Check(fmt)) {
+        PyObject *mod = PyImport_ImportModule("struct");
+        if(mod == NULL)
+            goto out;
+        st = PyObject_CallMethod(mod, "Struct", "O", fmt);
+        Py_DECREF(mod);
+        if(st == NULL)
+            goto out;
+    } else {
+        Py_INCREF(fmt);
+        st = fmt;
+    }
+    nret = typed_get(myarg, attrname, nofollow, ns, small, &data, &buf);
+    if(nret == -1)
+        goto out;
+    /* The view is released before the buffer goes away, so that any
+       reference to it kept by the unpacking can't read freed memory */
+    if((view = PyMemoryView_FromMemory((char *) data, nret,
+                                       PyBUF_READ)) == NULL)
+        goto out;
+    res = PyObject_CallMethod(st, "unpack", "O", view);
+    if(res == NULL) {
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        tmp = PyObject_CallMethod(view, "release", NULL);
+        PyErr_Restore(type, value, tb);
+    } else if((tmp = PyObject_CallMethod(view, "release", NULL)) == NULL) {
+        Py_CLEAR(res);
+    }
+    Py_XDECREF(tmp);
+    Py_DECREF(view);
+
+ out:
+    Py_XDECREF(st);
+    PyMem_Free(buf);
+    PyMem_Free(attrname);
+    return res;
+}
+
+static char __pysetxattr_doc__[] =
+    "setxattr(item, name, value[, flags=0, nofollow=False])\n"
+    "Set the value of a given extended attribute (deprecated).\n"
+    "\n"
+    "Be careful in case you want to set attributes on symbolic\n"
+    "links, you have to use all the 5 parameters; use 0 for the \n"
+    "flags value if you want the default behaviour (create or "
+    "replace)\n"
+    "\n"
+    ITEM_DOC
+    NAME_SET_DOC
+    VALUE_DOC
+    FLAGS_DOC
+    NOFOLLOW_DOC
+    "\n"
+    ".. deprecated:: 0.4\n"
+    "   this function has been deprecated\n"
+    "   by the :func:`set` function.\n"
+    ;
+
+/* Wrapper for setxattr */
+static PyObject *
+pysetxattr(PyObject *self, PyObject *args)
+{
+    PyObject *myarg, *res;
+    int nofollow = 0;
+    char *attrname = NULL;
+    char *buf = NULL;
+    Py_ssize_t bufsize_s;
+    size_t bufsize;
+    int nret;
+    int flags = 0;
+    target_t tgt;
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTuple(args, "Oetet#|ii", &myarg, NULL, &attrname,
+                          NULL, &buf, &bufsize_s, &flags, &nofollow))
+        return NULL;
+
+    if (bufsize_s < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "negative value size?!");
+        res = NULL;
+        goto free_arg;
+    }
+    bufsize = (size_t) bufsize_s;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        res = NULL;
+        goto free_arg;
+    }
+
+    /* Set the attribute's value */
+    nret = _set_obj(&tgt, attrname, buf, bufsize, flags);
+
+    free_tgt(&tgt);
+
+    if(nret == -1) {
+        res = PyErr_SetFromErrno(PyExc_IOError);
+        goto free_arg;
+    }
+
+    Py_INCREF(Py_None);
+    res = Py_None;
+
+ free_arg:
+    PyMem_Free(attrname);
+    PyMem_Free(buf);
+
+    /* Return the result */
+    return res;
+}
+
+static char __set_doc__[] =
+    "set(item, name, value[, flags=0, namespace=None])\n"
+    "Set the value of a given extended attribute.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.set('/path/to/file', 'user.comment', 'test')\n"
+    "    >>> xattr.set('/path/to/file', 'comment', 'test',"
+    " namespace=xattr.NS_USER)\n"
+    "\n"
+    ITEM_DOC
+    NAME_SET_DOC
+    VALUE_DOC
+    FLAGS_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":returns: None\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.4\n"
+    NS_CHANGED_DOC
+    ;
+
+/* Wrapper for setxattr */
+static PyObject *
+xattr_set(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *res;
+    int nofollow = 0;
+    char *attrname = NULL;
+    char *buf = NULL;
+    Py_ssize_t bufsize_s;
+    size_t bufsize;
+    int nret;
+    int flags = 0;
+    target_t tgt;
+    const char *ns = NULL;
+    char *newname;
+    const char *full_name;
+    static char *kwlist[] = {"item", "name", "value", "flags",
+                             "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oetet#|iiy",
+                                     kwlist, &myarg, NULL, &attrname, NULL,
+                                     &buf, &bufsize_s, &flags, &nofollow, &ns))
+        return NULL;
+
+    if (bufsize_s < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "negative value size?!");
+        res = NULL;
+        goto free_arg;
+    }
+    bufsize = (size_t) bufsize_s;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        res = NULL;
+        goto free_arg;
+    }
+
+    if(merge_ns(ns, attrname, &full_name, &newname) < 0) {
+        res = NULL;
+        goto free_arg;
+    }
+
+    /* Set the attribute's value */
+    nret = _set_obj(&tgt, full_name, buf, bufsize, flags);
+
+    PyMem_Free(newname);
+
+    free_tgt(&tgt);
+
+    if(nret == -1) {
+        res = PyErr_SetFromErrno(PyExc_IOError);
+        goto free_arg;
+    }
+
+    Py_INCREF(Py_None);
+    res = Py_None;
+
+ free_arg:
+    PyMem_Free(attrname);
+    PyMem_Free(buf);
+
+    /* Return the result */
+    return res;
+}
+
+static char __set_u64_doc__[] =
+    "set_u64(item, name, value[, flags=0, nofollow=False, namespace=None])\n"
+    "Set the value of an extended attribute to an unsigned integer.\n"
+    "\n"
+    "The integer is stored as 8 bytes, in little-endian byte order; it\n"
+    "can be read back with :func:`get_u64`.\n"
+    "\n"
+    "Example:\n"
+    "    >>> xattr.set_u64('/path/to/file', 'user.expires', 1767225600)\n"
+    "\n"
+    ITEM_DOC
+    NAME_SET_DOC
+    ":param int value: the value, between 0 and 2**64 - 1\n"
+    FLAGS_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":returns: None\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    ":raises OverflowError: if the value is out of range\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_set_u64(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *valobj, *res = NULL;
+    int nofollow = 0, flags = 0, nret, i;
+    char *attrname = NULL, *namebuf;
+    const char *fullname;
+    const char *ns = NULL;
+    unsigned long long value;
+    char buf[8];
+    target_t tgt;
+    static char *kwlist[] = {"item", "name", "value", "flags",
+                             "nofollow", "namespace", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OetO!|iiy", kwlist,
+                                     &myarg, NULL, &attrname,
+                                     &PyLong_Type, &valobj, &flags,
+                                     &nofollow, &ns))
+        return NULL;
+    value = PyLong_AsUnsignedLongLong(valobj);
+    if(value == (unsigned long long) -1 && PyErr_Occurred())
+        goto free_arg;
+    for(i = 0; i < 8; i++)
+        buf[i] = (char) (value >> (8 * i));
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        goto free_arg;
+    if(merge_ns(ns, attrname, &fullname, &namebuf) < 0)
+        goto free_tgt;
+
+    nret = _set_obj(&tgt, fullname, buf, sizeof(buf), flags);
+    PyMem_Free(namebuf);
+    if(nret == -1) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto free_tgt;
+    }
+    Py_INCREF(Py_None);
+    res = Py_None;
+
+ free_tgt:
+    free_tgt(&tgt);
+ free_arg:
+    PyMem_Free(attrname);
+    return res;
+}
+
+static char __set_if_changed_doc__[] =
+    "set_if_changed(item, name, value[, flags=0, nofollow=False, namespace=None])\n"
+    "Set the value of an extended attribute, unless it already has it.\n"
+    "\n"
+    "The current value is read and compared with the new one, and the\n"
+    "attribute is only written if they differ; this avoids needless\n"
+    "writes (and ctime changes) when re-applying identical values.\n"
+    "With :const:`XATTR_CREATE`, no comparison is made: as for\n"
+    ":func:`set`, the call fails if the attribute already exists.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.set_if_changed('/path/to/file', 'user.comment', 'test')\n"
+    "    True\n"
+    "    >>> xattr.set_if_changed('/path/to/file', 'user.comment', 'test')\n"
+    "    False\n"
+    "\n"
+    ITEM_DOC
+    NAME_SET_DOC
+    VALUE_DOC
+    FLAGS_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":returns: whether the attribute was written\n"
+    ":rtype: bool\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+/* Wrapper for conditional setxattr */
+static PyObject *
+xattr_set_if_changed(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *res;
+    int nofollow = 0;
+    char *attrname = NULL;
+    char *buf = NULL;
+    char *scratch;
+    Py_ssize_t bufsize_s;
+    size_t bufsize;
+    int nret;
+    int flags = 0;
+    target_t tgt;
+    const char *ns = NULL;
+    char *newname;
+    const char *full_name;
+    static char *kwlist[] = {"item", "name", "value", "flags",
+                             "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oetet#|iiy",
+                                     kwlist, &myarg, NULL, &attrname, NULL,
+                                     &buf, &bufsize_s, &flags, &nofollow, &ns))
+        return NULL;
+
+    if (bufsize_s < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "negative value size?!");
+        res = NULL;
+        goto free_arg;
+    }
+    bufsize = (size_t) bufsize_s;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        res = NULL;
+        goto free_arg;
+    }
+
+    if(merge_ns(ns, attrname, &full_name, &newname) < 0) {
+        res = NULL;
+        goto free_tgt;
+    }
+
+    /* One extra byte so that empty values don't need special casing */
+    if((scratch = PyMem_Malloc(bufsize + 1)) == NULL) {
+        res = PyErr_NoMemory();
+        goto free_name;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    nret = _set_if_changed_raw(&tgt, full_name, buf, bufsize, scratch, flags);
+    Py_END_ALLOW_THREADS;
+
+    PyMem_Free(scratch);
+
+    if(nret == -1) {
+        res = PyErr_SetFromErrno(PyExc_IOError);
+        goto free_name;
+    }
+
+    res = PyBool_FromLong(nret);
+
+ free_name:
+    PyMem_Free(newname);
+ free_tgt:
+    free_tgt(&tgt);
+ free_arg:
+    PyMem_Free(attrname);
+    PyMem_Free(buf);
+
+    /* Return the result */
+    return res;
+}
+
+
+static char __set_many_doc__[] =
+    "set_many(item, attrs[, flags=0, nofollow=False, namespace=None, "
+    "atomic=False, only_changed=False])\n"
+    "Set the values of multiple extended attributes.\n"
+    "\n"
+    "All the attributes are written in a single native loop, which\n"
+    "avoids the per-call overhead of repeated :func:`set` calls.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.set_many('/path/to/file', {'comment': 'test',\n"
+    "    ...                                  'mime_type': 'text/plain'},\n"
+    "    ...                namespace=xattr.NS_USER)\n"
+    "    2\n"
+    "\n"
+    ITEM_DOC
+    ":param attrs: the attributes to set, either as a mapping of names\n"
+    "    to values, or as an iterable of (name, value) pairs (for\n"
+    "    example, as returned by :func:`get_all`)\n"
+    FLAGS_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":param atomic: if true, the previous values of all attributes are\n"
+    "    saved before writing, and if one of the writes fails, the\n"
+    "    already written attributes are restored (or removed, if they\n"
+    "    didn't exist before); note that this is best-effort only, as\n"
+    "    the restore itself can fail, and other processes can observe\n"
+    "    the intermediate state\n"
+    ":type atomic: boolean, optional\n"
+    ":param only_changed: if true, attributes which already have the\n"
+    "    given value are not rewritten, as for :func:`set_if_changed`\n"
+    ":type only_changed: boolean, optional\n"
+    ":returns: the number of attributes written\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+typedef struct {
+    PyObject *name_obj;
+    PyObject *value_obj;
+    char *name_buf;
+    const char *name;
+    const char *value;
+    size_t size;
+    /* Previous value, used for rollback; old_size is -1 if the
+       attribute didn't exist. */
+    char *old;
+    ssize_t old_size;
+    int written;
+} set_entry_t;
+
+/* Converts a mapping or an iterable of pairs into a list of pairs */
+static PyObject *attr_pairs(PyObject *attrs) {
+    if(PyDict_Check(attrs))
+        return PyDict_Items(attrs);
+    if(PyMapping_Check(attrs) && PyObject_HasAttrString(attrs, "items"))
+        return PyMapping_Items(attrs);
+    return PySequence_Fast(attrs, "attrs must be a mapping or an iterable"
+                           " of (name, value) pairs");
+}
+
+/* Wrapper for multiple setxattr calls */
+static PyObject *
+xattr_set_many(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *attrs, *seq, *res = NULL;
+    int nofollow = 0;
+    int flags = 0;
+    int atomic = 0;
+    int only_changed = 0;
+    const char *ns = NULL;
+    target_t tgt;
+    set_entry_t *entries = NULL;
+    Py_ssize_t nentries = 0, i, failed = -1;
+    size_t maxsize = 0;
+    char *scratch = NULL;
+    long written = 0;
+    int saved_errno = 0;
+    static char *kwlist[] = {"item", "attrs", "flags", "nofollow",
+                             "namespace", "atomic", "only_changed", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OO|iiyii", kwlist,
+                                     &myarg, &attrs, &flags, &nofollow,
+                                     &ns, &atomic, &only_changed))
+        return NULL;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        return NULL;
+
+    if((seq = attr_pairs(attrs)) == NULL)
+        goto free_tgt;
+
+    nentries = PySequence_Fast_GET_SIZE(seq);
+    if((entries = PyMem_Calloc(nentries + 1, sizeof(set_entry_t))) == NULL) {
+        nentries = 0;
+        PyErr_NoMemory();
+        goto free_entries;
+    }
+
+    /* Convert all the arguments upfront, so that we don't need the GIL
+       while writing */
+    for(i = 0; i < nentries; i++) {
+        set_entry_t *e = &entries[i];
+        PyObject *pair = PySequence_Fast_GET_ITEM(seq, i);
+
+        e->old_size = -1;
+        if(!PyTuple_Check(pair) || PyTuple_GET_SIZE(pair) != 2) {
+            PyErr_SetString(PyExc_TypeError,
+                            "attrs items must be (name, value) pairs");
+            goto free_entries;
+        }
+        if((e->name_obj = convert_bytes(PyTuple_GET_ITEM(pair, 0))) == NULL ||
+           (e->value_obj = convert_bytes(PyTuple_GET_ITEM(pair, 1))) == NULL)
+            goto free_entries;
+        if(strlen(PyBytes_AS_STRING(e->name_obj)) !=
+           (size_t) PyBytes_GET_SIZE(e->name_obj)) {
+            PyErr_SetString(PyExc_ValueError, "embedded null byte");
+            goto free_entries;
+        }
+        if(merge_ns(ns, PyBytes_AS_STRING(e->name_obj), &e->name,
+                    &e->name_buf) < 0) {
+            e->name_buf = NULL;
+            goto free_entries;
+        }
+        e->value = PyBytes_AS_STRING(e->value_obj);
+        e->size = (size_t) PyBytes_GET_SIZE(e->value_obj);
+        if(e->size > maxsize)
+            maxsize = e->size;
+    }
+
+    /* Snapshot the current values, if needed */
+    if(atomic) {
+        for(i = 0; i < nentries; i++) {
+            set_entry_t *e = &entries[i];
+            size_t nalloc = 0;
+            int io_errno;
+            e->old_size = _generic_get(_get_obj, &tgt, e->name, &e->old,
+                                       &nalloc, &io_errno);
+            if(e->old_size == -1 && io_errno != XATTR_ENOATTR)
+                goto free_entries;
+        }
+    }
+
+    /* One extra byte so that empty values don't need special casing */
+    if(only_changed && (scratch = PyMem_Malloc(maxsize + 1)) == NULL) {
+        PyErr_NoMemory();
+        goto free_entries;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    for(i = 0; i < nentries; i++) {
+        set_entry_t *e = &entries[i];
+        int nret;
+        if(only_changed)
+            nret = _set_if_changed_raw(&tgt, e->name, e->value, e->size,
+                                       scratch, flags);
+        else if((nret = _set_raw(&tgt, e->name, e->value, e->size,
+                                 flags)) == 0)
+            nret = 1;
+        if(nret == -1) {
+            saved_errno = errno;
+            failed = i;
+            break;
+        }
+        e->written = nret;
+        written += nret;
+    }
+    if(failed >= 0 && atomic) {
+        /* Restore in reverse order, so that the oldest snapshot wins
+           for duplicate names */
+        for(i = failed - 1; i >= 0; i--) {
+            set_entry_t *e = &entries[i];
+            if(!e->written)
+                continue;
+            if(e->old_size >= 0)
+                _set_raw(&tgt, e->name, e->old, (size_t) e->old_size, 0);
+            else
+                _remove_raw(&tgt, e->name);
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    if(failed >= 0) {
+        errno = saved_errno;
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto free_entries;
+    }
+
+    res = PyLong_FromLong(written);
+
+ free_entries:
+    PyMem_Free(scratch);
+    for(i = 0; i < nentries; i++) {
+        Py_XDECREF(entries[i].name_obj);
+        Py_XDECREF(entries[i].value_obj);
+        PyMem_Free(entries[i].name_buf);
+        PyMem_Free(entries[i].old);
+    }
+    PyMem_Free(entries);
+    Py_DECREF(seq);
+ free_tgt:
+    free_tgt(&tgt);
+
+    /* Return the result */
+    return res;
+}
+
+
+static char __pyremovexattr_doc__[] =
+    "removexattr(item, name[, nofollow])\n"
+    "Remove an attribute from a file (deprecated).\n"
+    "\n"
+    ITEM_DOC
+    NAME_REMOVE_DOC
+    NOFOLLOW_DOC
+    "\n"
+    ".. deprecated:: 0.4\n"
+    "   this function has been deprecated by the :func:`remove` function.\n"
+    ;
+
+/* Wrapper for removexattr */
+static PyObject *
+pyremovexattr(PyObject *self, PyObject *args)
+{
+    PyObject *myarg, *res;
+    int nofollow = 0;
+    char *attrname = NULL;
+    int nret;
+    target_t tgt;
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTuple(args, "Oet|i", &myarg, NULL, &attrname, &nofollow))
+        return NULL;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        res = NULL;
+        goto free_arg;
+    }
+
+    /* Remove the attribute */
+    nret = _remove_obj(&tgt, attrname);
+
+    free_tgt(&tgt);
+
+    if(nret == -1) {
+        res = PyErr_SetFromErrno(PyExc_IOError);
+        goto free_arg;
+    }
+
+    Py_INCREF(Py_None);
+    res = Py_None;
+
+ free_arg:
+    PyMem_Free(attrname);
+
+    /* Return the result */
+    return res;
+}
+
+static char __remove_doc__[] =
+    "remove(item, name[, nofollow=False, namespace=None])\n"
+    "Remove an attribute from a file.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.remove('/path/to/file', 'user.comment')\n"
+    "\n"
+    ITEM_DOC
+    NAME_REMOVE_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":returns: None\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.4\n"
+    NS_CHANGED_DOC
+    ;
+
+/* Wrapper for removexattr */
+static PyObject *
+xattr_remove(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *res;
+    int nofollow = 0;
+    char *attrname = NULL, *name_buf;
+    const char *ns = NULL;
+    const char *full_name;
+    int nret;
+    target_t tgt;
+    static char *kwlist[] = {"item", "name", "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|iy", kwlist,
+                                     &myarg, NULL, &attrname, &nofollow, &ns))
+        return NULL;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        res = NULL;
+        goto free_arg;
+    }
+
+    if(merge_ns(ns, attrname, &full_name, &name_buf) < 0) {
+        res = NULL;
+        goto free_arg;
+    }
+
+    /* Remove the attribute */
+    nret = _remove_obj(&tgt, full_name);
+
+    PyMem_Free(name_buf);
+
+    free_tgt(&tgt);
+
+    if(nret == -1) {
+        res = PyErr_SetFromErrno(PyExc_IOError);
+        goto free_arg;
+    }
+
+    Py_INCREF(Py_None);
+    res = Py_None;
+
+ free_arg:
+    PyMem_Free(attrname);
+
+    /* Return the result */
+    return res;
+}
+
+static char __remove_many_doc__[] =
+    "remove_many(item, names[, nofollow=False, namespace=None])\n"
+    "Remove multiple attributes from a file.\n"
+    "\n"
+    "Attributes which don't exist (anymore) are silently skipped.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.remove_many('/path/to/file', ['comment', 'mime_type'],\n"
+    "    ...                   namespace=xattr.NS_USER)\n"
+    "    2\n"
+    "\n"
+    ITEM_DOC
+    ":param names: an iterable of attribute names\n"
+    NOFOLLOW_DOC
+    NS_DOC
+    ":returns: the number of attributes actually removed\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+/* Wrapper for multiple removexattr calls */
+static PyObject *
+xattr_remove_many(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg, *names, *seq, *res = NULL;
+    PyObject **name_objs = NULL;
+    char **name_bufs = NULL;
+    const char **full_names = NULL;
+    int nofollow = 0;
+    const char *ns = NULL;
+    Py_ssize_t nnames = 0, i;
+    long removed = 0;
+    int failed = 0;
+    target_t tgt;
+    static char *kwlist[] = {"item", "names", "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OO|iy", kwlist,
+                                     &myarg, &names, &nofollow, &ns))
+        return NULL;
+
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        return NULL;
+
+    if((seq = PySequence_Fast(names, "names must be an iterable")) == NULL)
+        goto free_tgt;
+
+    nnames = PySequence_Fast_GET_SIZE(seq);
+    name_objs = PyMem_Calloc(nnames + 1, sizeof(PyObject *));
+    name_bufs = PyMem_Calloc(nnames + 1, sizeof(char *));
+    full_names = PyMem_Calloc(nnames + 1, sizeof(char *));
+    if(name_objs == NULL || name_bufs == NULL || full_names == NULL) {
+        nnames = 0;
+        PyErr_NoMemory();
+        goto free_names;
+    }
+
+    for(i = 0; i < nnames; i++) {
+        PyObject *name = PySequence_Fast_GET_ITEM(seq, i);
+        if((name_objs[i] = convert_bytes(name)) == NULL)
+            goto free_names;
+        if(strlen(PyBytes_AS_STRING(name_objs[i])) !=
+           (size_t) PyBytes_GET_SIZE(name_objs[i])) {
+            PyErr_SetString(PyExc_ValueError, "embedded null byte");
+            goto free_names;
+        }
+        if(merge_ns(ns, PyBytes_AS_STRING(name_objs[i]), &full_names[i],
+                    &name_bufs[i]) < 0) {
+            name_bufs[i] = NULL;
+            goto free_names;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    for(i = 0; i < nnames; i++) {
+        if(_remove_raw(&tgt, full_names[i]) == 0)
+            removed++;
+        else if(errno != XATTR_ENOATTR) {
+            failed = 1;
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    if(failed) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto free_names;
+    }
+
+    res = PyLong_FromLong(removed);
+
+ free_names:
+    for(i = 0; i < nnames; i++) {
+        Py_XDECREF(name_objs[i]);
+        PyMem_Free(name_bufs[i]);
+    }
+    PyMem_Free(name_objs);
+    PyMem_Free(name_bufs);
+    PyMem_Free(full_names);
+    Py_DECREF(seq);
+ free_tgt:
+    free_tgt(&tgt);
+
+    /* Return the result */
+    return res;
+}
+
+static char __remove_all_doc__[] =
+    "remove_all(item[, nofollow=False, namespace=None])\n"
+    "Remove all the extended attributes of an item.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.remove_all('/path/to/file', namespace=xattr.NS_USER)\n"
+    "    2\n"
+    "\n"
+    ITEM_DOC
+    NOFOLLOW_DOC
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes; for example, removing all user attributes can be\n"
+    "   accomplished by passing namespace=:const:`NS_USER`\n"
+    ":type namespace: bytes\n"
+    ":returns: the number of attributes actually removed\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. note:: Attributes which disappear between listing and removal\n"
+    "   are skipped, but attributes added in the meantime will not be\n"
+    "   removed.\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+/* Wrapper for listxattr plus removexattr */
+static PyObject *
+xattr_remove_all(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    char *buf = NULL;
+    int nofollow = 0;
+    ssize_t nret;
+    size_t nalloc = 0;
+    PyObject *myarg;
+    PyObject *res = NULL;
+    const char *ns = NULL;
+    const char *s;
+    long removed = 0;
+    int failed = 0;
+    target_t tgt;
+    static char *kwlist[] = {"item", "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iy", kwlist,
+                                     &myarg, &nofollow, &ns))
+        return NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        return NULL;
+
+    nret = _generic_get(_list_obj, &tgt, NULL, &buf, &nalloc, NULL);
+    if (nret == -1) {
+      goto free_buf;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    for(s = buf; s - buf < nret; s += strlen(s) + 1) {
+        if(matches_ns(ns, s) == NULL)
+            continue;
+        if(_remove_raw(&tgt, s) == 0)
+            removed++;
+        else if(errno != XATTR_ENOATTR) {
+            failed = 1;
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    if(failed) {
+        PyErr_SetFromErrno(PyExc_IOError);
+        goto free_buf;
+    }
+
+    res = PyLong_FromLong(removed);
+
+ free_buf:
+    /* Free the buffer, now it is no longer needed */
+    PyMem_Free(buf);
+    free_tgt(&tgt);
+
+    /* Return the result */
+    return res;
+}
+
+static char __pylistxattr_doc__[] =
+    "listxattr(item[, nofollow=False])\n"
+    "Return the list of attribute names for a file (deprecated).\n"
+    "\n"
+    ITEM_DOC
+    NOFOLLOW_DOC
+    "\n"
+    ".. deprecated:: 0.4\n"
+    "   this function has been deprecated by the :func:`list` function.\n"
+    ;
+
+/* Wrapper for listxattr */
+static PyObject *
+pylistxattr(PyObject *self, PyObject *args)
+{
+    char *buf = NULL;
+    int nofollow = 0;
+    ssize_t nret;
+    size_t nalloc = 0;
+    PyObject *myarg;
+    PyObject *mylist;
+    Py_ssize_t nattrs;
+    char *s;
+    target_t tgt;
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTuple(args, "O|i", &myarg, &nofollow))
+        return NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        return NULL;
+
+    nret = _generic_get(_list_obj, &tgt, NULL, &buf, &nalloc, NULL);
+    if (nret == -1) {
+      mylist = NULL;
+      goto free_buf;
+    }
+
+    /* Compute the number of attributes in the list */
+    for(s = buf, nattrs = 0; (s - buf) < nret; s += strlen(s) + 1) {
+        nattrs++;
+    }
+
+    /* Create the list which will hold the result */
+    mylist = PyList_New(nattrs);
+    if(mylist == NULL) {
+      goto free_buf;
+    }
+
+    /* Create and insert the attributes as strings in the list */
+    for(s = buf, nattrs = 0; s - buf < nret; s += strlen(s) + 1) {
+        PyObject *item = PyBytes_FromString(s);
+        if(item == NULL) {
+            Py_DECREF(mylist);
+            mylist = NULL;
+            goto free_buf;
+        }
+        PyList_SET_ITEM(mylist, nattrs, item);
+        nattrs++;
+    }
+
+ free_buf:
+    /* Free the buffer, now it is no longer needed */
+    PyMem_Free(buf);
+    free_tgt(&tgt);
+
+    /* Return the result */
+    return mylist;
+}
+
+/* Lazy results of list: owns the buffer filled by listxattr (with
+ * the namespace prefixes stripped in place), plus the offsets of the
+ * names; bytes objects are only created for the names accessed.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    char *buf;
+    size_t len;
+    size_t *offsets;            /* count + 1 entries */
+    Py_ssize_t count;
+    int names_as_str;
+} NameListObject;
+
+static PyTypeObject NameListType;
+
+/* Creates a NameList, taking ownership of buf on success */
+static PyObject *namelist_new(char *buf, size_t len,
+                              const name_filter_t *filter,
+                              int names_as_str) {
+    NameListObject *nl;
+    size_t *offsets, used = 0;
+    Py_ssize_t count = 0;
+    const char *s;
+
+    for(s = buf; (size_t) (s - buf) < len; s += strlen(s) + 1)
+        if(filter_match(filter, s) != NULL)
+            count++;
+    if((offsets = PyMem_New(size_t, (size_t) count + 1)) == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if((nl = PyObject_New(NameListObject, &NameListType)) == NULL) {
+        PyMem_Free(offsets);
+        return NULL;
+    }
+    /* Compact the matching names to the start of the buffer; they
+       never overlap later names, as they only get shorter. */
+    count = 0;
+    for(s = buf; (size_t) (s - buf) < len; ) {
+        size_t slen = strlen(s) + 1;
+        const char *name = filter_match(filter, s);
+        if(name != NULL) {
+            size_t nlen = slen - (size_t) (name - s);
+            offsets[count++] = used;
+            memmove(buf + used, name, nlen);
+            used += nlen;
+        }
+        s += slen;
+    }
+    offsets[count] = used;
+    nl->buf = buf;
+    nl->len = used;
+    nl->offsets = offsets;
+    nl->count = count;
+    nl->names_as_str = names_as_str;
+    return (PyObject *) nl;
+}
+
+static Py_ssize_t
+namelist_len(NameListObject *self)
+{
+    return self->count;
+}
+
+static PyObject *
+namelist_item(NameListObject *self, Py_ssize_t i)
+{
+    if(i < 0 || i >= self->count) {
+        PyErr_SetString(PyExc_IndexError, "NameList index out of range");
+        return NULL;
+    }
+    /* Exclude the terminating NUL */
+    return name_to_obj(self->buf + self->offsets[i],
+                       (Py_ssize_t) (self->offsets[i + 1] -
+                                     self->offsets[i] - 1),
+                       self->names_as_str);
+}
+
+static int
+namelist_contains(NameListObject *self, PyObject *key)
+{
+    PyObject *name;
+    const char *k;
+    size_t klen;
+    Py_ssize_t i;
+    int res = 0;
+
+    if((name = convert_fsname(key)) == NULL)
+        return -1;
+    k = PyBytes_AS_STRING(name);
+    klen = (size_t) PyBytes_GET_SIZE(name);
+    for(i = 0; i < self->count; i++) {
+        if(self->offsets[i + 1] - self->offsets[i] == klen + 1 &&
+           !memcmp(self->buf + self->offsets[i], k, klen)) {
+            res = 1;
+            break;
+        }
+    }
+    Py_DECREF(name);
+    return res;
+}
+
+static int
+namelist_getbuffer(NameListObject *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *) self, self->buf,
+                             (Py_ssize_t) self->len, 1, flags);
+}
+
+static void
+namelist_dealloc(NameListObject *self)
+{
+    PyMem_Free(self->buf);
+    PyMem_Free(self->offsets);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PySequenceMethods namelist_as_sequence = {
+    .sq_length = (lenfunc) namelist_len,
+    .sq_item = (ssizeargfunc) namelist_item,
+    .sq_contains = (objobjproc) namelist_contains,
+};
+
+static PyBufferProcs namelist_as_buffer = {
+    .bf_getbuffer = (getbufferproc) namelist_getbuffer,
+};
+
+static char __namelist_type_doc__[] =
+    "The attribute names of an item, as returned by ``list(lazy=True)``.\n"
+    "\n"
+    "A read-only sequence of names (bytes, or str if ``names_as_str``\n"
+    "was given), which are only created when accessed; membership tests\n"
+    "(with bytes or str) don't create any.\n"
+    "The underlying buffer, holding the NUL-terminated names back to\n"
+    "back, is exposed via the buffer protocol, e.g. ``bytes(names)``.\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyTypeObject NameListType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "xattr.NameList",
+    .tp_basicsize = sizeof(NameListObject),
+    .tp_dealloc = (destructor) namelist_dealloc,
+    .tp_as_sequence = &namelist_as_sequence,
+    .tp_as_buffer = &namelist_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = __namelist_type_doc__,
+};
+
+static char __list_doc__[] =
+    "list(item[, nofollow=False, namespace=None, lazy=False,\n"
+    "     names_as_str=False, namespaces=None, name_glob=None])\n"
+    "Return the list of attribute names for a file.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.list('/path/to/file')\n"
+    "    [b'user.test', b'user.comment', b'system.posix_acl_access']\n"
+    "    >>> xattr.list('/path/to/file', namespace=xattr.NS_USER)\n"
+    "    [b'test', b'comment']\n"
+    "\n"
+    ITEM_DOC
+    NOFOLLOW_DOC
+    NS_DOC
+    ":keyword lazy: if true, return a :class:`NameList` instead of a\n"
+    "    list, which only creates the names that are accessed\n"
+    ":type lazy: bool\n"
+    NAMES_AS_STR_DOC
+    FILTER_DOC
+    ":returns: the list of attributes; note that if a namespace \n"
+    "    argument was passed, it (and the separator) will be stripped\n"
+    "    from the names\n"
+    "    returned\n"
+    ":rtype: list[bytes or str] or NameList\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.4\n"
+    NS_CHANGED_DOC "\n"
+    ".. versionchanged:: 0.9\n"
+    "   The *lazy*, *names_as_str*, *namespaces* and *name_glob*\n"
+    "   arguments were added.\n"
+    ;
+
+/* Wrapper for listxattr */
+static PyObject *
+xattr_list(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    char *buf = NULL;
+    char small[ESTIMATE_ATTR_SIZE];
+    const char *data = NULL;
+    int nofollow = 0, lazy = 0, names_as_str = 0;
+    ssize_t nret;
+    size_t nalloc = 0;
+    PyObject *myarg;
+    PyObject *res, *namespaces = NULL;
+    const char *ns = NULL, *glob = NULL;
+    name_filter_t filter;
+    Py_ssize_t nattrs;
+    const char *s;
+    target_t tgt;
+    static char *kwlist[] = {"item", "nofollow", "namespace", "lazy",
+                             "names_as_str", "namespaces", "name_glob",
+                             NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iyppOy", kwlist,
+                                     &myarg, &nofollow, &ns, &lazy,
+                                     &names_as_str, &namespaces, &glob))
+        return NULL;
+    if(filter_init(&filter, ns, namespaces, glob) < 0)
+        return NULL;
+    res = NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0) {
+        goto free_arg;
+    }
+    /* The lazy list needs to own its buffer */
+    if(lazy)
+        nret = _generic_get(_list_obj, &tgt, NULL, &buf, &nalloc, NULL);
+    else
+        nret = _get_small(_list_obj, &tgt, NULL, small, &data, &buf,
+                          &nalloc, NULL);
+    if (nret == -1) {
+      goto free_tgt;
+    }
+
+    if(lazy) {
+        /* The list takes ownership of the buffer */
+        if((res = namelist_new(buf, (size_t) nret, &filter,
+                                names_as_str)) != NULL)
+            buf = NULL;
+        goto free_buf;
+    }
+
+    /* Compute the number of attributes in the list */
+    for(s = data, nattrs = 0; (s - data) < nret; s += strlen(s) + 1) {
+        if(filter_match(&filter, s) != NULL)
+            nattrs++;
+    }
+
+    /* Create the list which will hold the result */
+    if((res = PyList_New(nattrs)) == NULL) {
+        goto free_buf;
+    }
+
+    /* Create and insert the attributes as strings in the list */
+    for(s = data, nattrs = 0; s - data < nret; s += strlen(s) + 1) {
+        const char *name = filter_match(&filter, s);
+        if(name != NULL) {
+            PyObject *item = name_to_obj(name, (Py_ssize_t) strlen(name),
+                                         names_as_str);
+            if(item == NULL) {
+                Py_DECREF(res);
+                res = NULL;
+                goto free_buf;
+            }
+            PyList_SET_ITEM(res, nattrs, item);
+            nattrs++;
+        }
+    }
+
+ free_buf:
+    /* Free the buffer, now it is no longer needed */
+    PyMem_Free(buf);
+
+ free_tgt:
+    free_tgt(&tgt);
+ free_arg:
+    filter_free(&filter);
+
+    /* Return the result */
+    return res;
+}
+
+/* Tree operations.
+ *
+ * These walk a whole directory tree natively, with the GIL released
+ * for the entire walk; hence they only use the raw allocator, and
+ * record errors in a tree_error_t, which is converted into a Python
+ * exception once the GIL is held again. Symbolic links are never
+ * followed.
+ */
+
+typedef struct {
+    int io_errno;     /* errno of the failed operation */
+    const char *msg;  /* if set, a format error instead of an I/O one */
+    char *path;       /* path of the failed item, if any */
+} tree_error_t;
+
+static int tree_fail(tree_error_t *err, int io_errno, const char *path) {
+    err->io_errno = io_errno;
+    if(path != NULL && err->path == NULL) {
+        size_t len = strlen(path) + 1;
+        if((err->path = PyMem_RawMalloc(len)) != NULL)
+            memcpy(err->path, path, len);
+    }
+    return -1;
+}
+
+static int tree_fail_msg(tree_error_t *err, const char *msg) {
+    err->msg = msg;
+    return -1;
+}
+
+/* Sets the Python exception for a failed tree operation; must be
+   called with the GIL held. */
+static void tree_raise(tree_error_t *err) {
+    if(err->msg != NULL) {
+        PyErr_SetString(PyExc_ValueError, err->msg);
+    } else if(err->io_errno == ENOMEM) {
+        PyErr_NoMemory();
+    } else {
+        errno = err->io_errno;
+        if(err->path != NULL)
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, err->path);
+        else
+            PyErr_SetFromErrno(PyExc_IOError);
+    }
+    PyMem_RawFree(err->path);
+    err->path = NULL;
+}
+
+/* Grows an array of elements to hold at least one more */
+static int tree_reserve(void **array, size_t count, size_t *alloc,
+                        size_t elem, tree_error_t *err) {
+    if(count == *alloc) {
+        size_t nalloc = *alloc * 2 + 16;
+        void *tmp = PyMem_RawRealloc(*array, nalloc * elem);
+        if(tmp == NULL)
+            return tree_fail(err, ENOMEM, NULL);
+        *array = tmp;
+        *alloc = nalloc;
+    }
+    return 0;
+}
+
+/* GIL-less version of _generic_get, using the raw allocator. If name
+   is NULL, it lists the attributes instead. Returns -1 with errno set
+   on failure; the buffer must be freed by the caller in all cases. */
+static ssize_t _generic_get_raw(target_t *tgt, const char *name,
+                                char **buffer, size_t *size) {
+    ssize_t res;
+
+    if (*buffer == NULL) {
+        if (*size == 0)
+            *size = ESTIMATE_ATTR_SIZE;
+        if((*buffer = PyMem_RawMalloc(*size)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    while((res = name == NULL ? _list_raw(tgt, *buffer, *size) :
+           _get_raw(tgt, name, *buffer, *size)) == -1) {
+        ssize_t realloc_size_s;
+        char *tmp_buf;
+        if(errno != ERANGE)
+            return -1;
+        realloc_size_s = name == NULL ? _list_raw(tgt, NULL, 0) :
+            _get_raw(tgt, name, NULL, 0);
+        if(realloc_size_s == -1)
+            return -1;
+        if((tmp_buf = PyMem_RawRealloc(*buffer,
+                                       (size_t) realloc_size_s)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *buffer = tmp_buf;
+        *size = (size_t) realloc_size_s;
+    }
+    return res;
+}
+
+typedef struct {
+    char *buf;        /* the current path */
+    size_t len;
+    size_t alloc;
+    size_t root_len;  /* length of the root prefix in buf */
+} tree_path_t;
+
+static int tree_path_init(tree_path_t *p, const char *root,
+                          tree_error_t *err) {
+    p->len = p->root_len = strlen(root);
+    p->alloc = p->len + 256;
+    if((p->buf = PyMem_RawMalloc(p->alloc)) == NULL)
+        return tree_fail(err, ENOMEM, NULL);
+    memcpy(p->buf, root, p->len + 1);
+    return 0;
+}
+
+/* Appends a path component to the current path */
+static int tree_path_push(tree_path_t *p, const char *name,
+                          tree_error_t *err) {
+    size_t nlen = strlen(name);
+    int sep = p->len > 0 && p->buf[p->len - 1] != '/';
+    if(p->len + sep + nlen + 1 > p->alloc) {
+        size_t nalloc = (p->len + sep + nlen + 1) * 2;
+        char *tmp = PyMem_RawRealloc(p->buf, nalloc);
+        if(tmp == NULL)
+            return tree_fail(err, ENOMEM, NULL);
+        p->buf = tmp;
+        p->alloc = nalloc;
+    }
+    if(sep)
+        p->buf[p->len++] = '/';
+    memcpy(p->buf + p->len, name, nlen + 1);
+    p->len += nlen;
+    return 0;
+}
+
+/* Returns the current path relative to the root ("" for the root) */
+static const char *tree_relpath(const tree_path_t *p) {
+    const char *s = p->buf + p->root_len;
+    return *s == '/' ? s + 1 : s;
+}
+
+/* Visitor callback; called once for each item with post == 0, and for
+   directories a second time (after all their children) with post ==
+   1. Returns -1 (with err filled in) to abort the walk. */
+typedef int (*tree_cb)(void *ctx, tree_path_t *p, const struct stat *st,
+                       int post, tree_error_t *err);
+
+/* Walks the tree rooted at the current path, depth-first. Items which
+   vanish during the walk are skipped. */
+static int tree_walk(tree_path_t *p, tree_cb cb, void *ctx,
+                     tree_error_t *err, int is_root) {
+    struct stat st;
+    DIR *dir;
+    struct dirent *de;
+    size_t saved_len;
+    int ret = 0;
+
+    if(lstat(p->buf, &st) == -1) {
+        if(errno == ENOENT && !is_root)
+            return 0;
+        return tree_fail(err, errno, p->buf);
+    }
+    if(cb(ctx, p, &st, 0, err) < 0)
+        return -1;
+    if(!S_ISDIR(st.st_mode))
+        return 0;
+    if((dir = opendir(p->buf)) == NULL) {
+        if(errno == ENOENT && !is_root)
+            return 0;
+        return tree_fail(err, errno, p->buf);
+    }
+    saved_len = p->len;
+    for(;;) {
+        errno = 0;
+        if((de = readdir(dir)) == NULL) {
+            if(errno != 0)
+                ret = tree_fail(err, errno, p->buf);
+            break;
+        }
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if((ret = tree_path_push(p, de->d_name, err)) < 0)
+            break;
+        ret = tree_walk(p, cb, ctx, err, 0);
+        p->len = saved_len;
+        p->buf[saved_len] = '\0';
+        if(ret < 0)
+            break;
+    }
+    closedir(dir);
+    if(ret == 0)
+        ret = cb(ctx, p, &st, 1, err);
+    return ret;
+}
+
+/* Snapshot (dump/restore) support.
+ *
+ * The format is a header ("PYXATTR", a version byte and a flags byte)
+ * followed by one record per item that has attributes, and an end
+ * marker ('E'). A record is:
+ *
+ *   'F' varint(path length) path attr* varint(0) [crc32]
+ *
+ * where path is relative to the dumped root, and each attr is:
+ *
+ *   varint(1) varint(name length) name varint(value length) value
+ *   varint(2 + id) varint(value length) value
+ *
+ * The first form defines a new name, which (while the dictionary has
+ * room) is assigned the next id, so that later occurences only need
+ * the second form. The optional little-endian CRC-32 covers the whole
+ * record, from the 'F' tag to the terminating zero.
+ */
+
+#define SNAPSHOT_MAGIC "PYXATTR"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_FLAG_CRC 1
+#define SNAPSHOT_BUFSIZE 65536
+#define SNAPSHOT_MAX_NAMES 4096
+#define SNAPSHOT_NAME_SLOTS (2 * SNAPSHOT_MAX_NAMES)
+/* Sanity limits when reading, so that corrupted input doesn't lead to
+   huge allocations */
+#define SNAPSHOT_MAX_PATH (1 << 20)
+#define SNAPSHOT_MAX_VALUE (1 << 24)
+
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+/* Updates a (pre- and post-inverted) CRC-32 with the given data */
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    crc = ~crc;
+    while(len-- > 0) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc32_nibble[crc & 15];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 15];
+    }
+    return ~crc;
+}
+
+typedef struct {
+    char *name;
+    size_t len;
+    uint64_t hash;
+} dict_name_t;
+
+/* Bounded name dictionary, shared by the dump and restore sides */
+typedef struct {
+    dict_name_t names[SNAPSHOT_MAX_NAMES];
+    uint32_t count;
+    /* id + 1 of the name in each slot, 0 for empty; only used when
+       dumping */
+    uint32_t slots[SNAPSHOT_NAME_SLOTS];
+} name_dict_t;
+
+static void name_dict_free(name_dict_t *d) {
+    uint32_t i;
+    if(d == NULL)
+        return;
+    for(i = 0; i < d->count; i++)
+        PyMem_RawFree(d->names[i].name);
+    PyMem_RawFree(d);
+}
+
+/* Adds a name to the dictionary, if it has room; returns -1 only on
+   allocation failure. */
+static int name_dict_add(name_dict_t *d, const char *name, size_t len,
+                         uint64_t hash) {
+    dict_name_t *n;
+    if(d->count >= SNAPSHOT_MAX_NAMES)
+        return 0;
+    n = &d->names[d->count];
+    if((n->name = PyMem_RawMalloc(len + 1)) == NULL)
+        return -1;
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    n->len = len;
+    n->hash = hash;
+    d->count++;
+    return 0;
+}
+
+/* Looks up a name, returning its id or -1; if missing, it is added
+   (if possible), in which case *added is set. */
+static long name_dict_intern(name_dict_t *d, const char *name, size_t len,
+                             int *added) {
+    uint64_t hash = xattr_hash(name, len, XATTR_HASH_INIT);
+    size_t i = (size_t) hash & (SNAPSHOT_NAME_SLOTS - 1);
+
+    *added = 0;
+    while(d->slots[i] != 0) {
+        dict_name_t *n = &d->names[d->slots[i] - 1];
+        if(n->hash == hash && n->len == len && !memcmp(n->name, name, len))
+            return (long) d->slots[i] - 1;
+        i = (i + 1) & (SNAPSHOT_NAME_SLOTS - 1);
+    }
+    if(d->count < SNAPSHOT_MAX_NAMES) {
+        if(name_dict_add(d, name, len, hash) < 0)
+            return -2;
+        d->slots[i] = d->count;
+        *added = 1;
+    }
+    return -1;
+}
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    int use_crc;
+    uint32_t crc;
+} snap_writer_t;
+
+static int snap_flush(snap_writer_t *w, tree_error_t *err) {
+    size_t done = 0;
+    while(done < w->len) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            return tree_fail(err, errno, NULL);
+        }
+        done += (size_t) n;
+    }
+    w->len = 0;
+    return 0;
+}
+
+static int snap_write(snap_writer_t *w, const void *data, size_t len,
+                      tree_error_t *err) {
+    const char *p = data;
+    if(w->use_crc)
+        w->crc = crc32_update(w->crc, data, len);
+    while(len > 0) {
+        size_t chunk = SNAPSHOT_BUFSIZE - w->len;
+        if(chunk > len)
+            chunk = len;
+        memcpy(w->buf + w->len, p, chunk);
+        w->len += chunk;
+        p += chunk;
+        len -= chunk;
+        if(w->len == SNAPSHOT_BUFSIZE && snap_flush(w, err) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int snap_write_varint(snap_writer_t *w, uint64_t v,
+                             tree_error_t *err) {
+    unsigned char b[10];
+    size_t n = 0;
+    do {
+        b[n] = v & 0x7f;
+        v >>= 7;
+        if(v != 0)
+            b[n] |= 0x80;
+        n++;
+    } while(v != 0);
+    return snap_write(w, b, n, err);
+}
+
+typedef struct {
+    snap_writer_t w;
+    name_dict_t *dict;
+    const char *ns;
+    char *buf_list, *buf_val;
+    size_t size_list, size_val;
+    long count;
+} dump_ctx_t;
+
+static int dump_item(void *data, tree_path_t *p, const struct stat *st,
+                     int post, tree_error_t *err) {
+    dump_ctx_t *ctx = data;
+    target_t tgt;
+    ssize_t nlist, nval;
+    const char *s;
+    int started = 0;
+
+    if(post)
+        return 0;
+    tgt.type = T_LINK;
+    tgt.name = p->buf;
+    tgt.tmp = NULL;
+    nlist = _generic_get_raw(&tgt, NULL, &ctx->buf_list, &ctx->size_list);
+    if(nlist == -1) {
+        /* Vanished items, or filesystems without xattr support */
+        if(errno == ENOENT || errno == ENOTSUP || errno == EOPNOTSUPP)
+            return 0;
+        return tree_fail(err, errno, p->buf);
+    }
+    for(s = ctx->buf_list; s - ctx->buf_list < nlist; s += strlen(s) + 1) {
+        size_t name_len = strlen(s);
+        long id;
+        int added;
+
+        if(matches_ns(ctx->ns, s) == NULL)
+            continue;
+        nval = _generic_get_raw(&tgt, s, &ctx->buf_val, &ctx->size_val);
+        if(nval == -1) {
+            if(errno == XATTR_ENOATTR)
+                continue;
+            return tree_fail(err, errno, p->buf);
+        }
+        if(!started) {
+            const char *rel = tree_relpath(p);
+            size_t rel_len = strlen(rel);
+            ctx->w.crc = 0;
+            if(snap_write(&ctx->w, "F", 1, err) < 0 ||
+               snap_write_varint(&ctx->w, rel_len, err) < 0 ||
+               snap_write(&ctx->w, rel, rel_len, err) < 0)
+                return -1;
+            started = 1;
+        }
+        if((id = name_dict_intern(ctx->dict, s, name_len, &added)) == -2)
+            return tree_fail(err, ENOMEM, NULL);
+        if(id >= 0) {
+            if(snap_write_varint(&ctx->w, (uint64_t) id + 2, err) < 0)
+                return -1;
+        } else if(snap_write_varint(&ctx->w, 1, err) < 0 ||
+                  snap_write_varint(&ctx->w, name_len, err) < 0 ||
+                  snap_write(&ctx->w, s, name_len, err) < 0)
+            return -1;
+        if(snap_write_varint(&ctx->w, (uint64_t) nval, err) < 0 ||
+           snap_write(&ctx->w, ctx->buf_val, (size_t) nval, err) < 0)
+            return -1;
+        ctx->count++;
+    }
+    if(started) {
+        if(snap_write_varint(&ctx->w, 0, err) < 0)
+            return -1;
+        if(ctx->w.use_crc) {
+            uint32_t crc = ctx->w.crc;
+            unsigned char b[4] = {crc & 0xff, (crc >> 8) & 0xff,
+                                  (crc >> 16) & 0xff, (crc >> 24) & 0xff};
+            if(snap_write(&ctx->w, b, sizeof(b), err) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static char __dump_doc__[] =
+    "dump(root, fd[, namespace=None, crc=True])\n"
+    "Write the extended attributes of a whole tree to a file descriptor.\n"
+    "\n"
+    "The tree is walked natively (without following symbolic links),\n"
+    "and the attributes are streamed in a compact, length-prefixed\n"
+    "binary format, which can be read back by :func:`restore`. Memory\n"
+    "usage is bounded, independent of the size of the tree.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> with open('/backup/attrs.bin', 'wb') as f:\n"
+    "    ...     xattr.dump('/srv/data', f)\n"
+    "    1234\n"
+    "\n"
+    ":param root: the root of the tree to dump; paths are recorded\n"
+    "    relative to it\n"
+    ":type root: str, bytes or path-like object\n"
+    ":param fd: the file descriptor, or file-like object, to write to;\n"
+    "    note that data is written directly to the underlying\n"
+    "    descriptor, bypassing any Python-level buffering\n"
+    ":keyword namespace: if given, only attributes in this namespace\n"
+    "    are dumped; names are always recorded in full\n"
+    ":type namespace: bytes\n"
+    ":param crc: whether to add a CRC-32 checksum to each record\n"
+    ":type crc: boolean, optional\n"
+    ":returns: the number of attributes written\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_dump(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *root_obj = NULL, *fd_obj, *res = NULL;
+    const char *ns = NULL;
+    int use_crc = 1;
+    int ret;
+    dump_ctx_t ctx;
+    tree_path_t path;
+    tree_error_t err = {0, NULL, NULL};
+    unsigned char header[9] = SNAPSHOT_MAGIC;
+    static char *kwlist[] = {"root", "fd", "namespace", "crc", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O&O|yi", kwlist,
+                                     PyUnicode_FSConverter, &root_obj,
+                                     &fd_obj, &ns, &use_crc))
+        return NULL;
+
+    memset(&ctx, 0, sizeof(ctx));
+    path.buf = NULL;
+    if((ctx.w.fd = PyObject_AsFileDescriptor(fd_obj)) == -1)
+        goto free_root;
+    ctx.ns = ns;
+    ctx.w.buf = PyMem_RawMalloc(SNAPSHOT_BUFSIZE);
+    ctx.dict = PyMem_RawCalloc(1, sizeof(name_dict_t));
+    if(ctx.w.buf == NULL || ctx.dict == NULL) {
+        PyErr_NoMemory();
+        goto free_ctx;
+    }
+    header[7] = SNAPSHOT_VERSION;
+    header[8] = use_crc ? SNAPSHOT_FLAG_CRC : 0;
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = tree_path_init(&path, PyBytes_AS_STRING(root_obj), &err);
+    if(ret == 0)
+        ret = snap_write(&ctx.w, header, sizeof(header), &err);
+    ctx.w.use_crc = use_crc;
+    if(ret == 0)
+        ret = tree_walk(&path, dump_item, &ctx, &err, 1);
+    if(ret == 0)
+        ret = snap_write(&ctx.w, "E", 1, &err);
+    if(ret == 0)
+        ret = snap_flush(&ctx.w, &err);
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        tree_raise(&err);
+        goto free_ctx;
+    }
+    res = PyLong_FromLong(ctx.count);
+
+ free_ctx:
+    PyMem_RawFree(path.buf);
+    PyMem_RawFree(ctx.buf_list);
+    PyMem_RawFree(ctx.buf_val);
+    PyMem_RawFree(ctx.w.buf);
+    name_dict_free(ctx.dict);
+ free_root:
+    Py_DECREF(root_obj);
+
+    /* Return the result */
+    return res;
+}
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t pos, len;
+    int use_crc;
+    uint32_t crc;
+} snap_reader_t;
+
+#define SNAPSHOT_TRUNCATED "truncated xattr snapshot"
+#define SNAPSHOT_CORRUPTED "corrupted xattr snapshot"
+
+static int snap_read(snap_reader_t *r, void *data, size_t len,
+                     tree_error_t *err) {
+    char *p = data;
+    while(len > 0) {
+        size_t chunk;
+        if(r->pos == r->len) {
+            ssize_t n = read(r->fd, r->buf, SNAPSHOT_BUFSIZE);
+            if(n == -1) {
+                if(errno == EINTR)
+                    continue;
+                return tree_fail(err, errno, NULL);
+            }
+            if(n == 0)
+                return tree_fail_msg(err, SNAPSHOT_TRUNCATED);
+            r->pos = 0;
+            r->len = (size_t) n;
+        }
+        chunk = r->len - r->pos;
+        if(chunk > len)
+            chunk = len;
+        memcpy(p, r->buf + r->pos, chunk);
+        if(r->use_crc)
+            r->crc = crc32_update(r->crc, p, chunk);
+        r->pos += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int snap_read_varint(snap_reader_t *r, uint64_t *v,
+                            tree_error_t *err) {
+    unsigned char b;
+    int shift = 0;
+    *v = 0;
+    do {
+        if(shift > 63)
+            return tree_fail_msg(err, SNAPSHOT_CORRUPTED);
+        if(snap_read(r, &b, 1, err) < 0)
+            return -1;
+        *v |= (uint64_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while(b & 0x80);
+    return 0;
+}
+
+/* Reads a varint length-prefixed string into a (growing) buffer,
+   NUL-terminating it */
+static int snap_read_string(snap_reader_t *r, char **buf, size_t *alloc,
+                            size_t *len, size_t limit, tree_error_t *err) {
+    uint64_t v;
+    if(snap_read_varint(r, &v, err) < 0)
+        return -1;
+    if(v > limit)
+        return tree_fail_msg(err, SNAPSHOT_CORRUPTED);
+    if(*buf == NULL || (size_t) v + 1 > *alloc) {
+        char *tmp = PyMem_RawRealloc(*buf, (size_t) v + 1);
+        if(tmp == NULL)
+            return tree_fail(err, ENOMEM, NULL);
+        *buf = tmp;
+        *alloc = (size_t) v + 1;
+    }
+    if(snap_read(r, *buf, (size_t) v, err) < 0)
+        return -1;
+    (*buf)[v] = '\0';
+    *len = (size_t) v;
+    return 0;
+}
+
+/* Checks that a relative path from a snapshot can't escape the root */
+static int safe_relpath(const char *path, size_t len) {
+    const char *s = path;
+    if(strlen(path) != len || *path == '/')
+        return 0;
+    while(*s != '\0') {
+        const char *end = strchr(s, '/');
+        size_t clen = end == NULL ? strlen(s) : (size_t) (end - s);
+        if(clen == 2 && s[0] == '.' && s[1] == '.')
+            return 0;
+        s += clen;
+        if(*s == '/')
+            s++;
+    }
+    return 1;
+}
+
+typedef struct {
+    size_t name_off;
+    size_t val_off;
+    size_t val_len;
+} staged_attr_t;
+
+typedef struct {
+    snap_reader_t r;
+    name_dict_t *dict;
+    const char *root;
+    char *path, *str, *stage;
+    size_t path_alloc, str_alloc, stage_alloc, stage_len;
+    staged_attr_t *attrs;
+    size_t nattrs, attrs_alloc;
+    size_t rel_off;     /* offset of the relative path in path */
+    int root_fd, parent_fd;
+    int use_proc;       /* whether /proc/self/fd paths can be used */
+    long count;
+} restore_ctx_t;
+
+/* Appends data to the staging buffer, returning its offset */
+static int restore_stage(restore_ctx_t *ctx, const char *data, size_t len,
+                         size_t *offset, tree_error_t *err) {
+    if(ctx->stage_len + len > ctx->stage_alloc || ctx->stage == NULL) {
+        size_t nalloc = (ctx->stage_len + len) * 2 + 1;
+        char *tmp = PyMem_RawRealloc(ctx->stage, nalloc);
+        if(tmp == NULL)
+            return tree_fail(err, ENOMEM, NULL);
+        ctx->stage = tmp;
+        ctx->stage_alloc = nalloc;
+    }
+    memcpy(ctx->stage + ctx->stage_len, data, len);
+    *offset = ctx->stage_len;
+    ctx->stage_len += len;
+    return 0;
+}
+
+/* Resolves the relative path of the current record beneath the root,
+   without following symbolic links in any of its components (so that
+   a symlink planted inside the tree can't redirect the restore
+   outside of it). Intermediate directories are opened one by one
+   with O_NOFOLLOW; the last component is then addressed via its
+   parent's /proc/self/fd entry and not followed (where available), or
+   opened with O_NOFOLLOW. On failure, returns -1 with errno set. */
+static int restore_target(restore_ctx_t *ctx, target_t *tgt) {
+    char *s = ctx->path + ctx->rel_off, *end;
+    int dir_fd = ctx->root_fd, fd, saved_errno;
+
+    tgt->tmp = NULL;
+    ctx->parent_fd = -1;
+    if(ctx->root_fd == -1) {
+        if((ctx->root_fd = open(ctx->root, O_RDONLY | O_DIRECTORY |
+                                O_CLOEXEC)) == -1)
+            return -1;
+#ifdef __linux__
+        ctx->use_proc = access("/proc/self/fd", X_OK) == 0;
+#endif
+        dir_fd = ctx->root_fd;
+    }
+    for(;;) {
+        while(*s == '/')
+            s++;
+        if((end = strchr(s, '/')) == NULL)
+            break;
+        *end = '\0';
+        fd = openat(dir_fd, s, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                    O_CLOEXEC);
+        *end = '/';
+        saved_errno = errno;
+        if(dir_fd != ctx->root_fd)
+            close(dir_fd);
+        if(fd == -1) {
+            errno = saved_errno;
+            return -1;
+        }
+        dir_fd = fd;
+        s = end + 1;
+    }
+    if(*s == '\0' || !strcmp(s, ".")) {
+        /* The directory itself */
+        fd = dir_fd == ctx->root_fd ? dup(dir_fd) : dir_fd;
+    } else if(ctx->use_proc) {
+        size_t len = strlen(s) + 32;
+        if(len > ctx->str_alloc) {
+            char *tmp = PyMem_RawRealloc(ctx->str, len);
+            if(tmp == NULL) {
+                if(dir_fd != ctx->root_fd)
+                    close(dir_fd);
+                errno = ENOMEM;
+                return -1;
+            }
+            ctx->str = tmp;
+            ctx->str_alloc = len;
+        }
+        snprintf(ctx->str, len, "/proc/self/fd/%d/%s", dir_fd, s);
+        tgt->type = T_LINK;
+        tgt->name = ctx->str;
+        /* The parent must stay open while the path is in use */
+        if(dir_fd != ctx->root_fd)
+            ctx->parent_fd = dir_fd;
+        return 0;
+    } else {
+        fd = openat(dir_fd, s, O_RDONLY | O_NOFOLLOW | O_NONBLOCK |
+                    O_NOCTTY | O_CLOEXEC);
+        saved_errno = errno;
+        if(dir_fd != ctx->root_fd)
+            close(dir_fd);
+        errno = saved_errno;
+    }
+    if(fd == -1)
+        return -1;
+    tgt->type = T_FD;
+    tgt->fd = fd;
+    return 0;
+}
+
+static void restore_target_close(restore_ctx_t *ctx, target_t *tgt) {
+    if(tgt->type == T_FD)
+        close(tgt->fd);
+    if(ctx->parent_fd != -1)
+        close(ctx->parent_fd);
+}
+
+/* Reads one item record (after its tag), and applies it once fully
+   read and verified */
+static int restore_record(restore_ctx_t *ctx, tree_error_t *err) {
+    size_t rel_len, root_len = strlen(ctx->root), i;
+    uint64_t ref;
+    target_t tgt;
+
+    if(snap_read_string(&ctx->r, &ctx->str, &ctx->str_alloc, &rel_len,
+                        SNAPSHOT_MAX_PATH, err) < 0)
+        return -1;
+    if(!safe_relpath(ctx->str, rel_len))
+        return tree_fail_msg(err, "unsafe path in xattr snapshot");
+    if(root_len + rel_len + 2 > ctx->path_alloc) {
+        size_t nalloc = root_len + rel_len + 2;
+        char *tmp = PyMem_RawRealloc(ctx->path, nalloc);
+        if(tmp == NULL)
+            return tree_fail(err, ENOMEM, NULL);
+        ctx->path = tmp;
+        ctx->path_alloc = nalloc;
+    }
+    memcpy(ctx->path, ctx->root, root_len + 1);
+    if(rel_len > 0) {
+        if(root_len > 0 && ctx->path[root_len - 1] != '/')
+            ctx->path[root_len++] = '/';
+        memcpy(ctx->path + root_len, ctx->str, rel_len + 1);
+    }
+    ctx->rel_off = root_len;
+
+    ctx->nattrs = 0;
+    ctx->stage_len = 0;
+    for(;;) {
+        staged_attr_t *a;
+        const char *name;
+        size_t name_len, val_len;
+
+        if(snap_read_varint(&ctx->r, &ref, err) < 0)
+            return -1;
+        if(ref == 0)
+            break;
+        if(ref == 1) {
+            if(snap_read_string(&ctx->r, &ctx->str, &ctx->str_alloc,
+                                &name_len, SNAPSHOT_MAX_PATH, err) < 0)
+                return -1;
+            if(strlen(ctx->str) != name_len || name_len == 0)
+                return tree_fail_msg(err, SNAPSHOT_CORRUPTED);
+            if(name_dict_add(ctx->dict, ctx->str, name_len, 0) < 0)
+                return tree_fail(err, ENOMEM, NULL);
+            name = ctx->str;
+        } else if(ref - 2 < ctx->dict->count) {
+            name = ctx->dict->names[ref - 2].name;
+            name_len = ctx->dict->names[ref - 2].len;
+        } else
+            return tree_fail_msg(err, SNAPSHOT_CORRUPTED);
+        if(ctx->nattrs == ctx->attrs_alloc) {
+            size_t nalloc = ctx->attrs_alloc * 2 + 16;
+            staged_attr_t *tmp = PyMem_RawRealloc(ctx->attrs,
+                                                  nalloc * sizeof(*tmp));
+            if(tmp == NULL)
+                return tree_fail(err, ENOMEM, NULL);
+            ctx->attrs = tmp;
+            ctx->attrs_alloc = nalloc;
+        }
+        a = &ctx->attrs[ctx->nattrs];
+        if(restore_stage(ctx, name, name_len + 1, &a->name_off, err) < 0)
+            return -1;
+        if(snap_read_string(&ctx->r, &ctx->str, &ctx->str_alloc, &val_len,
+                            SNAPSHOT_MAX_VALUE, err) < 0 ||
+           restore_stage(ctx, ctx->str, val_len, &a->val_off, err) < 0)
+            return -1;
+        a->val_len = val_len;
+        ctx->nattrs++;
+    }
+    if(ctx->r.use_crc) {
+        uint32_t crc = ctx->r.crc;
+        unsigned char b[4];
+        if(snap_read(&ctx->r, b, sizeof(b), err) < 0)
+            return -1;
+        if(crc != ((uint32_t) b[0] | (uint32_t) b[1] << 8 |
+                   (uint32_t) b[2] << 16 | (uint32_t) b[3] << 24))
+            return tree_fail_msg(err, "checksum mismatch in xattr snapshot");
+    }
+
+    if(restore_target(ctx, &tgt) < 0)
+        return tree_fail(err, errno, ctx->path);
+    for(i = 0; i < ctx->nattrs; i++) {
+        staged_attr_t *a = &ctx->attrs[i];
+        if(_set_raw(&tgt, ctx->stage + a->name_off, ctx->stage + a->val_off,
+                    a->val_len, 0) == -1) {
+            int saved_errno = errno;
+            restore_target_close(ctx, &tgt);
+            return tree_fail(err, saved_errno, ctx->path);
+        }
+        ctx->count++;
+    }
+    restore_target_close(ctx, &tgt);
+    return 0;
+}
+
+static int restore_stream(restore_ctx_t *ctx, tree_error_t *err) {
+    unsigned char header[9];
+
+    if(snap_read(&ctx->r, header, sizeof(header), err) < 0)
+        return -1;
+    if(memcmp(header, SNAPSHOT_MAGIC, 7) || header[7] != SNAPSHOT_VERSION)
+        return tree_fail_msg(err, "not an xattr snapshot,"
+                             " or unsupported version");
+    ctx->r.use_crc = header[8] & SNAPSHOT_FLAG_CRC;
+    for(;;) {
+        char tag;
+        ctx->r.crc = 0;
+        if(snap_read(&ctx->r, &tag, 1, err) < 0)
+            return -1;
+        if(tag == 'E')
+            return 0;
+        if(tag != 'F')
+            return tree_fail_msg(err, SNAPSHOT_CORRUPTED);
+        if(restore_record(ctx, err) < 0)
+            return -1;
+    }
+}
+
+static char __restore_doc__[] =
+    "restore(fd, root)\n"
+    "Restore extended attributes from a snapshot written by :func:`dump`.\n"
+    "\n"
+    "The items must already exist under the given root; their\n"
+    "attributes are set (created or replaced), while other attributes\n"
+    "are left untouched. Each record is fully read, and its checksum\n"
+    "verified, before it is applied. Symbolic links under the root are\n"
+    "never followed, neither for the items themselves nor for their\n"
+    "parent directories, so that a snapshot can't address items\n"
+    "outside of the root.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> with open('/backup/attrs.bin', 'rb') as f:\n"
+    "    ...     xattr.restore(f, '/srv/data')\n"
+    "    1234\n"
+    "\n"
+    ":param fd: the file descriptor, or file-like object, to read from;\n"
+    "    note that data is read directly from the underlying descriptor,\n"
+    "    bypassing any Python-level buffering\n"
+    ":param root: the root of the tree to restore to\n"
+    ":type root: str, bytes or path-like object\n"
+    ":returns: the number of attributes restored\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    ":raises ValueError: if the snapshot is invalid or corrupted\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_restore(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *root_obj = NULL, *fd_obj, *res = NULL;
+    int ret;
+    restore_ctx_t ctx;
+    tree_error_t err = {0, NULL, NULL};
+    static char *kwlist[] = {"fd", "root", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OO&", kwlist, &fd_obj,
+                                     PyUnicode_FSConverter, &root_obj))
+        return NULL;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.root_fd = -1;
+    if((ctx.r.fd = PyObject_AsFileDescriptor(fd_obj)) == -1)
+        goto free_root;
+    ctx.root = PyBytes_AS_STRING(root_obj);
+    ctx.r.buf = PyMem_RawMalloc(SNAPSHOT_BUFSIZE);
+    ctx.dict = PyMem_RawCalloc(1, sizeof(name_dict_t));
+    if(ctx.r.buf == NULL || ctx.dict == NULL) {
+        PyErr_NoMemory();
+        goto free_ctx;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = restore_stream(&ctx, &err);
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        tree_raise(&err);
+        goto free_ctx;
+    }
+    res = PyLong_FromLong(ctx.count);
+
+ free_ctx:
+    if(ctx.root_fd != -1)
+        close(ctx.root_fd);
+    PyMem_RawFree(ctx.r.buf);
+    PyMem_RawFree(ctx.path);
+    PyMem_RawFree(ctx.str);
+    PyMem_RawFree(ctx.stage);
+    PyMem_RawFree(ctx.attrs);
+    name_dict_free(ctx.dict);
+ free_root:
+    Py_DECREF(root_obj);
+
+    /* Return the result */
+    return res;
+}
+
+/* Parallel tree walking.
+ *
+ * Directories waiting to be read are kept in a shared stack, from
+ * which a pool of workers (the calling thread included) takes them;
+ * a worker reports each entry of its directory to the visitor, and
+ * pushes the subdirectories back on the stack. Unlike tree_walk, the
+ * order of visits is undefined, and the post visit of a directory
+ * happens (in the same worker) once its entries have been visited,
+ * not its whole subtree. Each worker gets its own visitor context, so
+ * that visitors don't need any locking.
+ */
+
+#define TREE_MAX_THREADS 256
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **dirs;
+    size_t ndirs, dirs_alloc;
+    size_t busy;        /* workers currently reading a directory */
+    int failed;
+    tree_error_t err;   /* the first failure */
+    size_t root_len;
+    tree_cb cb;
+    char *ctxs;
+    size_t ctx_size;
+} tree_pool_t;
+
+typedef struct {
+    tree_pool_t *pool;
+    void *ctx;
+} tree_worker_t;
+
+/* Returns the default number of threads for parallel walks */
+static int tree_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1)
+        return 1;
+    return n > TREE_MAX_THREADS ? TREE_MAX_THREADS : (int) n;
+}
+
+/* Reads one directory; the (owned) path buffer is freed here */
+static int tree_pool_dir(tree_pool_t *pool, char *dir, void *ctx,
+                         tree_error_t *err) {
+    tree_path_t p;
+    struct stat st;
+    DIR *d;
+    struct dirent *de;
+    char **subdirs = NULL;
+    size_t nsubdirs = 0, subdirs_alloc = 0, saved_len, i;
+    int ret = 0;
+
+    p.buf = dir;
+    p.len = saved_len = strlen(dir);
+    p.alloc = p.len + 1;
+    p.root_len = pool->root_len;
+    if((d = opendir(p.buf)) == NULL) {
+        ret = errno == ENOENT ? 0 : tree_fail(err, errno, p.buf);
+        PyMem_RawFree(p.buf);
+        return ret;
+    }
+    for(;;) {
+        errno = 0;
+        if((de = readdir(d)) == NULL) {
+            if(errno != 0)
+                ret = tree_fail(err, errno, p.buf);
+            break;
+        }
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if((ret = tree_path_push(&p, de->d_name, err)) < 0)
+            break;
+        if(lstat(p.buf, &st) == -1) {
+            if(errno != ENOENT)
+                ret = tree_fail(err, errno, p.buf);
+        } else if((ret = pool->cb(ctx, &p, &st, 0, err)) == 0 &&
+                  S_ISDIR(st.st_mode)) {
+            char *copy = PyMem_RawMalloc(p.len + 1);
+            if(copy == NULL ||
+               tree_reserve((void **) &subdirs, nsubdirs, &subdirs_alloc,
+                            sizeof(char *), err) < 0) {
+                PyMem_RawFree(copy);
+                ret = tree_fail(err, ENOMEM, NULL);
+            } else {
+                memcpy(copy, p.buf, p.len + 1);
+                subdirs[nsubdirs++] = copy;
+            }
+        }
+        p.len = saved_len;
+        p.buf[saved_len] = '\0';
+        if(ret < 0)
+            break;
+    }
+    if(ret == 0) {
+        if(fstat(dirfd(d), &st) == -1)
+            ret = tree_fail(err, errno, p.buf);
+        else
+            ret = pool->cb(ctx, &p, &st, 1, err);
+    }
+    closedir(d);
+    PyMem_RawFree(p.buf);
+
+    /* Publish the subdirectories in one go */
+    i = 0;
+    if(ret == 0 && nsubdirs > 0) {
+        pthread_mutex_lock(&pool->lock);
+        for(; i < nsubdirs; i++) {
+            if(tree_reserve((void **) &pool->dirs, pool->ndirs,
+                            &pool->dirs_alloc, sizeof(char *), err) < 0) {
+                ret = -1;
+                break;
+            }
+            pool->dirs[pool->ndirs++] = subdirs[i];
+        }
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    for(; i < nsubdirs; i++)
+        PyMem_RawFree(subdirs[i]);
+    PyMem_RawFree(subdirs);
+    return ret;
+}
+
+static void *tree_pool_worker(void *arg) {
+    tree_worker_t *w = arg;
+    tree_pool_t *pool = w->pool;
+    tree_error_t err = {0, NULL, NULL};
+    char *dir;
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(pool->ndirs == 0 && pool->busy > 0 && !pool->failed)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if(pool->failed || pool->ndirs == 0)
+            break;
+        dir = pool->dirs[--pool->ndirs];
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        ret = tree_pool_dir(pool, dir, w->ctx, &err);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->busy--;
+        if(ret < 0) {
+            if(!pool->failed) {
+                pool->failed = 1;
+                pool->err = err;
+            } else {
+                PyMem_RawFree(err.path);
+            }
+            memset(&err, 0, sizeof(err));
+        }
+        if(pool->failed || (pool->ndirs == 0 && pool->busy == 0))
+            pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Walks the tree using the given number of threads; ctxs is an array
+   of nthreads visitor contexts, of ctx_size bytes each. Doesn't need
+   the GIL. */
+static int tree_pwalk(const char *root, int nthreads, tree_cb cb,
+                      void *ctxs, size_t ctx_size, tree_error_t *err) {
+    tree_pool_t pool;
+    tree_worker_t *workers = NULL;
+    pthread_t *threads = NULL;
+    tree_path_t p;
+    struct stat st;
+    int i, started = 0, ret;
+
+    if(tree_path_init(&p, root, err) < 0)
+        return -1;
+    if(lstat(p.buf, &st) == -1) {
+        ret = tree_fail(err, errno, p.buf);
+        PyMem_RawFree(p.buf);
+        return ret;
+    }
+    if((ret = cb(ctxs, &p, &st, 0, err)) < 0 || !S_ISDIR(st.st_mode)) {
+        PyMem_RawFree(p.buf);
+        return ret;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.root_len = p.root_len;
+    pool.cb = cb;
+    pool.ctxs = ctxs;
+    pool.ctx_size = ctx_size;
+    workers = PyMem_RawCalloc((size_t) nthreads, sizeof(tree_worker_t));
+    threads = PyMem_RawCalloc((size_t) nthreads, sizeof(pthread_t));
+    pool.dirs = PyMem_RawMalloc(sizeof(char *));
+    if(workers == NULL || threads == NULL || pool.dirs == NULL) {
+        PyMem_RawFree(workers);
+        PyMem_RawFree(threads);
+        PyMem_RawFree(pool.dirs);
+        PyMem_RawFree(p.buf);
+        return tree_fail(err, ENOMEM, NULL);
+    }
+    pool.dirs[pool.ndirs++] = p.buf;
+    pool.dirs_alloc = 1;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    for(i = 0; i < nthreads; i++) {
+        workers[i].pool = &pool;
+        workers[i].ctx = pool.ctxs + (size_t) i * ctx_size;
+    }
+    /* If some threads can't be started, the others do their work */
+    for(i = 1; i < nthreads; i++, started++)
+        if(pthread_create(&threads[i], NULL, tree_pool_worker,
+                          &workers[i]) != 0)
+            break;
+    tree_pool_worker(&workers[0]);
+    for(i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    while(pool.ndirs > 0)
+        PyMem_RawFree(pool.dirs[--pool.ndirs]);
+    PyMem_RawFree(pool.dirs);
+    PyMem_RawFree(workers);
+    PyMem_RawFree(threads);
+    if(pool.failed) {
+        *err = pool.err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Parses a threads argument (None or a positive int) */
+static int tree_threads_arg(PyObject *obj, int *nthreads) {
+    long n;
+    if(obj == NULL || obj == Py_None) {
+        *nthreads = tree_default_threads();
+        return 0;
+    }
+    n = PyLong_AsLong(obj);
+    if(n == -1 && PyErr_Occurred())
+        return -1;
+    if(n < 1 || n > TREE_MAX_THREADS) {
+        PyErr_Format(PyExc_ValueError, "threads must be between 1 and %d",
+                     TREE_MAX_THREADS);
+        return -1;
+    }
+    *nthreads = (int) n;
+    return 0;
+}
+
+/* Searching a tree by attributes */
+
+typedef enum {FIND_HAS, FIND_MISSING, FIND_EQUALS, FIND_PREFIX} find_e;
+
+typedef struct {
+    find_e type;
+    PyObject *name_obj;
+    PyObject *value_obj;
+    const char *name;
+    const char *value;
+    size_t size;
+} find_pred_t;
+
+typedef struct {
+    const find_pred_t *preds;
+    size_t npreds;
+    char *buf;        /* for equality checks; never resized */
+    size_t size;
+    char *scratch;    /* for prefix checks; grown as needed */
+    size_t scratch_size;
+    char **matches;
+    size_t nmatches, matches_alloc;
+} find_ctx_t;
+
+/* Evaluates one predicate; returns 1 on match, 0 if not, -1 on
+   errors */
+static int find_eval(find_ctx_t *ctx, const find_pred_t *pred,
+                     target_t *tgt) {
+    ssize_t res;
+
+    switch(pred->type) {
+    case FIND_HAS:
+    case FIND_MISSING:
+        res = _get_raw(tgt, pred->name, NULL, 0);
+        break;
+    case FIND_EQUALS:
+        /* A buffer one byte larger than the value tells apart longer
+           values without reading them */
+        res = _get_raw(tgt, pred->name, ctx->buf, pred->size + 1);
+        if(res == -1 && errno == ERANGE)
+            return 0;
+        if(res != -1)
+            return (size_t) res == pred->size &&
+                !memcmp(ctx->buf, pred->value, pred->size);
+        break;
+    default:
+        res = _generic_get_raw(tgt, pred->name, &ctx->scratch,
+                               &ctx->scratch_size);
+        if(res != -1)
+            return (size_t) res >= pred->size &&
+                !memcmp(ctx->scratch, pred->value, pred->size);
+        break;
+    }
+    if(res == -1) {
+        if(errno != XATTR_ENOATTR && errno != ENOTSUP && errno != EOPNOTSUPP)
+            return -1;
+        return pred->type == FIND_MISSING;
+    }
+    return pred->type == FIND_HAS;
+}
+
+static int find_item(void *data, tree_path_t *p, const struct stat *st,
+                     int post, tree_error_t *err) {
+    find_ctx_t *ctx = data;
+    target_t tgt;
+    size_t i;
+    char *copy;
+    int res;
+
+    if(post)
+        return 0;
+    tgt.type = T_LINK;
+    tgt.name = p->buf;
+    tgt.tmp = NULL;
+    for(i = 0; i < ctx->npreds; i++) {
+        if((res = find_eval(ctx, &ctx->preds[i], &tgt)) < 0) {
+            /* Items removed during the walk just don't match */
+            if(errno == ENOENT)
+                return 0;
+            return tree_fail(err, errno, p->buf);
+        }
+        if(res == 0)
+            return 0;
+    }
+    if(tree_reserve((void **) &ctx->matches, ctx->nmatches,
+                    &ctx->matches_alloc, sizeof(char *), err) < 0)
+        return -1;
+    if((copy = PyMem_RawMalloc(p->len + 1)) == NULL)
+        return tree_fail(err, ENOMEM, NULL);
+    memcpy(copy, p->buf, p->len + 1);
+    ctx->matches[ctx->nmatches++] = copy;
+    return 0;
+}
+
+/* Converts an optional predicate argument into a sequence: of names
+   (a single name is also accepted), or of (name, value) pairs */
+static PyObject *find_seq(PyObject *obj, int pairs) {
+    if(obj == NULL || obj == Py_None)
+        return PyTuple_New(0);
+    if(pairs)
+        return attr_pairs(obj);
+    if(PyBytes_Check(obj) || PyUnicode_Check(obj))
+        return PyTuple_Pack(1, obj);
+    return PySequence_Fast(obj, "expected an iterable of names");
+}
+
+/* Adds the predicates from a sequence built by find_seq */
+static int find_add(find_pred_t *preds, size_t *npreds, find_e type,
+                    PyObject *seq) {
+    int pairs = type == FIND_EQUALS || type == FIND_PREFIX;
+    Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq);
+
+    for(i = 0; i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        find_pred_t *pred = &preds[(*npreds)++];
+        pred->type = type;
+        if(pairs) {
+            if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+                PyErr_SetString(PyExc_TypeError,
+                                "expected (name, value) pairs");
+                return -1;
+            }
+            if((pred->value_obj = convert_bytes(PyTuple_GET_ITEM(item, 1)))
+               == NULL)
+                return -1;
+            pred->value = PyBytes_AS_STRING(pred->value_obj);
+            pred->size = (size_t) PyBytes_GET_SIZE(pred->value_obj);
+            item = PyTuple_GET_ITEM(item, 0);
+        }
+        if((pred->name_obj = convert_bytes(item)) == NULL)
+            return -1;
+        pred->name = PyBytes_AS_STRING(pred->name_obj);
+        if(strlen(pred->name) != (size_t) PyBytes_GET_SIZE(pred->name_obj)) {
+            PyErr_SetString(PyExc_ValueError, "embedded null byte");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static char __find_doc__[] =
+    "find(root[, has=None, missing=None, equals=None, prefix=None,\n"
+    "     threads=None])\n"
+    "Find the items of a tree matching attribute predicates.\n"
+    "\n"
+    "The tree is walked natively and in parallel (without following\n"
+    "symbolic links), and the predicates are evaluated without creating\n"
+    "any Python objects for the items that don't match. All predicates\n"
+    "must hold for an item to match; without any predicates, all items\n"
+    "match. Attribute names must be given in full (with the namespace).\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.find('/srv/data', has=['user.expires'],\n"
+    "    ...            missing=['user.owner'])\n"
+    "    [b'/srv/data/tmp/file1', b'/srv/data/tmp/file2']\n"
+    "\n"
+    ":param root: the root of the tree to search\n"
+    ":type root: str, bytes or path-like object\n"
+    ":keyword has: names of attributes which must be present\n"
+    ":type has: iterable of str or bytes\n"
+    ":keyword missing: names of attributes which must not be present\n"
+    ":type missing: iterable of str or bytes\n"
+    ":keyword equals: attributes which must be present and have exactly\n"
+    "    the given values\n"
+    ":type equals: mapping or iterable of (name, value) pairs\n"
+    ":keyword prefix: attributes which must be present and have values\n"
+    "    starting with the given bytes\n"
+    ":type prefix: mapping or iterable of (name, value) pairs\n"
+    ":keyword threads: the number of threads to use for the walk; by\n"
+    "    default, the number of online CPUs\n"
+    ":type threads: int\n"
+    ":returns: the paths of the matching items (the root included),\n"
+    "    sorted\n"
+    ":rtype: list of bytes\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_find(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *root_obj = NULL, *args_in[4] = {NULL, NULL, NULL, NULL},
+        *seqs[4] = {NULL, NULL, NULL, NULL}, *threads_obj = NULL,
+        *res = NULL, *item;
+    find_pred_t *preds = NULL;
+    find_ctx_t *ctxs = NULL;
+    Py_ssize_t nmax = 0, n;
+    size_t npreds = 0, maxsize = 0, i, j, k;
+    int nthreads = 1, ret;
+    tree_error_t err = {0, NULL, NULL};
+    static char *kwlist[] = {"root", "has", "missing", "equals", "prefix",
+                             "threads", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O&|OOOOO", kwlist,
+                                     PyUnicode_FSConverter, &root_obj,
+                                     &args_in[FIND_HAS],
+                                     &args_in[FIND_MISSING],
+                                     &args_in[FIND_EQUALS],
+                                     &args_in[FIND_PREFIX], &threads_obj))
+        return NULL;
+
+    if(tree_threads_arg(threads_obj, &nthreads) < 0)
+        goto free_seqs;
+    for(i = 0; i < 4; i++) {
+        if((seqs[i] = find_seq(args_in[i], i >= FIND_EQUALS)) == NULL)
+            goto free_seqs;
+        nmax += PySequence_Fast_GET_SIZE(seqs[i]);
+    }
+    if((preds = PyMem_Calloc((size_t) nmax + 1, sizeof(find_pred_t))) ==
+       NULL) {
+        PyErr_NoMemory();
+        goto free_seqs;
+    }
+    /* In enum order: cheap existence probes first, then value checks */
+    for(i = 0; i < 4; i++)
+        if(find_add(preds, &npreds, (find_e) i, seqs[i]) < 0)
+            goto free_preds;
+    for(i = 0; i < npreds; i++)
+        if(preds[i].size > maxsize)
+            maxsize = preds[i].size;
+
+    if((ctxs = PyMem_Calloc((size_t) nthreads, sizeof(find_ctx_t))) ==
+       NULL) {
+        PyErr_NoMemory();
+        goto free_preds;
+    }
+    for(i = 0; i < (size_t) nthreads; i++) {
+        ctxs[i].preds = preds;
+        ctxs[i].npreds = npreds;
+        ctxs[i].size = maxsize + 1 > ESTIMATE_ATTR_SIZE ?
+            maxsize + 1 : ESTIMATE_ATTR_SIZE;
+        if((ctxs[i].buf = PyMem_RawMalloc(ctxs[i].size)) == NULL) {
+            PyErr_NoMemory();
+            goto free_ctxs;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = tree_pwalk(PyBytes_AS_STRING(root_obj), nthreads, find_item,
+                     ctxs, sizeof(find_ctx_t), &err);
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        tree_raise(&err);
+        goto free_ctxs;
+    }
+    for(i = 0, n = 0; i < (size_t) nthreads; i++)
+        n += (Py_ssize_t) ctxs[i].nmatches;
+    if((res = PyList_New(n)) == NULL)
+        goto free_ctxs;
+    for(i = 0, k = 0; i < (size_t) nthreads; i++)
+        for(j = 0; j < ctxs[i].nmatches; j++) {
+            if((item = PyBytes_FromString(ctxs[i].matches[j])) == NULL) {
+                Py_CLEAR(res);
+                goto free_ctxs;
+            }
+            PyList_SET_ITEM(res, k++, item);
+        }
+    if(PyList_Sort(res) < 0)
+        Py_CLEAR(res);
+
+ free_ctxs:
+    for(i = 0; i < (size_t) nthreads; i++) {
+        for(j = 0; j < ctxs[i].nmatches; j++)
+            PyMem_RawFree(ctxs[i].matches[j]);
+        PyMem_RawFree(ctxs[i].matches);
+        PyMem_RawFree(ctxs[i].buf);
+        PyMem_RawFree(ctxs[i].scratch);
+    }
+    PyMem_Free(ctxs);
+ free_preds:
+    for(i = 0; i < npreds; i++) {
+        Py_XDECREF(preds[i].name_obj);
+        Py_XDECREF(preds[i].value_obj);
+    }
+    PyMem_Free(preds);
+ free_seqs:
+    for(i = 0; i < 4; i++)
+        Py_XDECREF(seqs[i]);
+    Py_DECREF(root_obj);
+
+    /* Return the result */
+    return res;
+}
+
+/* Scratch buffers for reading all the attributes of items, reused
+   from one item to the next */
+typedef struct {
+    char *list, *val;
+    size_t size_list, size_val;
+    const char **names;     /* the sorted names, pointing into list */
+    size_t names_alloc;
+} attr_scratch_t;
+
+/* Lists the attributes of an item in the given namespace, and sorts
+   their names; returns their count, or -1 with errno set. A missing
+   item (if allowed), or a filesystem without attributes support, has
+   none. Doesn't need the GIL. */
+static ssize_t attr_scratch_list(attr_scratch_t *sc, const char *ns,
+                                 target_t *tgt, int missing_ok) {
+    ssize_t nlist;
+    size_t count = 0;
+    const char *s;
+
+    nlist = _generic_get_raw(tgt, NULL, &sc->list, &sc->size_list);
+    if(nlist == -1) {
+        if(errno == ENOTSUP || errno == EOPNOTSUPP ||
+           ((errno == ENOENT || errno == ENOTDIR) && missing_ok))
+            return 0;
+        return -1;
+    }
+    for(s = sc->list; s - sc->list < nlist; s += strlen(s) + 1) {
+        if(matches_ns(ns, s) == NULL)
+            continue;
+        if(count == sc->names_alloc) {
+            size_t nalloc = sc->names_alloc * 2 + 16;
+            const char **tmp = PyMem_RawRealloc((void *) sc->names,
+                                                nalloc * sizeof(char *));
+            if(tmp == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            sc->names = tmp;
+            sc->names_alloc = nalloc;
+        }
+        sc->names[count++] = s;
+    }
+    qsort((void *) sc->names, count, sizeof(char *), attr_cmp_names);
+    return (ssize_t) count;
+}
+
+static void attr_scratch_free(attr_scratch_t *sc) {
+    PyMem_RawFree(sc->list);
+    PyMem_RawFree(sc->val);
+    PyMem_RawFree((void *) sc->names);
+}
+
+/* Fingerprints: a 64-bit hash of the sorted names and values of the
+   attributes of an item. Each name is hashed with its terminating
+   NUL, and each value is preceded by its length, so that different
+   sets of attributes can't produce the same stream of bytes. */
+
+static int fingerprint_raw(attr_scratch_t *sc, const char *ns,
+                           target_t *tgt, int missing_ok, uint64_t *hash) {
+    ssize_t n, i, nval;
+    uint64_t h = XATTR_HASH_INIT;
+
+    if((n = attr_scratch_list(sc, ns, tgt, missing_ok)) < 0)
+        return -1;
+    for(i = 0; i < n; i++) {
+        const char *name = sc->names[i];
+        nval = _generic_get_raw(tgt, name, &sc->val, &sc->size_val);
+        if(nval == -1) {
+            if(errno == XATTR_ENOATTR)
+                continue;
+            return -1;
+        }
+        h = xattr_hash(name, strlen(name) + 1, h);
+        h = xattr_hash_u64((uint64_t) nval, h);
+        h = xattr_hash(sc->val, (size_t) nval, h);
+    }
+    *hash = h;
+    return 0;
+}
+
+static char __fingerprint_doc__[] =
+    "fingerprint(item[, nofollow=False, namespace=None])\n"
+    "Compute a fingerprint of the extended attributes of an item.\n"
+    "\n"
+    "The fingerprint is a 64-bit non-cryptographic hash over the sorted\n"
+    "names and the values of the attributes, computed natively without\n"
+    "creating any Python objects for them; two items with the same\n"
+    "attributes have the same fingerprint, independently of the order\n"
+    "in which the attributes are listed. This is meant for change\n"
+    "detection, not for security.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.fingerprint('/path/to/file', namespace=xattr.NS_USER)\n"
+    "    11730395917237380432\n"
+    "\n"
+    ITEM_DOC
+    NOFOLLOW_DOC
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes; names are hashed in full\n"
+    ":type namespace: bytes\n"
+    ":return: the fingerprint, an unsigned 64-bit integer\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_fingerprint(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *myarg;
+    int nofollow = 0, ret, io_errno = 0;
+    const char *ns = NULL;
+    target_t tgt;
+    attr_scratch_t sc;
+    uint64_t hash = 0;
+    static char *kwlist[] = {"item", "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iy", kwlist,
+                                     &myarg, &nofollow, &ns))
+        return NULL;
+    if(convert_obj(myarg, &tgt, nofollow) < 0)
+        return NULL;
+
+    memset(&sc, 0, sizeof(sc));
+    Py_BEGIN_ALLOW_THREADS;
+    if((ret = fingerprint_raw(&sc, ns, &tgt, 0, &hash)) < 0)
+        io_errno = errno;
+    attr_scratch_free(&sc);
+    Py_END_ALLOW_THREADS;
+    free_tgt(&tgt);
+
+    if(ret < 0) {
+        if(io_errno == ENOMEM)
+            return PyErr_NoMemory();
+        errno = io_errno;
+        return PyErr_SetFromErrno(PyExc_IOError);
+    }
+    return PyLong_FromUnsignedLongLong(hash);
+}
+
+static char __fingerprint_many_doc__[] =
+    "fingerprint_many(items[, nofollow=False, namespace=None])\n"
+    "Compute the fingerprints of multiple items.\n"
+    "\n"
+    "This is equivalent to calling :func:`fingerprint` for each item,\n"
+    "but the buffers are reused and the GIL is released only once.\n"
+    "\n"
+    ":param items: the items, each given as for :func:`fingerprint`\n"
+    ":type items: iterable\n"
+    NOFOLLOW_DOC
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes; names are hashed in full\n"
+    ":type namespace: bytes\n"
+    ":return: the fingerprints, in the order of the items\n"
+    ":rtype: list[int]\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_fingerprint_many(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *items, *seq, *res = NULL, *item;
+    int nofollow = 0, ret = 0, io_errno = 0;
+    const char *ns = NULL;
+    target_t *tgts = NULL;
+    uint64_t *hashes = NULL;
+    attr_scratch_t sc;
+    Py_ssize_t n, i, converted = 0;
+    static char *kwlist[] = {"items", "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iy", kwlist,
+                                     &items, &nofollow, &ns))
+        return NULL;
+    if((seq = PySequence_Fast(items, "items must be iterable")) == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    tgts = PyMem_New(target_t, n + 1);
+    hashes = PyMem_New(uint64_t, n + 1);
+    if(tgts == NULL || hashes == NULL) {
+        PyErr_NoMemory();
+        goto free_tgts;
+    }
+    for(; converted < n; converted++)
+        if(convert_obj(PySequence_Fast_GET_ITEM(seq, converted),
+                       &tgts[converted], nofollow) < 0)
+            goto free_tgts;
+
+    memset(&sc, 0, sizeof(sc));
+    Py_BEGIN_ALLOW_THREADS;
+    for(i = 0; i < n && ret == 0; i++)
+        if((ret = fingerprint_raw(&sc, ns, &tgts[i], 0, &hashes[i])) < 0)
+            io_errno = errno;
+    attr_scratch_free(&sc);
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        if(io_errno == ENOMEM) {
+            PyErr_NoMemory();
+        } else {
+            errno = io_errno;
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+        goto free_tgts;
+    }
+    if((res = PyList_New(n)) == NULL)
+        goto free_tgts;
+    for(i = 0; i < n; i++) {
+        if((item = PyLong_FromUnsignedLongLong(hashes[i])) == NULL) {
+            Py_CLEAR(res);
+            break;
+        }
+        PyList_SET_ITEM(res, i, item);
+    }
+
+ free_tgts:
+    for(i = 0; i < converted; i++)
+        free_tgt(&tgts[i]);
+    PyMem_Free(tgts);
+    PyMem_Free(hashes);
+    Py_DECREF(seq);
+
+    /* Return the result */
+    return res;
+}
+
+/* Comparing the attributes of two items, or of two trees */
+
+#define DIFF_ADDED 0
+#define DIFF_REMOVED 1
+#define DIFF_CHANGED 2
+
+typedef struct {
+    char *names;        /* NUL-terminated names, back to back */
+    size_t len, alloc;
+    size_t count;
+} diff_names_t;
+
+typedef struct {
+    char *path;         /* relative path, for trees */
+    diff_names_t out[3];
+} diff_rec_t;
+
+typedef struct {
+    const char *ns;
+    attr_scratch_t a, b;
+    diff_names_t out[3];
+    /* For trees: the root of the other side, and the differing items */
+    const char *b_root;
+    tree_path_t b_path;
+    diff_rec_t *recs;
+    size_t nrecs, recs_alloc;
+} diff_ctx_t;
+
+static int diff_add_name(diff_names_t *d, const char *name) {
+    size_t len = strlen(name) + 1;
+    if(d->len + len > d->alloc) {
+        size_t nalloc = (d->len + len) * 2 + 64;
+        char *tmp = PyMem_RawRealloc(d->names, nalloc);
+        if(tmp == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        d->names = tmp;
+        d->alloc = nalloc;
+    }
+    memcpy(d->names + d->len, name, len);
+    d->len += len;
+    d->count++;
+    return 0;
+}
+
+/* Compares two items, filling in ctx->out; returns 1 if they differ,
+   0 if not, and -1 on failure, with errno set. Doesn't need the GIL. */
+static int diff_items(diff_ctx_t *ctx, target_t *a, target_t *b,
+                      int b_missing_ok) {
+    ssize_t na, nb, va, vb;
+    size_t i = 0, j = 0, k;
+    int cmp, which;
+    const char *name;
+
+    for(k = 0; k < 3; k++)
+        ctx->out[k].len = ctx->out[k].count = 0;
+    if((na = attr_scratch_list(&ctx->a, ctx->ns, a, 0)) < 0 ||
+       (nb = attr_scratch_list(&ctx->b, ctx->ns, b, b_missing_ok)) < 0)
+        return -1;
+    /* Merge the two sorted lists */
+    while(i < (size_t) na || j < (size_t) nb) {
+        if(i == (size_t) na)
+            cmp = 1;
+        else if(j == (size_t) nb)
+            cmp = -1;
+        else
+            cmp = strcmp(ctx->a.names[i], ctx->b.names[j]);
+        if(cmp < 0) {
+            name = ctx->a.names[i++];
+            which = DIFF_REMOVED;
+        } else if(cmp > 0) {
+            name = ctx->b.names[j++];
+            which = DIFF_ADDED;
+        } else {
+            name = ctx->a.names[i++];
+            j++;
+            va = _generic_get_raw(a, name, &ctx->a.val, &ctx->a.size_val);
+            if(va == -1 && errno != XATTR_ENOATTR)
+                return -1;
+            vb = _generic_get_raw(b, name, &ctx->b.val, &ctx->b.size_val);
+            if(vb == -1 && errno != XATTR_ENOATTR)
+                return -1;
+            /* Attributes removed since the listing count as such */
+            if(va == -1 && vb == -1)
+                continue;
+            else if(va == -1)
+                which = DIFF_ADDED;
+            else if(vb == -1)
+                which = DIFF_REMOVED;
+            else if(va != vb || memcmp(ctx->a.val, ctx->b.val, (size_t) va))
+                which = DIFF_CHANGED;
+            else
+                continue;
+        }
+        if(diff_add_name(&ctx->out[which], matches_ns(ctx->ns, name)) < 0)
+            return -1;
+    }
+    return ctx->out[0].count + ctx->out[1].count + ctx->out[2].count > 0;
+}
+
+static void diff_ctx_free(diff_ctx_t *ctx) {
+    size_t i, k;
+    attr_scratch_free(&ctx->a);
+    attr_scratch_free(&ctx->b);
+    PyMem_RawFree(ctx->b_path.buf);
+    for(k = 0; k < 3; k++)
+        PyMem_RawFree(ctx->out[k].names);
+    for(i = 0; i < ctx->nrecs; i++) {
+        PyMem_RawFree(ctx->recs[i].path);
+        for(k = 0; k < 3; k++)
+            PyMem_RawFree(ctx->recs[i].out[k].names);
+    }
+    PyMem_RawFree(ctx->recs);
+}
+
+/* Builds the (added, removed, changed) tuple of lists of names */
+static PyObject *diff_result(const diff_names_t *out) {
+    PyObject *res, *list, *name;
+    const char *s;
+    size_t k, i;
+
+    if((res = PyTuple_New(3)) == NULL)
+        return NULL;
+    for(k = 0; k < 3; k++) {
+        if((list = PyList_New((Py_ssize_t) out[k].count)) == NULL) {
+            Py_DECREF(res);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(res, k, list);
+        for(i = 0, s = out[k].names; i < out[k].count;
+            i++, s += strlen(s) + 1) {
+            if((name = PyBytes_FromString(s)) == NULL) {
+                Py_DECREF(res);
+                return NULL;
+            }
+            PyList_SET_ITEM(list, i, name);
+        }
+    }
+    return res;
+}
+
+static char __diff_doc__[] =
+    "diff(a, b[, nofollow=False, namespace=None])\n"
+    "Compare the extended attributes of two items.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.diff('/src/file', '/replica/file',\n"
+    "    ...            namespace=xattr.NS_USER)\n"
+    "    ([b'new'], [], [b'comment'])\n"
+    "\n"
+    ":param a: the reference item\n"
+    ":param b: the item to compare with it\n"
+    "    (both items can be given as for :func:`get`)\n"
+    NOFOLLOW_DOC
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes; if given, it (and the separator) will be stripped\n"
+    "   from the names returned\n"
+    ":type namespace: bytes\n"
+    ":return: the sorted names of the attributes only present on *b*\n"
+    "   (added), only present on *a* (removed), and present on both but\n"
+    "   with different values (changed)\n"
+    ":rtype: tuple(list[bytes], list[bytes], list[bytes])\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_diff(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *a_obj, *b_obj, *res = NULL;
+    int nofollow = 0, ret, io_errno = 0;
+    const char *ns = NULL;
+    target_t a, b;
+    diff_ctx_t ctx;
+    static char *kwlist[] = {"a", "b", "nofollow", "namespace", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "OO|iy", kwlist,
+                                     &a_obj, &b_obj, &nofollow, &ns))
+        return NULL;
+    if(convert_obj(a_obj, &a, nofollow) < 0)
+        return NULL;
+    if(convert_obj(b_obj, &b, nofollow) < 0)
+        goto free_a;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ns = ns;
+    Py_BEGIN_ALLOW_THREADS;
+    if((ret = diff_items(&ctx, &a, &b, 0)) < 0)
+        io_errno = errno;
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        if(io_errno == ENOMEM) {
+            PyErr_NoMemory();
+        } else {
+            errno = io_errno;
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+    } else {
+        res = diff_result(ctx.out);
+    }
+    diff_ctx_free(&ctx);
+
+    free_tgt(&b);
+ free_a:
+    free_tgt(&a);
+
+    /* Return the result */
+    return res;
+}
+
+static int diff_tree_item(void *data, tree_path_t *p, const struct stat *st,
+                          int post, tree_error_t *err) {
+    diff_ctx_t *ctx = data;
+    target_t a, b;
+    const char *rel = tree_relpath(p);
+    diff_rec_t *rec;
+    size_t len, k;
+    int ret;
+
+    if(post)
+        return 0;
+    /* Rebuild the path on the other side */
+    if(ctx->b_path.buf == NULL) {
+        if(tree_path_init(&ctx->b_path, ctx->b_root, err) < 0)
+            return -1;
+    } else {
+        ctx->b_path.len = ctx->b_path.root_len;
+        ctx->b_path.buf[ctx->b_path.len] = '\0';
+    }
+    if(*rel != '\0' && tree_path_push(&ctx->b_path, rel, err) < 0)
+        return -1;
+    a.type = b.type = T_LINK;
+    a.tmp = b.tmp = NULL;
+    a.name = p->buf;
+    b.name = ctx->b_path.buf;
+    if((ret = diff_items(ctx, &a, &b, 1)) < 0) {
+        /* Items removed during the walk are skipped */
+        if(errno == ENOENT)
+            return 0;
+        return tree_fail(err, errno, p->buf);
+    }
+    if(ret == 0)
+        return 0;
+    if(tree_reserve((void **) &ctx->recs, ctx->nrecs, &ctx->recs_alloc,
+                    sizeof(diff_rec_t), err) < 0)
+        return -1;
+    rec = &ctx->recs[ctx->nrecs];
+    len = strlen(rel) + 1;
+    if((rec->path = PyMem_RawMalloc(len)) == NULL)
+        return tree_fail(err, ENOMEM, NULL);
+    memcpy(rec->path, rel, len);
+    /* Hand over the name buffers to the record */
+    for(k = 0; k < 3; k++) {
+        rec->out[k] = ctx->out[k];
+        memset(&ctx->out[k], 0, sizeof(diff_names_t));
+    }
+    ctx->nrecs++;
+    return 0;
+}
+
+static char __diff_tree_doc__[] =
+    "diff_tree(a_root, b_root[, namespace=None, threads=None])\n"
+    "Compare the extended attributes of two trees.\n"
+    "\n"
+    "The first tree is walked natively and in parallel (without\n"
+    "following symbolic links), and each item is compared with the item\n"
+    "at the same relative path in the second tree, as by :func:`diff`.\n"
+    "Items missing from the second tree (including those below a\n"
+    "directory replaced there by another kind of item) are compared as\n"
+    "having no attributes; items only present in the second tree are\n"
+    "not visited.\n"
+    "Only the differing items are reported, so that no Python objects\n"
+    "are created for the (usually many) identical ones.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.diff_tree('/src', '/replica', namespace=xattr.NS_USER)\n"
+    "    [(b'dir/file', [b'new'], [], [b'comment'])]\n"
+    "\n"
+    ":param a_root: the root of the reference tree\n"
+    ":type a_root: str, bytes or path-like object\n"
+    ":param b_root: the root of the tree to compare with it\n"
+    ":type b_root: str, bytes or path-like object\n"
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes; if given, it (and the separator) will be stripped\n"
+    "   from the names returned\n"
+    ":type namespace: bytes\n"
+    ":keyword threads: the number of threads to use for the walk; by\n"
+    "    default, the number of online CPUs\n"
+    ":type threads: int\n"
+    ":return: a list, sorted by path, of (relative path, added, removed,\n"
+    "   changed) tuples\n"
+    ":rtype: list[tuple(bytes, list[bytes], list[bytes], list[bytes])]\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_diff_tree(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *a_obj = NULL, *b_obj = NULL, *threads_obj = NULL, *res = NULL;
+    PyObject *item, *names;
+    const char *ns = NULL;
+    diff_ctx_t *ctxs = NULL;
+    tree_error_t err = {0, NULL, NULL};
+    int nthreads, ret;
+    size_t i, j;
+    static char *kwlist[] = {"a_root", "b_root", "namespace", "threads",
+                             NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O&O&|yO", kwlist,
+                                     PyUnicode_FSConverter, &a_obj,
+                                     PyUnicode_FSConverter, &b_obj, &ns,
+                                     &threads_obj))
+        goto free_args;
+    if(tree_threads_arg(threads_obj, &nthreads) < 0)
+        goto free_args;
+    if((ctxs = PyMem_Calloc((size_t) nthreads, sizeof(diff_ctx_t))) ==
+       NULL) {
+        PyErr_NoMemory();
+        goto free_args;
+    }
+    for(i = 0; i < (size_t) nthreads; i++) {
+        ctxs[i].ns = ns;
+        ctxs[i].b_root = PyBytes_AS_STRING(b_obj);
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = tree_pwalk(PyBytes_AS_STRING(a_obj), nthreads, diff_tree_item,
+                     ctxs, sizeof(diff_ctx_t), &err);
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        tree_raise(&err);
+        goto free_ctxs;
+    }
+    if((res = PyList_New(0)) == NULL)
+        goto free_ctxs;
+    for(i = 0; i < (size_t) nthreads; i++)
+        for(j = 0; j < ctxs[i].nrecs; j++) {
+            if((names = diff_result(ctxs[i].recs[j].out)) == NULL)
+                goto free_res;
+            item = Py_BuildValue("(yOOO)", ctxs[i].recs[j].path,
+                                 PyTuple_GET_ITEM(names, 0),
+                                 PyTuple_GET_ITEM(names, 1),
+                                 PyTuple_GET_ITEM(names, 2));
+            Py_DECREF(names);
+            if(item == NULL)
+                goto free_res;
+            ret = PyList_Append(res, item);
+            Py_DECREF(item);
+            if(ret < 0)
+                goto free_res;
+        }
+    if(PyList_Sort(res) == 0)
+        goto free_ctxs;
+ free_res:
+    Py_CLEAR(res);
+ free_ctxs:
+    for(i = 0; i < (size_t) nthreads; i++)
+        diff_ctx_free(&ctxs[i]);
+    PyMem_Free(ctxs);
+ free_args:
+    Py_XDECREF(a_obj);
+    Py_XDECREF(b_obj);
+
+    /* Return the result */
+    return res;
+}
+
+/* Merkle trees of fingerprints.
+ *
+ * The hash of a directory covers the fingerprint of its own
+ * attributes, a hash of the (name, fingerprint) pairs of its
+ * non-directory entries, and the (name, hash) pairs of its
+ * subdirectories, all in name order; so two directories have the same
+ * hash iff their subtrees have the same attributes (barring
+ * collisions). The first two parts are computed by the worker which
+ * reads the directory; the subdirectories are combined at the end,
+ * once all the directories are known.
+ */
+
+typedef struct {
+    char *path;         /* relative path */
+    uint64_t own, files, hash;
+} merkle_dir_t;
+
+typedef struct {
+    const char *name;
+    size_t off;         /* of the name, in the names arena */
+    uint64_t hash;
+} merkle_file_t;
+
+typedef struct {
+    const char *ns;
+    attr_scratch_t sc;
+    /* The entries of the directory being read */
+    merkle_file_t *files;
+    size_t nfiles, files_alloc;
+    char *names;
+    size_t names_len, names_alloc;
+    merkle_dir_t *dirs;
+    size_t ndirs, dirs_alloc;
+} merkle_ctx_t;
+
+static int merkle_cmp_files(const void *x, const void *y) {
+    return strcmp(((const merkle_file_t *) x)->name,
+                  ((const merkle_file_t *) y)->name);
+}
+
+/* Orders paths component-wise, so that each directory is followed by
+   its subtree, and subdirectories come in name order */
+static int merkle_cmp_dirs(const void *x, const void *y) {
+    const unsigned char *a = (const unsigned char *)
+        (*(merkle_dir_t * const *) x)->path;
+    const unsigned char *b = (const unsigned char *)
+        (*(merkle_dir_t * const *) y)->path;
+    int ca, cb;
+
+    for(;; a++, b++) {
+        ca = *a == '\0' ? 0 : *a == '/' ? 1 : *a + 2;
+        cb = *b == '\0' ? 0 : *b == '/' ? 1 : *b + 2;
+        if(ca != cb || ca == 0)
+            return ca - cb;
+    }
+}
+
+static int merkle_item(void *data, tree_path_t *p, const struct stat *st,
+                       int post, tree_error_t *err) {
+    merkle_ctx_t *ctx = data;
+    target_t tgt;
+    merkle_dir_t *dir;
+    uint64_t hash;
+    const char *name;
+    size_t len, i;
+
+    if(!post && S_ISDIR(st->st_mode))
+        return 0;
+    tgt.type = T_LINK;
+    tgt.name = p->buf;
+    tgt.tmp = NULL;
+    if(fingerprint_raw(&ctx->sc, ctx->ns, &tgt, 0, &hash) < 0) {
+        /* Items removed during the walk are skipped; for directories,
+           so are their already collected entries, which must not be
+           attributed to the next directory */
+        if(errno == ENOENT) {
+            if(post)
+                ctx->nfiles = ctx->names_len = 0;
+            return 0;
+        }
+        return tree_fail(err, errno, p->buf);
+    }
+    if(!post) {
+        if(*tree_relpath(p) == '\0')
+            return tree_fail(err, ENOTDIR, p->buf);
+        name = strrchr(p->buf, '/') + 1;
+        len = strlen(name) + 1;
+        if(tree_reserve((void **) &ctx->files, ctx->nfiles,
+                        &ctx->files_alloc, sizeof(merkle_file_t), err) < 0)
+            return -1;
+        if(ctx->names_len + len > ctx->names_alloc) {
+            size_t nalloc = (ctx->names_len + len) * 2 + 4096;
+            char *tmp = PyMem_RawRealloc(ctx->names, nalloc);
+            if(tmp == NULL)
+                return tree_fail(err, ENOMEM, NULL);
+            ctx->names = tmp;
+            ctx->names_alloc = nalloc;
+        }
+        memcpy(ctx->names + ctx->names_len, name, len);
+        ctx->files[ctx->nfiles].off = ctx->names_len;
+        ctx->files[ctx->nfiles++].hash = hash;
+        ctx->names_len += len;
+        return 0;
+    }
+
+    /* All the entries of the directory have been seen */
+    if(tree_reserve((void **) &ctx->dirs, ctx->ndirs, &ctx->dirs_alloc,
+                    sizeof(merkle_dir_t), err) < 0)
+        return -1;
+    dir = &ctx->dirs[ctx->ndirs];
+    len = strlen(tree_relpath(p)) + 1;
+    if((dir->path = PyMem_RawMalloc(len)) == NULL)
+        return tree_fail(err, ENOMEM, NULL);
+    memcpy(dir->path, tree_relpath(p), len);
+    ctx->ndirs++;
+    dir->own = hash;
+    for(i = 0; i < ctx->nfiles; i++)
+        ctx->files[i].name = ctx->names + ctx->files[i].off;
+    qsort(ctx->files, ctx->nfiles, sizeof(merkle_file_t), merkle_cmp_files);
+    dir->files = XATTR_HASH_INIT;
+    for(i = 0; i < ctx->nfiles; i++) {
+        dir->files = xattr_hash(ctx->files[i].name,
+                                strlen(ctx->files[i].name) + 1, dir->files);
+        dir->files = xattr_hash_u64(ctx->files[i].hash, dir->files);
+    }
+    ctx->nfiles = ctx->names_len = 0;
+    return 0;
+}
+
+/* Computes the hash of dirs[i] from its subdirectories, which follow
+   it in the sorted array; returns the index after its subtree */
+static size_t merkle_combine(merkle_dir_t **dirs, size_t n, size_t i) {
+    merkle_dir_t *self = dirs[i];
+    size_t plen = strlen(self->path), j = i + 1;
+    uint64_t h = xattr_hash_u64(self->own, XATTR_HASH_INIT);
+    const char *name;
+
+    h = xattr_hash_u64(self->files, h);
+    while(j < n && (plen == 0 ||
+                    (!strncmp(dirs[j]->path, self->path, plen) &&
+                     dirs[j]->path[plen] == '/'))) {
+        size_t next = merkle_combine(dirs, n, j);
+        name = dirs[j]->path + (plen == 0 ? 0 : plen + 1);
+        h = xattr_hash(name, strlen(name) + 1, h);
+        h = xattr_hash_u64(dirs[j]->hash, h);
+        j = next;
+    }
+    self->hash = h;
+    return j;
+}
+
+static char __merkle_doc__[] =
+    "merkle(root[, namespace=None, threads=None])\n"
+    "Compute a Merkle tree of the extended attributes of a tree.\n"
+    "\n"
+    "The tree is walked natively and in parallel (without following\n"
+    "symbolic links), and each directory gets a 64-bit hash covering\n"
+    "the attributes of itself and of its whole subtree, built bottom-up\n"
+    "from the :func:`fingerprint` of each item (and from the entry\n"
+    "names). Two replicas can then be compared starting from the root,\n"
+    "descending only into the subdirectories whose hashes differ.\n"
+    "\n"
+    "The result maps plain bytes to integers, so it can be stored\n"
+    "with any serialisation format, and compared later against a new\n"
+    "computation.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.merkle('/srv/data', namespace=xattr.NS_USER)\n"
+    "    {b'': 4263839113612402931, b'tmp': 11730395917237380432}\n"
+    "\n"
+    ":param root: the root of the tree, which must be a directory\n"
+    ":type root: str, bytes or path-like object\n"
+    ":keyword namespace: an optional namespace for filtering the\n"
+    "   attributes\n"
+    ":type namespace: bytes\n"
+    ":keyword threads: the number of threads to use for the walk; by\n"
+    "    default, the number of online CPUs\n"
+    ":type threads: int\n"
+    ":return: the hash of each directory, by relative path (the root\n"
+    "   being ``b''``)\n"
+    ":rtype: dict[bytes, int]\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_merkle(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *root_obj = NULL, *threads_obj = NULL, *res = NULL;
+    PyObject *value;
+    const char *ns = NULL;
+    merkle_ctx_t *ctxs = NULL;
+    merkle_dir_t **dirs = NULL;
+    tree_error_t err = {0, NULL, NULL};
+    size_t i, j, n = 0;
+    int nthreads, ret;
+    static char *kwlist[] = {"root", "namespace", "threads", NULL};
+
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O&|yO", kwlist,
+                                     PyUnicode_FSConverter, &root_obj, &ns,
+                                     &threads_obj))
+        return NULL;
+    if(tree_threads_arg(threads_obj, &nthreads) < 0)
+        goto free_root;
+    if((ctxs = PyMem_Calloc((size_t) nthreads, sizeof(merkle_ctx_t))) ==
+       NULL) {
+        PyErr_NoMemory();
+        goto free_root;
+    }
+    for(i = 0; i < (size_t) nthreads; i++)
+        ctxs[i].ns = ns;
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = tree_pwalk(PyBytes_AS_STRING(root_obj), nthreads, merkle_item,
+                     ctxs, sizeof(merkle_ctx_t), &err);
+    if(ret == 0) {
+        for(i = 0; i < (size_t) nthreads; i++)
+            n += ctxs[i].ndirs;
+        if((dirs = PyMem_RawMalloc((n + 1) * sizeof(merkle_dir_t *))) ==
+           NULL) {
+            ret = tree_fail(&err, ENOMEM, NULL);
+        } else {
+            for(i = 0, n = 0; i < (size_t) nthreads; i++)
+                for(j = 0; j < ctxs[i].ndirs; j++)
+                    dirs[n++] = &ctxs[i].dirs[j];
+            qsort(dirs, n, sizeof(merkle_dir_t *), merkle_cmp_dirs);
+            if(n > 0)
+                merkle_combine(dirs, n, 0);
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        tree_raise(&err);
+        goto free_ctxs;
+    }
+    if((res = PyDict_New()) == NULL)
+        goto free_ctxs;
+    for(i = 0; i < n; i++) {
+        PyObject *key = PyBytes_FromString(dirs[i]->path);
+        if(key == NULL ||
+           (value = PyLong_FromUnsignedLongLong(dirs[i]->hash)) == NULL) {
+            Py_XDECREF(key);
+            Py_CLEAR(res);
+            break;
+        }
+        ret = PyDict_SetItem(res, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if(ret < 0) {
+            Py_CLEAR(res);
+            break;
+        }
+    }
+
+ free_ctxs:
+    PyMem_RawFree(dirs);
+    for(i = 0; i < (size_t) nthreads; i++) {
+        attr_scratch_free(&ctxs[i].sc);
+        PyMem_RawFree(ctxs[i].files);
+        PyMem_RawFree(ctxs[i].names);
+        for(j = 0; j < ctxs[i].ndirs; j++)
+            PyMem_RawFree(ctxs[i].dirs[j].path);
+        PyMem_RawFree(ctxs[i].dirs);
+    }
+    PyMem_Free(ctxs);
+ free_root:
+    Py_DECREF(root_obj);
+
+    /* Return the result */
+    return res;
+}
+
+/* Attribute index support.
+ *
+ * An index file is meant to be memory-mapped: it consists of a header
+ * followed by fixed-size, naturally aligned tables (in native byte
+ * order), and a final blob holding all the strings:
+ *
+ * - paths: the indexed items (relative to the root), by id
+ * - names: the distinct attribute names, sorted bytewise; each points
+ *   to a contiguous range in the values table
+ * - values: the distinct values of each name, sorted by hash, each
+ *   pointing to its posting list
+ * - postings: the path ids for each (name, value) pair, ascending
+ * - attrs: for each path, the ids of the values it has
+ *
+ * Index files are not portable across architectures.
+ *
+ * The header also records a watermark, slightly before the time the
+ * walk started: since any attribute change bumps the ctime of the
+ * item, an item whose ctime is unchanged and older than the watermark
+ * can be carried over by an incremental update without reading its
+ * attributes again.
+ */
+
+#define INDEX_MAGIC "PYXINDEX"
+#define INDEX_VERSION 2
+/* Safety margin for the watermark, covering coarse ctime clocks */
+#define INDEX_WATERMARK_MARGIN 1
+#define INDEX_BOM 0x01020304U
+
+typedef struct {
+    char magic[8];
+    uint32_t bom;
+    uint32_t version;
+    uint64_t npaths, nnames, nvalues, npostings, nattrs;
+    uint64_t paths_off, names_off, values_off, postings_off, attrs_off;
+    uint64_t strings_off, strings_len;
+    uint64_t root_off, root_len;
+    uint64_t ns_off, ns_len;
+    int64_t watermark_sec;
+    int64_t watermark_nsec;
+} index_header_t;
+
+typedef struct {
+    uint64_t off;
+    uint64_t ino;
+    int64_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t len;
+    uint64_t first_attr;
+    uint32_t nattrs;
+    uint32_t reserved;
+} index_path_t;
+
+typedef struct {
+    uint64_t off;
+    uint64_t first_value;
+    uint32_t len;
+    uint32_t nvalues;
+} index_name_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t off;
+    uint64_t first_posting;
+    uint32_t len;
+    uint32_t npostings;
+} index_value_t;
+
+/* A mapped index file */
+typedef struct {
+    char *map;
+    size_t size;
+    const index_header_t *hdr;
+    const index_path_t *paths;
+    const index_name_t *names;
+    const index_value_t *values;
+    const uint32_t *postings;
+    const uint32_t *attrs;
+    const char *strings;
+} index_map_t;
+
+#define INDEX_CORRUPTED "corrupted xattr index"
+
+#if defined(__APPLE__)
+#define ST_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+#else
+#define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#endif
+
+/* Checks that a table fits in the mapped file */
+static int index_table_ok(const index_map_t *m, uint64_t off, uint64_t n,
+                          size_t elem) {
+    return off % (elem < 8 ? elem : 8) == 0 && off <= m->size &&
+        n <= (m->size - off) / elem;
+}
+
+/* Returns a pointer to a string from the blob, or NULL if the
+   reference is invalid */
+static const char *index_map_string(const index_map_t *m, uint64_t off,
+                                    uint64_t len) {
+    if(off > m->hdr->strings_len || len > m->hdr->strings_len - off)
+        return NULL;
+    return m->strings + off;
+}
+
+static void index_map_close(index_map_t *m) {
+    if(m->map != NULL) {
+        munmap(m->map, m->size);
+        m->map = NULL;
+    }
+}
+
+/* Maps and validates an index file; doesn't need the GIL */
+static int index_map_open(index_map_t *m, const char *path,
+                          tree_error_t *err) {
+    const index_header_t *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) == -1)
+        return tree_fail(err, errno, path);
+    if(fstat(fd, &st) == -1) {
+        close(fd);
+        return tree_fail(err, errno, path);
+    }
+    if((size_t) st.st_size < sizeof(index_header_t)) {
+        close(fd);
+        return tree_fail_msg(err, "not an xattr index");
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return tree_fail(err, errno, path);
+    m->map = map;
+    m->size = (size_t) st.st_size;
+    m->hdr = hdr = map;
+    if(memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+       hdr->bom != INDEX_BOM || hdr->version != INDEX_VERSION) {
+        index_map_close(m);
+        return tree_fail_msg(err, "not an xattr index, or written by an"
+                             " incompatible version or architecture");
+    }
+    if(!index_table_ok(m, hdr->paths_off, hdr->npaths,
+                       sizeof(index_path_t)) ||
+       !index_table_ok(m, hdr->names_off, hdr->nnames,
+                       sizeof(index_name_t)) ||
+       !index_table_ok(m, hdr->values_off, hdr->nvalues,
+                       sizeof(index_value_t)) ||
+       !index_table_ok(m, hdr->postings_off, hdr->npostings,
+                       sizeof(uint32_t)) ||
+       !index_table_ok(m, hdr->attrs_off, hdr->nattrs, sizeof(uint32_t)) ||
+       hdr->strings_off > m->size ||
+       hdr->strings_len > m->size - hdr->strings_off) {
+        index_map_close(m);
+        return tree_fail_msg(err, INDEX_CORRUPTED);
+    }
+    m->paths = (const index_path_t *) (m->map + hdr->paths_off);
+    m->names = (const index_name_t *) (m->map + hdr->names_off);
+    m->values = (const index_value_t *) (m->map + hdr->values_off);
+    m->postings = (const uint32_t *) (m->map + hdr->postings_off);
+    m->attrs = (const uint32_t *) (m->map + hdr->attrs_off);
+    m->strings = m->map + hdr->strings_off;
+    return 0;
+}
+
+/* Index builder: names and values are interned in hash tables, with
+   their bytes kept in a single arena, which becomes the strings blob
+   of the index. */
+
+typedef struct {
+    uint64_t hash;
+    uint64_t off;
+    uint32_t len;
+    uint32_t group;     /* the name id, for values */
+    uint32_t *post;
+    uint32_t npost, post_alloc;
+} ib_str_t;
+
+typedef struct {
+    ib_str_t *items;
+    size_t count, alloc;
+    uint32_t *slots;    /* id + 1 of the item in each slot, 0 for empty */
+    size_t nslots;
+} ib_table_t;
+
+typedef struct {
+    char *strings;
+    size_t strings_len, strings_alloc;
+    ib_table_t names, values;
+    index_path_t *paths;
+    size_t npaths, paths_alloc;
+    uint32_t *attrs;    /* the value ids of each path, in path order */
+    size_t nattrs, attrs_alloc;
+    uint64_t npostings;
+    const char *ns;
+    char *buf_list, *buf_val;
+    size_t size_list, size_val;
+    struct timespec watermark;
+    /* The previous index, for incremental updates */
+    index_map_t *old;
+    uint32_t *old_slots;
+    size_t old_nslots;
+} index_builder_t;
+
+static int ib_add_string(index_builder_t *b, const char *data, size_t len,
+                         uint64_t *off, tree_error_t *err) {
+    if(b->strings_len + len > b->strings_alloc || b->strings == NULL) {
+        size_t nalloc = (b->strings_len + len) * 2 + 4096;
+        char *tmp = PyMem_RawRealloc(b->strings, nalloc);
+        if(tmp == NULL)
+            return tree_fail(err, ENOMEM, NULL);
+        b->strings = tmp;
+        b->strings_alloc = nalloc;
+    }
+    memcpy(b->strings + b->strings_len, data, len);
+    *off = b->strings_len;
+    b->strings_len += len;
+    return 0;
+}
+
+static size_t ib_slot(uint64_t hash, uint32_t group, size_t nslots) {
+    return (size_t) ((hash ^ (group * 0x9e3779b97f4a7c15ULL)) &
+                     (nslots - 1));
+}
+
+/* Returns the id of the given string in the table, adding it if
+   needed */
+static int ib_intern(index_builder_t *b, ib_table_t *t, const char *data,
+                     size_t len, uint32_t group, uint32_t *id,
+                     tree_error_t *err) {
+    uint64_t hash = xattr_hash(data, len, XATTR_HASH_INIT);
+    size_t i;
+    ib_str_t *item;
+
+    /* Keep the load factor under 1/2 */
+    if((t->count + 1) * 2 > t->nslots) {
+        size_t nslots = t->nslots == 0 ? 1024 : t->nslots * 2, j;
+        uint32_t *slots = PyMem_RawCalloc(nslots, sizeof(uint32_t));
+        if(slots == NULL)
+            return tree_fail(err, ENOMEM, NULL);
+        for(j = 0; j < t->count; j++) {
+            i = ib_slot(t->items[j].hash, t->items[j].group, nslots);
+            while(slots[i] != 0)
+                i = (i + 1) & (nslots - 1);
+            slots[i] = (uint32_t) j + 1;
+        }
+        PyMem_RawFree(t->slots);
+        t->slots = slots;
+        t->nslots = nslots;
+    }
+    i = ib_slot(hash, group, t->nslots);
+    while(t->slots[i] != 0) {
+        item = &t->items[t->slots[i] - 1];
+        if(item->hash == hash && item->group == group && item->len == len &&
+           !memcmp(b->strings + item->off, data, len)) {
+            *id = t->slots[i] - 1;
+            return 0;
+        }
+        i = (i + 1) & (t->nslots - 1);
+    }
+    if(t->count >= UINT32_MAX - 1 || len > UINT32_MAX)
+        return tree_fail(err, EOVERFLOW, NULL);
+    if(tree_reserve((void **) &t->items, t->count, &t->alloc,
+                    sizeof(ib_str_t), err) < 0)
+        return -1;
+    item = &t->items[t->count];
+    memset(item, 0, sizeof(*item));
+    if(ib_add_string(b, data, len, &item->off, err) < 0)
+        return -1;
+    item->hash = hash;
+    item->len = (uint32_t) len;
+    item->group = group;
+    *id = (uint32_t) t->count;
+    t->slots[i] = (uint32_t) ++t->count;
+    return 0;
+}
+
+static void ib_table_free(ib_table_t *t) {
+    size_t i;
+    for(i = 0; i < t->count; i++)
+        PyMem_RawFree(t->items[i].post);
+    PyMem_RawFree(t->items);
+    PyMem_RawFree(t->slots);
+}
+
+static void index_builder_free(index_builder_t *b) {
+    ib_table_free(&b->names);
+    ib_table_free(&b->values);
+    PyMem_RawFree(b->strings);
+    PyMem_RawFree(b->paths);
+    PyMem_RawFree(b->attrs);
+    PyMem_RawFree(b->old_slots);
+    PyMem_RawFree(b->buf_list);
+    PyMem_RawFree(b->buf_val);
+}
+
+/* Records a (name, value) pair for the given path id */
+static int ib_add_pair(index_builder_t *b, const char *name, size_t name_len,
+                       const char *value, size_t value_len, uint32_t path_id,
+                       tree_error_t *err) {
+    uint32_t name_id, value_id;
+    ib_str_t *v;
+    size_t post_alloc;
+
+    if(ib_intern(b, &b->names, name, name_len, 0, &name_id, err) < 0 ||
+       ib_intern(b, &b->values, value, value_len, name_id, &value_id,
+                 err) < 0)
+        return -1;
+    v = &b->values.items[value_id];
+    post_alloc = v->post_alloc;
+    if(tree_reserve((void **) &v->post, v->npost, &post_alloc,
+                    sizeof(uint32_t), err) < 0)
+        return -1;
+    v->post_alloc = (uint32_t) post_alloc;
+    v->post[v->npost++] = path_id;
+    b->npostings++;
+    if(tree_reserve((void **) &b->attrs, b->nattrs, &b->attrs_alloc,
+                    sizeof(uint32_t), err) < 0)
+        return -1;
+    b->attrs[b->nattrs++] = value_id;
+    b->paths[path_id].nattrs++;
+    return 0;
+}
+
+/* Adds a new path entry, returning its id */
+static int ib_add_path(index_builder_t *b, const char *rel,
+                       const struct stat *st, uint32_t *id,
+                       tree_error_t *err) {
+    index_path_t *p;
+    size_t len = strlen(rel);
+    if(b->npaths >= UINT32_MAX || len > UINT32_MAX)
+        return tree_fail(err, EOVERFLOW, NULL);
+    if(tree_reserve((void **) &b->paths, b->npaths, &b->paths_alloc,
+                    sizeof(index_path_t), err) < 0)
+        return -1;
+    p = &b->paths[b->npaths];
+    memset(p, 0, sizeof(*p));
+    if(ib_add_string(b, rel, len, &p->off, err) < 0)
+        return -1;
+    p->len = (uint32_t) len;
+    p->ino = (uint64_t) st->st_ino;
+    p->ctime_sec = (int64_t) st->st_ctime;
+    p->ctime_nsec = (uint32_t) ST_CTIME_NSEC(st);
+    p->first_attr = b->nattrs;
+    *id = (uint32_t) b->npaths++;
+    return 0;
+}
+
+/* Incremental updates: the paths of the previous index are looked up
+   by their relative name via a hash table of path ids */
+
+static int ib_old_open(index_builder_t *b, index_map_t *old,
+                       const char *root, const char *path) {
+    const index_header_t *hdr;
+    const char *s;
+    tree_error_t ignored = {0, NULL, NULL};
+    size_t i, j, nslots;
+
+    if(index_map_open(old, path, &ignored) < 0) {
+        /* A missing or unusable index means a full rebuild */
+        PyMem_RawFree(ignored.path);
+        return 0;
+    }
+    hdr = old->hdr;
+    s = index_map_string(old, hdr->root_off, hdr->root_len);
+    if(s == NULL || hdr->root_len != strlen(root) ||
+       memcmp(s, root, hdr->root_len))
+        goto mismatch;
+    s = index_map_string(old, hdr->ns_off, hdr->ns_len);
+    if(s == NULL ||
+       hdr->ns_len != (b->ns == NULL ? 0 : strlen(b->ns)) ||
+       (hdr->ns_len > 0 && memcmp(s, b->ns, hdr->ns_len)))
+        goto mismatch;
+    if(hdr->npaths >= UINT32_MAX / 2)
+        goto mismatch;
+    for(nslots = 16; nslots < hdr->npaths * 2; nslots *= 2);
+    if((b->old_slots = PyMem_RawCalloc(nslots, sizeof(uint32_t))) == NULL)
+        goto mismatch;
+    b->old_nslots = nslots;
+    for(i = 0; i < hdr->npaths; i++) {
+        const index_path_t *op = &old->paths[i];
+        if((s = index_map_string(old, op->off, op->len)) == NULL)
+            continue;
+        j = (size_t) xattr_hash(s, op->len, XATTR_HASH_INIT) & (nslots - 1);
+        while(b->old_slots[j] != 0)
+            j = (j + 1) & (nslots - 1);
+        b->old_slots[j] = (uint32_t) i + 1;
+    }
+    b->old = old;
+    return 0;
+
+ mismatch:
+    index_map_close(old);
+    return 0;
+}
+
+/* Returns the previous entry for the given relative path, or NULL */
+static const index_path_t *ib_old_find(index_builder_t *b, const char *rel) {
+    size_t len = strlen(rel), j;
+    const char *s;
+
+    j = (size_t) xattr_hash(rel, len, XATTR_HASH_INIT) & (b->old_nslots - 1);
+    while(b->old_slots[j] != 0) {
+        const index_path_t *op = &b->old->paths[b->old_slots[j] - 1];
+        s = index_map_string(b->old, op->off, op->len);
+        if(op->len == len && !memcmp(s, rel, len))
+            return op;
+        j = (j + 1) & (b->old_nslots - 1);
+    }
+    return NULL;
+}
+
+/* Checks whether an item is unchanged since the previous index was
+   built; its ctime must predate the watermark of that build, since
+   any later change might have been missed by it */
+static int ib_old_unchanged(index_builder_t *b, const index_path_t *op,
+                            const struct stat *st) {
+    const index_header_t *hdr = b->old->hdr;
+    int64_t sec = (int64_t) st->st_ctime;
+    int64_t nsec = (int64_t) ST_CTIME_NSEC(st);
+
+    if(sec > hdr->watermark_sec ||
+       (sec == hdr->watermark_sec && nsec >= hdr->watermark_nsec))
+        return 0;
+    return op->ino == (uint64_t) st->st_ino && op->ctime_sec == sec &&
+        op->ctime_nsec == (uint32_t) nsec;
+}
+
+/* Copies the attributes of an unchanged item from the previous index;
+   returns 1 if done, 0 if the old entry is unusable */
+static int ib_old_copy(index_builder_t *b, const index_path_t *op,
+                       tree_path_t *p, const struct stat *st,
+                       tree_error_t *err) {
+    const index_map_t *m = b->old;
+    const index_header_t *hdr = m->hdr;
+    uint32_t path_id;
+    uint64_t i;
+
+    if(op->nattrs == 0 || op->first_attr > hdr->nattrs ||
+       op->nattrs > hdr->nattrs - op->first_attr)
+        return 0;
+    /* Validate everything first, so that no partial entry is added */
+    for(i = op->first_attr; i < op->first_attr + op->nattrs; i++)
+        if(m->attrs[i] >= hdr->nvalues ||
+           index_map_string(m, m->values[m->attrs[i]].off,
+                            m->values[m->attrs[i]].len) == NULL)
+            return 0;
+    if(ib_add_path(b, tree_relpath(p), st, &path_id, err) < 0)
+        return -1;
+    for(i = op->first_attr; i < op->first_attr + op->nattrs; i++) {
+        const index_value_t *v = &m->values[m->attrs[i]];
+        const index_name_t *n = NULL;
+        size_t lo = 0, hi = hdr->nnames;
+        /* Find the name owning the value, via its value range */
+        while(lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if(m->names[mid].first_value > m->attrs[i])
+                hi = mid;
+            else if(m->names[mid].first_value + m->names[mid].nvalues <=
+                    m->attrs[i])
+                lo = mid + 1;
+            else {
+                n = &m->names[mid];
+                break;
+            }
+        }
+        if(n == NULL || index_map_string(m, n->off, n->len) == NULL)
+            return tree_fail_msg(err, INDEX_CORRUPTED);
+        if(ib_add_pair(b, m->strings + n->off, n->len, m->strings + v->off,
+                       v->len, path_id, err) < 0)
+            return -1;
+    }
+    return 1;
+}
+
+static int index_item(void *data, tree_path_t *p, const struct stat *st,
+                      int post, tree_error_t *err) {
+    index_builder_t *b = data;
+    target_t tgt;
+    ssize_t nlist, nval;
+    const char *s;
+    uint32_t path_id = 0;
+    int added = 0;
+
+    if(post)
+        return 0;
+    if(b->old != NULL) {
+        /* Items absent from the previous index are always read: an old
+           ctime doesn't prove they had no attributes, since they might
+           have been moved here with a renamed parent directory, which
+           leaves their ctime untouched */
+        const index_path_t *op = ib_old_find(b, tree_relpath(p));
+        if(op != NULL && ib_old_unchanged(b, op, st)) {
+            int ret = ib_old_copy(b, op, p, st, err);
+            if(ret != 0)
+                return ret < 0 ? -1 : 0;
+        }
+    }
+    tgt.type = T_LINK;
+    tgt.name = p->buf;
+    tgt.tmp = NULL;
+    nlist = _generic_get_raw(&tgt, NULL, &b->buf_list, &b->size_list);
+    if(nlist == -1) {
+        if(errno == ENOENT || errno == ENOTSUP || errno == EOPNOTSUPP)
+            return 0;
+        return tree_fail(err, errno, p->buf);
+    }
+    for(s = b->buf_list; s - b->buf_list < nlist; s += strlen(s) + 1) {
+        if(matches_ns(b->ns, s) == NULL)
+            continue;
+        nval = _generic_get_raw(&tgt, s, &b->buf_val, &b->size_val);
+        if(nval == -1) {
+            if(errno == XATTR_ENOATTR)
+                continue;
+            return tree_fail(err, errno, p->buf);
+        }
+        if(!added) {
+            if(ib_add_path(b, tree_relpath(p), st, &path_id, err) < 0)
+                return -1;
+            added = 1;
+        }
+        if(ib_add_pair(b, s, strlen(s), b->buf_val, (size_t) nval, path_id,
+                       err) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *data;
+    uint64_t hash;
+    uint32_t len;
+    uint32_t rank;    /* for values, the rank of their name */
+    uint32_t id;
+} ib_sort_t;
+
+static int ib_cmp_bytes(const ib_sort_t *a, const ib_sort_t *b) {
+    int r = memcmp(a->data, b->data, a->len < b->len ? a->len : b->len);
+    if(r != 0)
+        return r;
+    return a->len < b->len ? -1 : a->len > b->len;
+}
+
+static int ib_cmp_names(const void *x, const void *y) {
+    return ib_cmp_bytes(x, y);
+}
+
+static int ib_cmp_values(const void *x, const void *y) {
+    const ib_sort_t *a = x, *b = y;
+    if(a->rank != b->rank)
+        return a->rank < b->rank ? -1 : 1;
+    if(a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    return ib_cmp_bytes(a, b);
+}
+
+static int ib_cmp_u32(const void *x, const void *y) {
+    uint32_t a = *(const uint32_t *) x, b = *(const uint32_t *) y;
+    return a < b ? -1 : a > b;
+}
+
+/* Writes the index to the given file descriptor */
+static int index_write(index_builder_t *b, const char *root, int fd,
+                       tree_error_t *err) {
+    index_header_t hdr;
+    snap_writer_t w;
+    ib_sort_t *names = NULL, *values = NULL;
+    uint32_t *rank = NULL, *value_pos = NULL;
+    size_t i;
+    uint64_t first;
+    int ret = -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(&w, 0, sizeof(w));
+    w.fd = fd;
+    hdr.root_len = strlen(root);
+    hdr.ns_len = b->ns == NULL ? 0 : strlen(b->ns);
+    if(ib_add_string(b, root, hdr.root_len, &hdr.root_off, err) < 0 ||
+       ib_add_string(b, b->ns, hdr.ns_len, &hdr.ns_off, err) < 0)
+        return -1;
+
+    names = PyMem_RawMalloc((b->names.count + 1) * sizeof(ib_sort_t));
+    values = PyMem_RawMalloc((b->values.count + 1) * sizeof(ib_sort_t));
+    rank = PyMem_RawMalloc((b->names.count + 1) * sizeof(uint32_t));
+    value_pos = PyMem_RawMalloc((b->values.count + 1) * sizeof(uint32_t));
+    w.buf = PyMem_RawMalloc(SNAPSHOT_BUFSIZE);
+    if(names == NULL || values == NULL || rank == NULL || value_pos == NULL ||
+       w.buf == NULL) {
+        tree_fail(err, ENOMEM, NULL);
+        goto out;
     }
-    bufsize = (size_t) bufsize_s;
 
-    if(convert_obj(myarg, &tgt, nofollow) < 0) {
-        res = NULL;
-        goto free_arg;
+    /* Sort the names bytewise, and the values by name, then hash */
+    for(i = 0; i < b->names.count; i++) {
+        ib_str_t *n = &b->names.items[i];
+        names[i].data = b->strings + n->off;
+        names[i].len = n->len;
+        names[i].id = (uint32_t) i;
+    }
+    qsort(names, b->names.count, sizeof(ib_sort_t), ib_cmp_names);
+    for(i = 0; i < b->names.count; i++)
+        rank[names[i].id] = (uint32_t) i;
+    for(i = 0; i < b->values.count; i++) {
+        ib_str_t *v = &b->values.items[i];
+        values[i].data = b->strings + v->off;
+        values[i].len = v->len;
+        values[i].hash = v->hash;
+        values[i].rank = rank[v->group];
+        values[i].id = (uint32_t) i;
+        /* Postings are added in path order, except for duplicate
+           paths from races; sort them anyway */
+        qsort(v->post, v->npost, sizeof(uint32_t), ib_cmp_u32);
+    }
+    qsort(values, b->values.count, sizeof(ib_sort_t), ib_cmp_values);
+    for(i = 0; i < b->values.count; i++)
+        value_pos[values[i].id] = (uint32_t) i;
+    /* The per-path attributes refer to the final value positions */
+    for(i = 0; i < b->nattrs; i++)
+        b->attrs[i] = value_pos[b->attrs[i]];
+
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.bom = INDEX_BOM;
+    hdr.version = INDEX_VERSION;
+    hdr.npaths = b->npaths;
+    hdr.nnames = b->names.count;
+    hdr.nvalues = b->values.count;
+    hdr.npostings = b->npostings;
+    hdr.nattrs = b->nattrs;
+    hdr.watermark_sec = (int64_t) b->watermark.tv_sec;
+    hdr.watermark_nsec = (int64_t) b->watermark.tv_nsec;
+    hdr.paths_off = sizeof(hdr);
+    hdr.names_off = hdr.paths_off + hdr.npaths * sizeof(index_path_t);
+    hdr.values_off = hdr.names_off + hdr.nnames * sizeof(index_name_t);
+    hdr.postings_off = hdr.values_off + hdr.nvalues * sizeof(index_value_t);
+    hdr.attrs_off = hdr.postings_off + hdr.npostings * sizeof(uint32_t);
+    hdr.strings_off = hdr.attrs_off + hdr.nattrs * sizeof(uint32_t);
+    hdr.strings_len = b->strings_len;
+
+    if(snap_write(&w, &hdr, sizeof(hdr), err) < 0 ||
+       snap_write(&w, b->paths, b->npaths * sizeof(index_path_t), err) < 0)
+        goto out;
+    /* Names, with their value ranges */
+    for(i = 0, first = 0; i < b->names.count; i++) {
+        index_name_t e;
+        ib_str_t *n = &b->names.items[names[i].id];
+        memset(&e, 0, sizeof(e));
+        e.off = n->off;
+        e.len = n->len;
+        e.first_value = first;
+        while(first < b->values.count && values[first].rank == i)
+            first++;
+        e.nvalues = (uint32_t) (first - e.first_value);
+        if(snap_write(&w, &e, sizeof(e), err) < 0)
+            goto out;
     }
+    /* Values, with their posting ranges */
+    for(i = 0, first = 0; i < b->values.count; i++) {
+        index_value_t e;
+        ib_str_t *v = &b->values.items[values[i].id];
+        memset(&e, 0, sizeof(e));
+        e.hash = v->hash;
+        e.off = v->off;
+        e.len = v->len;
+        e.first_posting = first;
+        e.npostings = v->npost;
+        first += v->npost;
+        if(snap_write(&w, &e, sizeof(e), err) < 0)
+            goto out;
+    }
+    for(i = 0; i < b->values.count; i++) {
+        ib_str_t *v = &b->values.items[values[i].id];
+        if(snap_write(&w, v->post, v->npost * sizeof(uint32_t), err) < 0)
+            goto out;
+    }
+    if(snap_write(&w, b->attrs, b->nattrs * sizeof(uint32_t), err) < 0 ||
+       snap_write(&w, b->strings, b->strings_len, err) < 0 ||
+       snap_flush(&w, err) < 0)
+        goto out;
+    ret = 0;
+
+ out:
+    PyMem_RawFree(names);
+    PyMem_RawFree(values);
+    PyMem_RawFree(rank);
+    PyMem_RawFree(value_pos);
+    PyMem_RawFree(w.buf);
+    return ret;
+}
 
-    if(merge_ns(ns, attrname, &full_name, &newname) < 0) {
-        res = NULL;
-        goto free_arg;
+/* Writes an index to a temporary file, and atomically renames it into
+   place */
+static int index_save(index_builder_t *b, const char *root,
+                      const char *path, tree_error_t *err) {
+    size_t len = strlen(path);
+    char *tmp_path;
+    int fd, ret;
+
+    if((tmp_path = PyMem_RawMalloc(len + 5)) == NULL)
+        return tree_fail(err, ENOMEM, NULL);
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+    if((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        ret = tree_fail(err, errno, tmp_path);
+        goto out;
     }
+    ret = index_write(b, root, fd, err);
+    /* Make sure the data is on disk before it replaces the old index */
+    if(ret == 0 && fsync(fd) == -1)
+        ret = tree_fail(err, errno, tmp_path);
+    if(close(fd) == -1 && ret == 0)
+        ret = tree_fail(err, errno, tmp_path);
+    if(ret == 0 && rename(tmp_path, path) == -1)
+        ret = tree_fail(err, errno, path);
+    if(ret < 0)
+        unlink(tmp_path);
+ out:
+    PyMem_RawFree(tmp_path);
+    return ret;
+}
 
-    /* Set the attribute's value */
-    nret = _set_obj(&tgt, full_name, buf, bufsize, flags);
+static char __index_build_doc__[] =
+    "build(root, path[, namespace=None, incremental=False])\n"
+    "Build an index of the extended attributes of a tree.\n"
+    "\n"
+    "The tree is walked natively (without following symbolic links),\n"
+    "and an index mapping each (name, value) pair to the items having\n"
+    "it is written to the given path (via a temporary file, which is\n"
+    "then renamed into place). The index can be then queried,\n"
+    "without touching the indexed tree, via :func:`open`.\n"
+    "\n"
+    "With *incremental*, an existing index at *path* (for the same root\n"
+    "and namespace) is used to refresh it: the whole tree is still\n"
+    "walked (sequentially), but the attributes of items whose inode and\n"
+    "change time are the same as recorded, and whose change time is\n"
+    "older than the start of the previous build, are copied from it\n"
+    "instead of being read again; items not recorded (e.g. moved along\n"
+    "with a renamed directory) are always read, and items no longer\n"
+    "found by the walk are dropped. Since setting or removing\n"
+    "attributes updates the change time, this finds all changes,\n"
+    "except on filesystems or tools that forge change times.\n"
+    "If the index is missing or unusable, a full build is done.\n"
+    "\n"
+    "Example:\n"
+    "\n"
+    "    >>> xattr.index.build('/srv/data', '/var/cache/data.idx')\n"
+    "    1234\n"
+    "\n"
+    ":param root: the root of the tree to index; paths are recorded\n"
+    "    relative to it\n"
+    ":type root: str, bytes or path-like object\n"
+    ":param path: the index file to write\n"
+    ":type path: str, bytes or path-like object\n"
+    ":keyword namespace: if given, only attributes in this namespace\n"
+    "    are indexed; names are always recorded in full\n"
+    ":type namespace: bytes\n"
+    ":keyword incremental: refresh the existing index, if possible\n"
+    ":type incremental: bool\n"
+    ":returns: the number of items indexed (those having attributes)\n"
+    ":rtype: int\n"
+    ":raises EnvironmentError: caused by any system errors\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
 
-    PyMem_Free(newname);
+static PyObject *
+xattr_index_build(PyObject *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *root_obj = NULL, *path_obj = NULL, *res = NULL;
+    const char *ns = NULL;
+    int incremental = 0;
+    index_builder_t b;
+    index_map_t old;
+    tree_path_t path;
+    tree_error_t err = {0, NULL, NULL};
+    int ret;
+    static char *kwlist[] = {"root", "path", "namespace", "incremental",
+                             NULL};
 
-    free_tgt(&tgt);
+    /* Parse the arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O&O&|yp", kwlist,
+                                     PyUnicode_FSConverter, &root_obj,
+                                     PyUnicode_FSConverter, &path_obj, &ns,
+                                     &incremental))
+        goto free_args;
 
-    if(nret == -1) {
-        res = PyErr_SetFromErrno(PyExc_IOError);
-        goto free_arg;
-    }
+    memset(&b, 0, sizeof(b));
+    memset(&old, 0, sizeof(old));
+    b.ns = ns;
+    path.buf = NULL;
 
-    Py_INCREF(Py_None);
-    res = Py_None;
+    Py_BEGIN_ALLOW_THREADS;
+    /* Changes after this point might be missed by the walk, so the next
+       incremental update must re-read items changed since */
+    clock_gettime(CLOCK_REALTIME, &b.watermark);
+    b.watermark.tv_sec -= INDEX_WATERMARK_MARGIN;
+    if(incremental)
+        ib_old_open(&b, &old, PyBytes_AS_STRING(root_obj),
+                    PyBytes_AS_STRING(path_obj));
+    ret = tree_path_init(&path, PyBytes_AS_STRING(root_obj), &err);
+    if(ret == 0)
+        ret = tree_walk(&path, index_item, &b, &err, 1);
+    if(ret == 0)
+        ret = index_save(&b, PyBytes_AS_STRING(root_obj),
+                         PyBytes_AS_STRING(path_obj), &err);
+    /* The old file is replaced by now, but its mapping is still valid */
+    index_map_close(&old);
+    index_builder_free(&b);
+    PyMem_RawFree(path.buf);
+    Py_END_ALLOW_THREADS;
 
- free_arg:
-    PyMem_Free(attrname);
-    PyMem_Free(buf);
+    if(ret < 0)
+        tree_raise(&err);
+    else
+        res = PyLong_FromSize_t(b.npaths);
+
+ free_args:
+    Py_XDECREF(root_obj);
+    Py_XDECREF(path_obj);
 
     /* Return the result */
     return res;
 }
 
+typedef struct {
+    PyObject_HEAD
+    index_map_t m;
+} IndexObject;
 
-static char __pyremovexattr_doc__[] =
-    "removexattr(item, name[, nofollow])\n"
-    "Remove an attribute from a file (deprecated).\n"
-    "\n"
-    ITEM_DOC
-    NAME_REMOVE_DOC
-    NOFOLLOW_DOC
+static int index_check_open(IndexObject *self) {
+    if(self->m.map == NULL) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed index");
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns a new bytes object for a string from the blob */
+static PyObject *index_string(IndexObject *self, uint64_t off, uint64_t len) {
+    const char *data = index_map_string(&self->m, off, len);
+    if(data == NULL) {
+        PyErr_SetString(PyExc_ValueError, INDEX_CORRUPTED);
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize(data, (Py_ssize_t) len);
+}
+
+static int index_cmp(IndexObject *self, uint64_t off, uint32_t len,
+                     const char *data, size_t data_len, int *res) {
+    const char *s = index_map_string(&self->m, off, len);
+    int r;
+    if(s == NULL) {
+        PyErr_SetString(PyExc_ValueError, INDEX_CORRUPTED);
+        return -1;
+    }
+    r = memcmp(s, data, len < data_len ? len : data_len);
+    if(r == 0)
+        r = len < data_len ? -1 : len > data_len;
+    *res = r;
+    return 0;
+}
+
+/* Finds a name by binary search; returns its entry, or NULL (with or
+   without an exception set) */
+static const index_name_t *index_find_name(IndexObject *self,
+                                           const char *name, size_t len) {
+    uint64_t lo = 0, hi = self->m.hdr->nnames;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int r;
+        if(index_cmp(self, self->m.names[mid].off, self->m.names[mid].len,
+                     name, len, &r) < 0)
+            return NULL;
+        if(r == 0)
+            return &self->m.names[mid];
+        if(r < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* Returns the value range of a name, validating it */
+static int index_value_range(IndexObject *self, const index_name_t *n,
+                             uint64_t *first, uint64_t *last) {
+    if(n->first_value > self->m.hdr->nvalues ||
+       n->nvalues > self->m.hdr->nvalues - n->first_value) {
+        PyErr_SetString(PyExc_ValueError, INDEX_CORRUPTED);
+        return -1;
+    }
+    *first = n->first_value;
+    *last = n->first_value + n->nvalues;
+    return 0;
+}
+
+/* Appends the paths of a value's posting list to a list */
+static int index_add_postings(IndexObject *self, const index_value_t *v,
+                              PyObject *list) {
+    uint64_t i;
+    if(v->first_posting > self->m.hdr->npostings ||
+       v->npostings > self->m.hdr->npostings - v->first_posting) {
+        PyErr_SetString(PyExc_ValueError, INDEX_CORRUPTED);
+        return -1;
+    }
+    for(i = v->first_posting; i < v->first_posting + v->npostings; i++) {
+        uint32_t id = self->m.postings[i];
+        PyObject *path;
+        int ret;
+        if(id >= self->m.hdr->npaths) {
+            PyErr_SetString(PyExc_ValueError, INDEX_CORRUPTED);
+            return -1;
+        }
+        if((path = index_string(self, self->m.paths[id].off,
+                                self->m.paths[id].len)) == NULL)
+            return -1;
+        ret = PyList_Append(list, path);
+        Py_DECREF(path);
+        if(ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static char __index_query_doc__[] =
+    "query(name[, value=None])\n"
+    "Return the items having a given attribute.\n"
     "\n"
-    ".. deprecated:: 0.4\n"
-    "   this function has been deprecated by the :func:`remove` function.\n"
+    ":param name: the (full) attribute name\n"
+    ":type name: bytes or str\n"
+    ":param value: if given, only items where the attribute has this\n"
+    "    value are returned\n"
+    ":type value: bytes or str\n"
+    ":returns: the matching paths, relative to the indexed root, in\n"
+    "    sorted order\n"
+    ":rtype: list[bytes]\n"
     ;
 
-/* Wrapper for removexattr */
 static PyObject *
-pyremovexattr(PyObject *self, PyObject *args)
+index_query(IndexObject *self, PyObject *args, PyObject *keywds)
 {
-    PyObject *myarg, *res;
-    int nofollow = 0;
-    char *attrname = NULL;
-    int nret;
-    target_t tgt;
-
-    /* Parse the arguments */
-    if (!PyArg_ParseTuple(args, "Oet|i", &myarg, NULL, &attrname, &nofollow))
+    PyObject *name_arg, *value_arg = Py_None;
+    PyObject *name = NULL, *value = NULL, *res = NULL;
+    const index_name_t *n;
+    uint64_t first, last, i;
+    static char *kwlist[] = {"name", "value", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|O", kwlist,
+                                     &name_arg, &value_arg))
+        return NULL;
+    if((name = convert_bytes(name_arg)) == NULL)
         return NULL;
+    if(value_arg != Py_None && (value = convert_bytes(value_arg)) == NULL)
+        goto out;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(index_check_open(self) < 0 || (res = PyList_New(0)) == NULL)
+        goto unlock;
+    n = index_find_name(self, PyBytes_AS_STRING(name),
+                        (size_t) PyBytes_GET_SIZE(name));
+    if(n == NULL) {
+        if(PyErr_Occurred())
+            Py_CLEAR(res);
+        goto unlock;
+    }
+    if(index_value_range(self, n, &first, &last) < 0) {
+        Py_CLEAR(res);
+        goto unlock;
+    }
+    if(value != NULL) {
+        /* Binary search for the first value with the same hash */
+        size_t vlen = (size_t) PyBytes_GET_SIZE(value);
+        uint64_t hash = xattr_hash(PyBytes_AS_STRING(value), vlen,
+                                   XATTR_HASH_INIT);
+        uint64_t lo = first, hi = last;
+        while(lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if(self->m.values[mid].hash < hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        first = lo;
+        for(i = first; i < last && self->m.values[i].hash == hash; i++) {
+            int r;
+            if(index_cmp(self, self->m.values[i].off, self->m.values[i].len,
+                         PyBytes_AS_STRING(value), vlen, &r) < 0) {
+                Py_CLEAR(res);
+                goto unlock;
+            }
+            if(r == 0) {
+                if(index_add_postings(self, &self->m.values[i], res) < 0)
+                    Py_CLEAR(res);
+                break;
+            }
+        }
+    } else {
+        for(i = first; i < last; i++) {
+            if(index_add_postings(self, &self->m.values[i], res) < 0) {
+                Py_CLEAR(res);
+                break;
+            }
+        }
+    }
+    /* Postings are in walk order, which isn't meaningful */
+    if(res != NULL && PyList_Sort(res) < 0)
+        Py_CLEAR(res);
+ unlock:
+    Py_END_CRITICAL_SECTION();
+
+ out:
+    Py_DECREF(name);
+    Py_XDECREF(value);
+    return res;
+}
 
-    if(convert_obj(myarg, &tgt, nofollow) < 0) {
-        res = NULL;
-        goto free_arg;
+static char __index_names_doc__[] =
+    "names()\n"
+    "Return all the attribute names present in the index, sorted.\n"
+    "\n"
+    ":rtype: list[bytes]\n"
+    ;
+
+static PyObject *
+index_names(IndexObject *self, PyObject *unused)
+{
+    PyObject *res = NULL;
+    uint64_t i;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(index_check_open(self) < 0 ||
+       (res = PyList_New((Py_ssize_t) self->m.hdr->nnames)) == NULL)
+        goto unlock;
+    for(i = 0; i < self->m.hdr->nnames; i++) {
+        PyObject *name = index_string(self, self->m.names[i].off,
+                                      self->m.names[i].len);
+        if(name == NULL) {
+            Py_CLEAR(res);
+            break;
+        }
+        PyList_SET_ITEM(res, (Py_ssize_t) i, name);
     }
+ unlock:
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
 
-    /* Remove the attribute */
-    nret = _remove_obj(&tgt, attrname);
+static char __index_values_doc__[] =
+    "values(name)\n"
+    "Return the distinct values of an attribute present in the index.\n"
+    "\n"
+    ":param name: the (full) attribute name\n"
+    ":type name: bytes or str\n"
+    ":rtype: list[bytes]\n"
+    ;
 
-    free_tgt(&tgt);
+static PyObject *
+index_values(IndexObject *self, PyObject *name_arg)
+{
+    PyObject *name, *res = NULL;
+    const index_name_t *n;
+    uint64_t first, last, i;
 
-    if(nret == -1) {
-        res = PyErr_SetFromErrno(PyExc_IOError);
-        goto free_arg;
+    if((name = convert_bytes(name_arg)) == NULL)
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(index_check_open(self) < 0 || (res = PyList_New(0)) == NULL)
+        goto unlock;
+    n = index_find_name(self, PyBytes_AS_STRING(name),
+                        (size_t) PyBytes_GET_SIZE(name));
+    if(n == NULL) {
+        if(PyErr_Occurred())
+            Py_CLEAR(res);
+        goto unlock;
+    }
+    if(index_value_range(self, n, &first, &last) < 0) {
+        Py_CLEAR(res);
+        goto unlock;
+    }
+    for(i = first; i < last; i++) {
+        PyObject *value = index_string(self, self->m.values[i].off,
+                                       self->m.values[i].len);
+        int ret = value == NULL ? -1 : PyList_Append(res, value);
+        Py_XDECREF(value);
+        if(ret < 0) {
+            Py_CLEAR(res);
+            break;
+        }
     }
+ unlock:
+    Py_END_CRITICAL_SECTION();
+    Py_DECREF(name);
+    return res;
+}
 
-    Py_INCREF(Py_None);
-    res = Py_None;
+static PyObject *
+index_close(IndexObject *self, PyObject *unused)
+{
+    Py_BEGIN_CRITICAL_SECTION(self);
+    index_map_close(&self->m);
+    Py_END_CRITICAL_SECTION();
+    Py_RETURN_NONE;
+}
 
- free_arg:
-    PyMem_Free(attrname);
+static PyObject *
+index_enter(IndexObject *self, PyObject *unused)
+{
+    if(index_check_open(self) < 0)
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
 
-    /* Return the result */
+static PyObject *
+index_exit(IndexObject *self, PyObject *args)
+{
+    return index_close(self, NULL);
+}
+
+static Py_ssize_t
+index_len(IndexObject *self)
+{
+    Py_ssize_t res = -1;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(index_check_open(self) == 0)
+        res = (Py_ssize_t) self->m.hdr->npaths;
+    Py_END_CRITICAL_SECTION();
     return res;
 }
 
-static char __remove_doc__[] =
-    "remove(item, name[, nofollow=False, namespace=None])\n"
-    "Remove an attribute from a file.\n"
+static PyObject *
+index_get_root(IndexObject *self, void *closure)
+{
+    PyObject *res = NULL;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(index_check_open(self) == 0)
+        res = index_string(self, self->m.hdr->root_off, self->m.hdr->root_len);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static void
+index_dealloc(IndexObject *self)
+{
+    index_map_close(&self->m);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyMethodDef index_object_methods[] = {
+    {"query", (PyCFunction) index_query, METH_VARARGS | METH_KEYWORDS,
+     __index_query_doc__ },
+    {"names", (PyCFunction) index_names, METH_NOARGS, __index_names_doc__ },
+    {"values", (PyCFunction) index_values, METH_O, __index_values_doc__ },
+    {"close", (PyCFunction) index_close, METH_NOARGS,
+     "close()\nUnmap the index; further queries will fail.\n" },
+    {"__enter__", (PyCFunction) index_enter, METH_NOARGS, NULL },
+    {"__exit__", (PyCFunction) index_exit, METH_VARARGS, NULL },
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyGetSetDef index_getset[] = {
+    {"root", (getter) index_get_root, NULL,
+     "The root of the indexed tree (bytes).", NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PySequenceMethods index_as_sequence = {
+    .sq_length = (lenfunc) index_len,
+};
+
+static char __index_type_doc__[] =
+    "A memory-mapped, read-only attribute index.\n"
+    "\n"
+    "Instances are returned by :func:`xattr.index.open`; the length of\n"
+    "an index is the number of items it contains. Indexes can be used\n"
+    "as context managers, closing them on exit.\n"
+    ;
+
+static PyTypeObject IndexType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "xattr.index.Index",
+    .tp_basicsize = sizeof(IndexObject),
+    .tp_dealloc = (destructor) index_dealloc,
+    .tp_as_sequence = &index_as_sequence,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = __index_type_doc__,
+    .tp_methods = index_object_methods,
+    .tp_getset = index_getset,
+};
+
+static char __index_open_doc__[] =
+    "open(path)\n"
+    "Open an index written by :func:`build`.\n"
+    "\n"
+    "The index is memory-mapped, so opening it is cheap, and queries\n"
+    "only touch the parts of the index they need.\n"
     "\n"
     "Example:\n"
     "\n"
-    "    >>> xattr.remove('/path/to/file', 'user.comment')\n"
+    "    >>> with xattr.index.open('/var/cache/data.idx') as idx:\n"
+    "    ...     idx.query('user.retention', 'legal-hold')\n"
+    "    [b'contracts/2019/acme.pdf']\n"
     "\n"
-    ITEM_DOC
-    NAME_REMOVE_DOC
-    NOFOLLOW_DOC
-    NS_DOC
-    ":returns: None\n"
+    ":param path: the index file\n"
+    ":type path: str, bytes or path-like object\n"
+    ":rtype: Index\n"
     ":raises EnvironmentError: caused by any system errors\n"
+    ":raises ValueError: if the file is not a valid index\n"
+    "\n"
+    ".. versionadded:: 0.9\n"
+    ;
+
+static PyObject *
+xattr_index_open(PyObject *self, PyObject *args)
+{
+    PyObject *path_obj = NULL;
+    IndexObject *idx;
+    tree_error_t err = {0, NULL, NULL};
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &path_obj))
+        return NULL;
+
+    if((idx = PyObject_New(IndexObject, &IndexType)) == NULL)
+        goto out;
+    idx->m.map = NULL;
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = index_map_open(&idx->m, PyBytes_AS_STRING(path_obj), &err);
+    Py_END_ALLOW_THREADS;
+
+    if(ret < 0) {
+        tree_raise(&err);
+        Py_CLEAR(idx);
+    }
+
+ out:
+    Py_DECREF(path_obj);
+    return (PyObject *) idx;
+}
+
+static PyMethodDef xattr_index_methods[] = {
+    {"build",  (PyCFunction) xattr_index_build, METH_VARARGS | METH_KEYWORDS,
+     __index_build_doc__ },
+    {"open",  xattr_index_open, METH_VARARGS, __index_open_doc__ },
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static char __xattr_index_doc__[] =
+    "Persistent, memory-mapped index of the extended attributes of a\n"
+    "tree, answering queries such as \"which files have\n"
+    "``user.retention`` set to ``legal-hold``?\" without touching the\n"
+    "filesystem.\n"
+    ;
+
+/* Drop-in replacements for the os module's xattr functions, with the
+ * same signatures and semantics (str names, follow_symlinks, OSError
+ * with the path as filename), but using this module's read paths.
+ */
+
+/* Builds the target for an os-style path argument: an int is a file
+ * descriptor, anything else a path, possibly relative to dir_fd.
+ * Linux resolves dir_fd-relative paths through /proc/self/fd, since
+ * there are no *at() variants of the xattr syscalls. */
+static int compat_target(const char *func, PyObject *path, int follow,
+                         PyObject *dir_fd_obj, target_t *tgt) {
+    int dir_fd = -1;
+
+    tgt->tmp = NULL;
+    if(dir_fd_obj != Py_None) {
+        if((dir_fd = PyObject_AsFileDescriptor(dir_fd_obj)) == -1)
+            return -1;
+    }
+    if(PyLong_Check(path)) {
+        if(dir_fd != -1) {
+            PyErr_Format(PyExc_ValueError,
+                         "%s: can't specify both dir_fd and fd", func);
+            return -1;
+        }
+        if(!follow) {
+            PyErr_Format(PyExc_ValueError, "%s: cannot use fd and "
+                         "follow_symlinks together", func);
+            return -1;
+        }
+        if((tgt->fd = PyObject_AsFileDescriptor(path)) == -1)
+            return -1;
+        tgt->type = T_FD;
+        return 0;
+    }
+    if(!PyUnicode_FSConverter(path, &tgt->tmp))
+        return -1;
+    tgt->type = follow ? T_PATH : T_LINK;
+    tgt->name = PyBytes_AS_STRING(tgt->tmp);
+    if(dir_fd != -1 && tgt->name[0] != '/') {
+#ifdef __linux__
+        PyObject *full = PyBytes_FromFormat("/proc/self/fd/%d/%s", dir_fd,
+                                            tgt->name);
+        Py_CLEAR(tgt->tmp);
+        if(full == NULL)
+            return -1;
+        tgt->tmp = full;
+        tgt->name = PyBytes_AS_STRING(full);
+#else
+        Py_CLEAR(tgt->tmp);
+        PyErr_Format(PyExc_NotImplementedError,
+                     "%s: dir_fd unavailable on this platform", func);
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+/* Replaces the exception of a failed I/O call with one naming the path */
+static void compat_error(int io_errno, PyObject *path) {
+    if(io_errno == 0)
+        return;
+    PyErr_Clear();
+    errno = io_errno;
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+}
+
+/* Parses the arguments of the (vectorcall) os_compat functions into
+ * out, by position or keyword; arguments after the first npos are
+ * keyword-only, the first nreq are required, and the others are left
+ * untouched if not given. These calls are cheap enough that building
+ * an argument tuple (and a dict for keywords) would be a large part
+ * of their cost.
+ */
+static int compat_parse(const char *func, PyObject *const *args,
+                        Py_ssize_t nargs, PyObject *kwnames,
+                        const char *const *names, Py_ssize_t nreq,
+                        Py_ssize_t npos, PyObject **out) {
+    Py_ssize_t i, j, nkw = kwnames == NULL ? 0 : PyTuple_GET_SIZE(kwnames);
+
+    if(nargs > npos) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd positional "
+                     "arguments (%zd given)", func, npos, nargs);
+        return -1;
+    }
+    for(i = 0; i < nargs; i++)
+        out[i] = args[i];
+    for(i = 0; i < nkw; i++) {
+        PyObject *key = PyTuple_GET_ITEM(kwnames, i);
+        for(j = 0; names[j] != NULL; j++)
+            if(PyUnicode_CompareWithASCIIString(key, names[j]) == 0)
+                break;
+        if(names[j] == NULL) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword "
+                         "argument '%U'", func, key);
+            return -1;
+        }
+        if(j < nargs) {
+            PyErr_Format(PyExc_TypeError, "%s() got multiple values for "
+                         "argument '%s'", func, names[j]);
+            return -1;
+        }
+        out[j] = args[nargs + i];
+    }
+    for(i = 0; i < nreq; i++)
+        if(out[i] == NULL) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument "
+                         "'%s'", func, names[i]);
+            return -1;
+        }
+    return 0;
+}
+
+/* Converts the optional follow_symlinks argument */
+static int compat_follow(PyObject *obj) {
+    return obj == NULL ? 1 : PyObject_IsTrue(obj);
+}
+
+static char __compat_getxattr_doc__[] =
+    "getxattr(path, attribute, *, follow_symlinks=True, dir_fd=None)\n"
+    "Return the value of an extended attribute, as :func:`os.getxattr`.\n"
     "\n"
-    ".. versionadded:: 0.4\n"
-    NS_CHANGED_DOC
+    "Unlike :func:`os.getxattr`, *dir_fd* is supported (on Linux).\n"
     ;
 
-/* Wrapper for removexattr */
 static PyObject *
-xattr_remove(PyObject *self, PyObject *args, PyObject *keywds)
+compat_getxattr(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                PyObject *kwnames)
 {
-    PyObject *myarg, *res;
-    int nofollow = 0;
-    char *attrname = NULL, *name_buf;
-    const char *ns = NULL;
-    const char *full_name;
-    int nret;
+    PyObject *argv[4] = {NULL, NULL, NULL, Py_None};
+    PyObject *attr = NULL, *res = NULL;
+    int follow, io_errno;
     target_t tgt;
-    static char *kwlist[] = {"item", "name", "nofollow", "namespace", NULL};
+    static const char *const names[] = {"path", "attribute",
+                                        "follow_symlinks", "dir_fd", NULL};
 
-    /* Parse the arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "Oet|iy", kwlist,
-                                     &myarg, NULL, &attrname, &nofollow, &ns))
+    if(compat_parse("getxattr", args, nargs, kwnames, names, 2, 2, argv) < 0
+       || (follow = compat_follow(argv[2])) < 0
+       || !PyUnicode_FSConverter(argv[1], &attr))
         return NULL;
-
-    if(convert_obj(myarg, &tgt, nofollow) < 0) {
-        res = NULL;
-        goto free_arg;
-    }
-
-    if(merge_ns(ns, attrname, &full_name, &name_buf) < 0) {
-        res = NULL;
-        goto free_arg;
-    }
-
-    /* Remove the attribute */
-    nret = _remove_obj(&tgt, full_name);
-
-    PyMem_Free(name_buf);
-
+    if(compat_target("getxattr", argv[0], follow, argv[3], &tgt) < 0)
+        goto out;
+    if((res = _get_bytes(&tgt, PyBytes_AS_STRING(attr), &io_errno)) == NULL)
+        compat_error(io_errno, argv[0]);
     free_tgt(&tgt);
-
-    if(nret == -1) {
-        res = PyErr_SetFromErrno(PyExc_IOError);
-        goto free_arg;
-    }
-
-    Py_INCREF(Py_None);
-    res = Py_None;
-
- free_arg:
-    PyMem_Free(attrname);
-
-    /* Return the result */
+ out:
+    Py_DECREF(attr);
     return res;
 }
 
-static char __pylistxattr_doc__[] =
-    "listxattr(item[, nofollow=False])\n"
-    "Return the list of attribute names for a file (deprecated).\n"
-    "\n"
-    ITEM_DOC
-    NOFOLLOW_DOC
-    "\n"
-    ".. deprecated:: 0.4\n"
-    "   this function has been deprecated by the :func:`list` function.\n"
+static char __compat_setxattr_doc__[] =
+    "setxattr(path, attribute, value, flags=0, *, follow_symlinks=True,\n"
+    "         dir_fd=None)\n"
+    "Set an extended attribute, as :func:`os.setxattr`.\n"
     ;
 
-/* Wrapper for listxattr */
 static PyObject *
-pylistxattr(PyObject *self, PyObject *args)
+compat_setxattr(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                PyObject *kwnames)
 {
-    char *buf = NULL;
-    int nofollow = 0;
-    ssize_t nret;
-    size_t nalloc = 0;
-    PyObject *myarg;
-    PyObject *mylist;
-    Py_ssize_t nattrs;
-    char *s;
+    PyObject *argv[6] = {NULL, NULL, NULL, NULL, NULL, Py_None};
+    PyObject *attr = NULL, *res = NULL;
+    Py_buffer value;
+    int flags = 0, follow, nret;
     target_t tgt;
+    static const char *const names[] = {"path", "attribute", "value",
+                                        "flags", "follow_symlinks",
+                                        "dir_fd", NULL};
 
-    /* Parse the arguments */
-    if (!PyArg_ParseTuple(args, "O|i", &myarg, &nofollow))
+    if(compat_parse("setxattr", args, nargs, kwnames, names, 3, 4, argv) < 0
+       || (follow = compat_follow(argv[4])) < 0)
         return NULL;
-    if(convert_obj(myarg, &tgt, nofollow) < 0)
+    if(argv[3] != NULL) {
+        long l = PyLong_AsLong(argv[3]);
+        if(l == -1 && PyErr_Occurred())
+            return NULL;
+        if(l < INT_MIN || l > INT_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "flags out of range");
+            return NULL;
+        }
+        flags = (int) l;
+    }
+    if(!PyUnicode_FSConverter(argv[1], &attr))
+        return NULL;
+    if(PyObject_GetBuffer(argv[2], &value, PyBUF_SIMPLE) < 0) {
+        Py_DECREF(attr);
         return NULL;
-
-    nret = _generic_get(_list_obj, &tgt, NULL, &buf, &nalloc, NULL);
-    if (nret == -1) {
-      mylist = NULL;
-      goto free_buf;
     }
-
-    /* Compute the number of attributes in the list */
-    for(s = buf, nattrs = 0; (s - buf) < nret; s += strlen(s) + 1) {
-        nattrs++;
+    if(compat_target("setxattr", argv[0], follow, argv[5], &tgt) < 0)
+        goto out;
+    nret = _set_obj(&tgt, PyBytes_AS_STRING(attr), value.buf,
+                    (size_t) value.len, flags);
+    if(nret == -1) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, argv[0]);
+    } else {
+        Py_INCREF(Py_None);
+        res = Py_None;
     }
+    free_tgt(&tgt);
+ out:
+    PyBuffer_Release(&value);
+    Py_DECREF(attr);
+    return res;
+}
 
-    /* Create the list which will hold the result */
-    mylist = PyList_New(nattrs);
-    if(mylist == NULL) {
-      goto free_buf;
-    }
+static char __compat_removexattr_doc__[] =
+    "removexattr(path, attribute, *, follow_symlinks=True, dir_fd=None)\n"
+    "Remove an extended attribute, as :func:`os.removexattr`.\n"
+    ;
 
-    /* Create and insert the attributes as strings in the list */
-    for(s = buf, nattrs = 0; s - buf < nret; s += strlen(s) + 1) {
-        PyObject *item = PyBytes_FromString(s);
-        if(item == NULL) {
-            Py_DECREF(mylist);
-            mylist = NULL;
-            goto free_buf;
-        }
-        PyList_SET_ITEM(mylist, nattrs, item);
-        nattrs++;
-    }
+static PyObject *
+compat_removexattr(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                   PyObject *kwnames)
+{
+    PyObject *argv[4] = {NULL, NULL, NULL, Py_None};
+    PyObject *attr = NULL, *res = NULL;
+    int follow, nret;
+    target_t tgt;
+    static const char *const names[] = {"path", "attribute",
+                                        "follow_symlinks", "dir_fd", NULL};
 
- free_buf:
-    /* Free the buffer, now it is no longer needed */
-    PyMem_Free(buf);
+    if(compat_parse("removexattr", args, nargs, kwnames, names, 2, 2,
+                    argv) < 0
+       || (follow = compat_follow(argv[2])) < 0
+       || !PyUnicode_FSConverter(argv[1], &attr))
+        return NULL;
+    if(compat_target("removexattr", argv[0], follow, argv[3], &tgt) < 0)
+        goto out;
+    nret = _remove_obj(&tgt, PyBytes_AS_STRING(attr));
+    if(nret == -1) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, argv[0]);
+    } else {
+        Py_INCREF(Py_None);
+        res = Py_None;
+    }
     free_tgt(&tgt);
-
-    /* Return the result */
-    return mylist;
+ out:
+    Py_DECREF(attr);
+    return res;
 }
 
-static char __list_doc__[] =
-    "list(item[, nofollow=False, namespace=None])\n"
-    "Return the list of attribute names for a file.\n"
-    "\n"
-    "Example:\n"
-    "\n"
-    "    >>> xattr.list('/path/to/file')\n"
-    "    [b'user.test', b'user.comment', b'system.posix_acl_access']\n"
-    "    >>> xattr.list('/path/to/file', namespace=xattr.NS_USER)\n"
-    "    [b'test', b'comment']\n"
-    "\n"
-    ITEM_DOC
-    NOFOLLOW_DOC
-    NS_DOC
-    ":returns: the list of attributes; note that if a namespace \n"
-    "    argument was passed, it (and the separator) will be stripped\n"
-    "    from the names\n"
-    "    returned\n"
-    ":rtype: list[bytes]\n"
-    ":raises EnvironmentError: caused by any system errors\n"
-    "\n"
-    ".. versionadded:: 0.4\n"
-    NS_CHANGED_DOC
+static char __compat_listxattr_doc__[] =
+    "listxattr(path=None, *, follow_symlinks=True, dir_fd=None)\n"
+    "Return the extended attribute names (as str), as\n"
+    ":func:`os.listxattr`; *path* defaults to the current directory.\n"
     ;
 
-/* Wrapper for listxattr */
 static PyObject *
-xattr_list(PyObject *self, PyObject *args, PyObject *keywds)
+compat_listxattr(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                 PyObject *kwnames)
 {
+    PyObject *argv[3] = {Py_None, NULL, Py_None};
+    PyObject *path, *res = NULL, *item, *dot = NULL;
+    char small[ESTIMATE_ATTR_SIZE];
     char *buf = NULL;
-    int nofollow = 0;
-    ssize_t nret;
+    const char *data, *s;
     size_t nalloc = 0;
-    PyObject *myarg;
-    PyObject *res;
-    const char *ns = NULL;
-    Py_ssize_t nattrs;
-    char *s;
+    ssize_t nret;
+    int follow, io_errno;
     target_t tgt;
-    static char *kwlist[] = {"item", "nofollow", "namespace", NULL};
+    static const char *const names[] = {"path", "follow_symlinks",
+                                        "dir_fd", NULL};
 
-    /* Parse the arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|iy", kwlist,
-                                     &myarg, &nofollow, &ns))
+    if(compat_parse("listxattr", args, nargs, kwnames, names, 0, 1,
+                    argv) < 0
+       || (follow = compat_follow(argv[1])) < 0)
         return NULL;
-    res = NULL;
-    if(convert_obj(myarg, &tgt, nofollow) < 0) {
-        goto free_arg;
-    }
-    nret = _generic_get(_list_obj, &tgt, NULL, &buf, &nalloc, NULL);
-    if (nret == -1) {
-      goto free_tgt;
+    path = argv[0];
+    if(path == Py_None) {
+        if((dot = PyUnicode_FromString(".")) == NULL)
+            return NULL;
+        path = dot;
     }
-
-    /* Compute the number of attributes in the list */
-    for(s = buf, nattrs = 0; (s - buf) < nret; s += strlen(s) + 1) {
-        if(matches_ns(ns, s) != NULL)
-            nattrs++;
-    }
-
-    /* Create the list which will hold the result */
-    if((res = PyList_New(nattrs)) == NULL) {
+    if(compat_target("listxattr", path, follow, argv[2], &tgt) < 0)
+        goto out;
+    nret = _get_small(_list_obj, &tgt, NULL, small, &data, &buf, &nalloc,
+                      &io_errno);
+    if(nret == -1) {
+        compat_error(io_errno, path);
         goto free_buf;
     }
-
-    /* Create and insert the attributes as strings in the list */
-    for(s = buf, nattrs = 0; s - buf < nret; s += strlen(s) + 1) {
-        const char *name = matches_ns(ns, s);
-        if(name != NULL) {
-            PyObject *item = PyBytes_FromString(name);
-            if(item == NULL) {
-                Py_DECREF(res);
-                res = NULL;
-                goto free_buf;
-            }
-            PyList_SET_ITEM(res, nattrs, item);
-            nattrs++;
+    if((res = PyList_New(0)) == NULL)
+        goto free_buf;
+    for(s = data; s - data < nret; s += strlen(s) + 1) {
+        int ret;
+        if((item = name_to_str(s, (Py_ssize_t) strlen(s))) == NULL) {
+            Py_CLEAR(res);
+            break;
+        }
+        ret = PyList_Append(res, item);
+        Py_DECREF(item);
+        if(ret < 0) {
+            Py_CLEAR(res);
+            break;
         }
     }
-
  free_buf:
-    /* Free the buffer, now it is no longer needed */
     PyMem_Free(buf);
-
- free_tgt:
     free_tgt(&tgt);
- free_arg:
-
-    /* Return the result */
+ out:
+    Py_XDECREF(dot);
     return res;
 }
 
+static PyMethodDef xattr_os_compat_methods[] = {
+    {"getxattr",  (PyCFunction) (void (*)(void)) compat_getxattr,
+     METH_FASTCALL | METH_KEYWORDS, __compat_getxattr_doc__ },
+    {"setxattr",  (PyCFunction) (void (*)(void)) compat_setxattr,
+     METH_FASTCALL | METH_KEYWORDS, __compat_setxattr_doc__ },
+    {"listxattr",  (PyCFunction) (void (*)(void)) compat_listxattr,
+     METH_FASTCALL | METH_KEYWORDS, __compat_listxattr_doc__ },
+    {"removexattr",  (PyCFunction) (void (*)(void)) compat_removexattr,
+     METH_FASTCALL | METH_KEYWORDS, __compat_removexattr_doc__ },
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static char __xattr_os_compat_doc__[] =
+    "Drop-in replacements for :func:`os.getxattr`, :func:`os.setxattr`,\n"
+    ":func:`os.listxattr` and :func:`os.removexattr`, with the same\n"
+    "signatures and behaviour, but using this module's faster read\n"
+    "paths; switching is a matter of importing them from here::\n"
+    "\n"
+    "    from xattr.os_compat import getxattr, listxattr\n"
+    ;
+
 static PyMethodDef xattr_methods[] = {
     {"getxattr",  pygetxattr, METH_VARARGS, __pygetxattr_doc__ },
     {"get",  (PyCFunction) xattr_get, METH_VARARGS | METH_KEYWORDS,
      __get_doc__ },
     {"get_all", (PyCFunction) get_all, METH_VARARGS | METH_KEYWORDS,
      __get_all_doc__ },
+    {"stat_all", (PyCFunction) xattr_stat_all, METH_VARARGS | METH_KEYWORDS,
+     __stat_all_doc__ },
+    {"has", (PyCFunction) xattr_has, METH_VARARGS | METH_KEYWORDS,
+     __has_doc__ },
+    {"sizes", (PyCFunction) xattr_sizes, METH_VARARGS | METH_KEYWORDS,
+     __sizes_doc__ },
+    {"get_u64", (PyCFunction) xattr_get_u64, METH_VARARGS | METH_KEYWORDS,
+     __get_u64_doc__ },
+    {"get_str", (PyCFunction) xattr_get_str, METH_VARARGS | METH_KEYWORDS,
+     __get_str_doc__ },
+    {"get_struct", (PyCFunction) xattr_get_struct,
+     METH_VARARGS | METH_KEYWORDS, __get_struct_doc__ },
     {"setxattr",  pysetxattr, METH_VARARGS, __pysetxattr_doc__ },
     {"set",  (PyCFunction) xattr_set, METH_VARARGS | METH_KEYWORDS,
      __set_doc__ },
+    {"set_u64",  (PyCFunction) xattr_set_u64, METH_VARARGS | METH_KEYWORDS,
+     __set_u64_doc__ },
+    {"set_if_changed",  (PyCFunction) xattr_set_if_changed,
+     METH_VARARGS | METH_KEYWORDS, __set_if_changed_doc__ },
+    {"set_many",  (PyCFunction) xattr_set_many, METH_VARARGS | METH_KEYWORDS,
+     __set_many_doc__ },
     {"removexattr",  pyremovexattr, METH_VARARGS, __pyremovexattr_doc__ },
     {"remove",  (PyCFunction) xattr_remove, METH_VARARGS | METH_KEYWORDS,
      __remove_doc__ },
+    {"remove_many",  (PyCFunction) xattr_remove_many,
+     METH_VARARGS | METH_KEYWORDS, __remove_many_doc__ },
+    {"remove_all",  (PyCFunction) xattr_remove_all,
+     METH_VARARGS | METH_KEYWORDS, __remove_all_doc__ },
     {"listxattr",  pylistxattr, METH_VARARGS, __pylistxattr_doc__ },
     {"list",  (PyCFunction) xattr_list, METH_VARARGS | METH_KEYWORDS,
      __list_doc__ },
+    {"dump",  (PyCFunction) xattr_dump, METH_VARARGS | METH_KEYWORDS,
+     __dump_doc__ },
+    {"restore",  (PyCFunction) xattr_restore, METH_VARARGS | METH_KEYWORDS,
+     __restore_doc__ },
+    {"find",  (PyCFunction) xattr_find, METH_VARARGS | METH_KEYWORDS,
+     __find_doc__ },
+    {"fingerprint",  (PyCFunction) xattr_fingerprint,
+     METH_VARARGS | METH_KEYWORDS, __fingerprint_doc__ },
+    {"fingerprint_many",  (PyCFunction) xattr_fingerprint_many,
+     METH_VARARGS | METH_KEYWORDS, __fingerprint_many_doc__ },
+    {"diff",  (PyCFunction) xattr_diff, METH_VARARGS | METH_KEYWORDS,
+     __diff_doc__ },
+    {"diff_tree",  (PyCFunction) xattr_diff_tree,
+     METH_VARARGS | METH_KEYWORDS, __diff_tree_doc__ },
+    {"merkle",  (PyCFunction) xattr_merkle, METH_VARARGS | METH_KEYWORDS,
+     __merkle_doc__ },
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -1161,41 +7864,108 @@ static char __xattr_doc__[] = \
     "   - ``ENOSPC`` and ``EDQUOT`` are documented as meaning out of disk\n"
     "     space or out of disk space because of quota limits\n"
     ".. note:: Under Python 3, the namespace argument is a byte string,\n"
-    "   not a unicode string, and all return values are bytes, not strings.\n"
+    "   not a unicode string, and attribute names and values are returned\n"
+    "   as bytes, not strings; names are str only if ``names_as_str`` is\n"
+    "   given, and values only when decoded, e.g. by :func:`get_str` or a\n"
+    "   :class:`Schema`.\n"
     "\n"
     ;
 
-static struct PyModuleDef xattrmodule = {
-    PyModuleDef_HEAD_INIT,
-    "xattr",
-    __xattr_doc__,
-    0,
-    xattr_methods,
-};
-
-#define INITERROR return NULL
+/* Creates a submodule (registered in sys.modules, so that it can be
+   imported directly) and adds it to the module; returns a borrowed
+   reference. */
+static PyObject *
+add_submodule(PyObject *m, const char *name, PyMethodDef *methods,
+              const char *doc)
+{
+    PyObject *full_name, *sub;
+    int ret;
 
-PyMODINIT_FUNC
-PyInit_xattr(void)
+    if((full_name = PyUnicode_FromFormat("%s.%s", PyModule_GetName(m),
+                                         name)) == NULL)
+        return NULL;
+    sub = PyModule_NewObject(full_name);
+    ret = sub == NULL || PyModule_SetDocString(sub, doc) < 0 ||
+        PyModule_AddFunctions(sub, methods) < 0 ||
+        PyDict_SetItem(PyImport_GetModuleDict(), full_name, sub) < 0 ? -1 : 0;
+    Py_DECREF(full_name);
+    if(ret < 0 || PyModule_AddObject(m, name, sub) < 0) {
+        Py_XDECREF(sub);
+        return NULL;
+    }
+    return sub;
+}
 
+static int
+xattr_exec(PyObject *m)
 {
+    PyObject *index;
+
     PyObject *ns_security = NULL;
     PyObject *ns_system   = NULL;
     PyObject *ns_trusted  = NULL;
     PyObject *ns_user     = NULL;
-    PyObject *m = PyModule_Create(&xattrmodule);
-    if (m==NULL)
-        return NULL;
 
-    PyModule_AddStringConstant(m, "__author__", _XATTR_AUTHOR);
-    PyModule_AddStringConstant(m, "__contact__", _XATTR_EMAIL);
-    PyModule_AddStringConstant(m, "__version__", _XATTR_VERSION);
-    PyModule_AddStringConstant(m, "__license__",
-                               "GNU Lesser General Public License (LGPL)");
-    PyModule_AddStringConstant(m, "__docformat__", "restructuredtext en");
+    if(PyModule_AddStringConstant(m, "__author__", _XATTR_AUTHOR) < 0 ||
+       PyModule_AddStringConstant(m, "__contact__", _XATTR_EMAIL) < 0 ||
+       PyModule_AddStringConstant(m, "__version__", _XATTR_VERSION) < 0 ||
+       PyModule_AddStringConstant(m, "__license__",
+                                  "GNU Lesser General Public License (LGPL)") < 0 ||
+       PyModule_AddStringConstant(m, "__docformat__",
+                                  "restructuredtext en") < 0)
+        return -1;
+
+    if(PyModule_AddIntConstant(m, "XATTR_CREATE", XATTR_CREATE) < 0 ||
+       PyModule_AddIntConstant(m, "XATTR_REPLACE", XATTR_REPLACE) < 0)
+        return -1;
+
+    if(PyType_Ready(&InternTableType) < 0)
+        return -1;
+    Py_INCREF(&InternTableType);
+    if(PyModule_AddObject(m, "InternTable",
+                          (PyObject *) &InternTableType) < 0) {
+        Py_DECREF(&InternTableType);
+        return -1;
+    }
+
+    if(PyType_Ready(&SchemaType) < 0)
+        return -1;
+    Py_INCREF(&SchemaType);
+    if(PyModule_AddObject(m, "Schema", (PyObject *) &SchemaType) < 0) {
+        Py_DECREF(&SchemaType);
+        return -1;
+    }
+
+    if(PyType_Ready(&NameListType) < 0)
+        return -1;
+    Py_INCREF(&NameListType);
+    if(PyModule_AddObject(m, "NameList", (PyObject *) &NameListType) < 0) {
+        Py_DECREF(&NameListType);
+        return -1;
+    }
+
+    if(PyType_Ready(&XattrSetType) < 0 ||
+       PyType_Ready(&XattrSetIterType) < 0)
+        return -1;
+    Py_INCREF(&XattrSetType);
+    if(PyModule_AddObject(m, "XattrSet", (PyObject *) &XattrSetType) < 0) {
+        Py_DECREF(&XattrSetType);
+        return -1;
+    }
+
+    if(add_submodule(m, "os_compat", xattr_os_compat_methods,
+                     __xattr_os_compat_doc__) == NULL)
+        return -1;
 
-    PyModule_AddIntConstant(m, "XATTR_CREATE", XATTR_CREATE);
-    PyModule_AddIntConstant(m, "XATTR_REPLACE", XATTR_REPLACE);
+    if((index = add_submodule(m, "index", xattr_index_methods,
+                              __xattr_index_doc__)) == NULL ||
+       PyType_Ready(&IndexType) < 0)
+        return -1;
+    Py_INCREF(&IndexType);
+    if(PyModule_AddObject(index, "Index", (PyObject *) &IndexType) < 0) {
+        Py_DECREF(&IndexType);
+        return -1;
+    }
 
     /* namespace constants */
     if((ns_security = PyBytes_FromString("security")) == NULL)
@@ -1223,13 +7993,38 @@ PyInit_xattr(void)
         goto err_out;
     ns_user = NULL;
 
-    return m;
+    return 0;
 
  err_out:
     Py_XDECREF(ns_user);
     Py_XDECREF(ns_trusted);
     Py_XDECREF(ns_system);
     Py_XDECREF(ns_security);
-    Py_DECREF(m);
-    INITERROR;
+    return -1;
+}
+
+/* The module keeps no mutable global state (all I/O buffers are
+   per-call, and objects lock themselves), so it is safe to run without
+   the GIL on free-threaded builds. */
+static PyModuleDef_Slot xattr_slots[] = {
+    {Py_mod_exec, xattr_exec},
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef xattrmodule = {
+    PyModuleDef_HEAD_INIT,
+    "xattr",
+    __xattr_doc__,
+    0,
+    xattr_methods,
+    xattr_slots,
+};
+
+PyMODINIT_FUNC
+PyInit_xattr(void)
+{
+    return PyModuleDef_Init(&xattrmodule);
 }